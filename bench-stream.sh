@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# bench-stream.sh
+#
+# mp3nema - MP3 analysis and data hiding utility
+#
+# Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+#
+# bench-stream.sh is part of mp3nema.
+# mp3nema is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# mp3nema is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+#
+# Replays an mp3 through mp3nema-replay, listens with "mp3nema -s" and
+# compares the two: throughput, how long each injected OOB region took to be
+# detected, and how many bytes never made it through the analysis.
+#
+# Usage: bench-stream.sh file.mp3 [mp3nema-replay options]
+# e.g.   bench-stream.sh song.mp3 -r 0 -E 65536:64
+#        bench-stream.sh song.mp3 -r 4 -I -R -B 16384 -S 50 -O 100000:512
+#        MP3NEMA_OPTS="-I -D 50" bench-stream.sh song.mp3 -I -M 8192 -E 65536:64
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 file.mp3 [mp3nema-replay options]"
+    exit 1
+fi
+
+BIN=`dirname "$0"`
+FILE=$1
+shift
+PORT=${PORT:-8765}
+LOGS=`mktemp -d`
+
+"$BIN/mp3nema-replay" -p $PORT -n 1 -l "$LOGS/replay.log" "$@" "$FILE" \
+    > /dev/null &
+sleep 1
+"$BIN/mp3nema" -s $MP3NEMA_OPTS "http://127.0.0.1:$PORT/" > "$LOGS/client.log"
+wait
+
+# Join the records on the "OOB#<id>#" marker each injected region starts with
+awk '
+    function val(rec, key,    i, n, kv) {
+        n = split(rec, kv, " ")
+        for (i=1; i<=n; i++)
+          if (index(kv[i], key "=") == 1)
+            return substr(kv[i], length(key) + 2)
+        return ""
+    }
+    FNR == NR {
+        if ($1 == "oob")    { sent[val($0, "id")] = val($0, "sent"); ++n_sent }
+        if ($1 == "replay") { bytes_sent = val($0, "bytes") }
+        next
+    }
+    $1 == "oob" {
+        head = val($0, "head")
+        if (head ~ /^OOB#[0-9]+#/) {
+            split(head, m, "#")
+            if (m[2] in sent && !(m[2] in seen)) {
+                seen[m[2]] = 1
+                ms = (val($0, "time") - sent[m[2]]) * 1000
+                total_ms += ms
+                if (ms > max_ms)
+                  max_ms = ms
+                ++n_found
+            }
+        }
+    }
+    $1 == "stream" {
+        bytes = val($0, "bytes"); secs = val($0, "seconds")
+        rate = val($0, "bytes_per_sec"); dropped = val($0, "dropped")
+    }
+    END {
+        printf("bench bytes_sent=%d bytes_received=%d lost=%d dropped=%d " \
+               "seconds=%s bytes_per_sec=%s\n", bytes_sent, bytes,
+               bytes_sent - bytes + dropped, dropped, secs, rate)
+        printf("bench oob_sent=%d oob_detected=%d oob_missed=%d " \
+               "latency_avg_ms=%.3f latency_max_ms=%.3f\n", n_sent, n_found,
+               n_sent - n_found, (n_found) ? total_ms / n_found : 0, max_ms)
+    }
+' "$LOGS/replay.log" "$LOGS/client.log"
+
+rm -rf "$LOGS"
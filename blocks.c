@@ -0,0 +1,296 @@
+/******************************************************************************
+ * blocks.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * blocks.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#define _GNU_SOURCE /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "blocks.h"
+#include "pool.h"
+#include "utils.h"
+
+
+/* A block found while extracting */
+typedef struct _found_block_t
+{
+    uint32_t seq;
+    uint64_t offset;
+    uint32_t length;
+} found_block_t;
+
+
+/* State shared by the extraction workers */
+typedef struct _extract_t
+{
+    char            **fnames;
+    int               out_fd;
+    found_block_t    *blocks;
+    size_t            n_blocks;
+    size_t            alloc;
+    uint64_t          total;
+    long              n_bad;
+    pthread_mutex_t   lock;
+} extract_t;
+
+
+void block_write(
+    FILE          *src,
+    FILE          *out,
+    uint64_t       len,
+    block_state_t *state)
+{
+    off_t         start;
+    size_t        got;
+    uint32_t      crc, n;
+    unsigned char buf[COPY_BUF_SZ];
+
+    while (len)
+    {
+        n = (len < BLOCK_MAX_DATA) ? len : BLOCK_MAX_DATA;
+
+        /* Checksum the block's data, then go back and copy it */
+        start = ftello(src);
+        crc = 0;
+        for (got=0; got < n; got += sizeof(buf))
+          crc = util_crc32(crc, buf,
+                           fread(buf, 1, (n - got < sizeof(buf)) ?
+                                 n - got : sizeof(buf), src));
+        fseeko(src, start, SEEK_SET);
+
+        fprintf(out, BLOCK_MAGIC "%08" PRIX32 "%016" PRIX64 "%08" PRIX32
+                "%016" PRIX64 "%08" PRIX32, state->seq, state->offset, n,
+                state->total, crc);
+        util_copy_bytes(src, out, n);
+
+        ++state->seq;
+        state->offset += n;
+        len -= n;
+    }
+}
+
+
+/* Hex field of 'n' digits, returns 0 if any of them are not uppercase hex */
+static int parse_hex(const unsigned char *c, int n, uint64_t *value)
+{
+    *value = 0;
+    while (n--)
+    {
+        if (*c >= '0' && *c <= '9')
+          *value = (*value << 4) | (*c - '0');
+        else if (*c >= 'A' && *c <= 'F')
+          *value = (*value << 4) | (*c - 'A' + 10);
+        else
+          return 0;
+        ++c;
+    }
+
+    return 1;
+}
+
+
+static int parse_header(
+    const unsigned char *h,
+    uint32_t            *seq,
+    uint64_t            *offset,
+    uint32_t            *length,
+    uint64_t            *total,
+    uint32_t            *crc)
+{
+    uint64_t v[3];
+
+    h += BLOCK_MAGIC_SZ;
+    if (!parse_hex(h, 8, &v[0]) || !parse_hex(h + 8, 16, offset) ||
+        !parse_hex(h + 24, 8, &v[1]) || !parse_hex(h + 32, 16, total) ||
+        !parse_hex(h + 48, 8, &v[2]))
+      return 0;
+
+    *seq = v[0];
+    *length = v[1];
+    *crc = v[2];
+
+    return 1;
+}
+
+
+/* Find the blocks in one file and write their data where it belongs.  The
+ * whole file is searched rather than just its OOB regions: block data can
+ * contain something that looks like a frame, which would hide the headers
+ * that follow it from the scanner.  Checksums weed out any false matches.
+ */
+static void extract_file(void *job, void *arg, int worker)
+{
+    int                  have_prev;
+    size_t               size;
+    uint32_t             seq, prev_seq, length, crc;
+    uint64_t             pos, offset, total;
+    const char          *fname;
+    const unsigned char *data, *c;
+    extract_t           *ex = arg;
+
+    fname = ex->fnames[(intptr_t)job];
+    if (!util_map_file(fname, &data, &size))
+    {
+        ERR("Could not open '%s'\n", fname);
+        return;
+    }
+
+    have_prev = prev_seq = 0;
+    pos = 0;
+    while ((pos < size) &&
+           (c = memmem(data + pos, size - pos, BLOCK_MAGIC, BLOCK_MAGIC_SZ)))
+    {
+        pos = c - data;
+        if ((pos + BLOCK_HDR_SZ > size) ||
+            !parse_header(c, &seq, &offset, &length, &total, &crc) ||
+            (pos + BLOCK_HDR_SZ + length > size))
+        {
+            ++pos;
+            continue;
+        }
+
+        if (util_crc32(0, c + BLOCK_HDR_SZ, length) != crc)
+        {
+            printf(TAG " %s: block %" PRIu32 " at offset %" PRIu64
+                   " failed its checksum\n", fname, seq, pos);
+            pthread_mutex_lock(&ex->lock);
+            ++ex->n_bad;
+            pthread_mutex_unlock(&ex->lock);
+            ++pos;
+            continue;
+        }
+
+        /* Blocks in a file are sequential, say so as soon as one is not */
+        if (have_prev && (seq != prev_seq + 1))
+          printf(TAG " %s: gap between blocks %" PRIu32 " and %" PRIu32 "\n",
+                 fname, prev_seq, seq);
+        have_prev = 1;
+        prev_seq = seq;
+
+        if (pwrite(ex->out_fd, c + BLOCK_HDR_SZ, length, offset) !=
+            (ssize_t)length)
+          ERR("Could not write block %" PRIu32 "\n", seq);
+
+        pthread_mutex_lock(&ex->lock);
+        if (ex->n_blocks == ex->alloc)
+        {
+            ex->alloc = (ex->alloc) ? ex->alloc * 2 : DEFAULT_BLK_SZ;
+            ex->blocks = realloc(ex->blocks,
+                                 ex->alloc * sizeof(found_block_t));
+        }
+        ex->blocks[ex->n_blocks].seq = seq;
+        ex->blocks[ex->n_blocks].offset = offset;
+        ex->blocks[ex->n_blocks].length = length;
+        ++ex->n_blocks;
+        if (total > ex->total)
+          ex->total = total;
+        pthread_mutex_unlock(&ex->lock);
+
+        pos += BLOCK_HDR_SZ + length;
+    }
+
+    VERBOSE(TAG " %s: scanned\n", fname);
+    util_unmap_file(data, size);
+}
+
+
+static int cmp_block_offset(const void *a, const void *b)
+{
+    const found_block_t *x = a, *y = b;
+
+    if (x->offset != y->offset)
+      return (x->offset < y->offset) ? -1 : 1;
+    return 0;
+}
+
+
+int handle_as_framed_extract(
+    char  **fnames,
+    int     n_fnames,
+    flags_t flags,
+    int     n_workers)
+{
+    int        complete;
+    size_t     i;
+    uint64_t   covered, missing;
+    FILE      *out;
+    pool_t    *pool;
+    extract_t  ex;
+
+    if (!(out = util_create_file(fnames[0], "extracted-payload", "dat", 0)))
+      return 0;
+
+    memset(&ex, 0, sizeof(extract_t));
+    ex.fnames = fnames;
+    ex.out_fd = fileno(out);
+    pthread_mutex_init(&ex.lock, NULL);
+
+    /* Files can be handled in any order */
+    if (!(pool = pool_create(n_workers, 0, extract_file, &ex)))
+    {
+        util_close_file(out);
+        return 0;
+    }
+    for (i=0; i<n_fnames; i++)
+      pool_push(pool, (void *)(intptr_t)i);
+    pool_destroy(pool);
+
+    if (ftruncate(ex.out_fd, ex.total) == -1)
+      ERR("Could not size the extracted payload\n");
+
+    /* Anything missing? */
+    qsort(ex.blocks, ex.n_blocks, sizeof(found_block_t), cmp_block_offset);
+    covered = missing = 0;
+    for (i=0; i<ex.n_blocks; i++)
+    {
+        if (ex.blocks[i].offset > covered)
+        {
+            printf(TAG " Missing payload bytes %" PRIu64 " to %" PRIu64 "\n",
+                   covered, ex.blocks[i].offset - 1);
+            missing += ex.blocks[i].offset - covered;
+        }
+        if (ex.blocks[i].offset + ex.blocks[i].length > covered)
+          covered = ex.blocks[i].offset + ex.blocks[i].length;
+    }
+    if (covered < ex.total)
+    {
+        printf(TAG " Missing payload bytes %" PRIu64 " to %" PRIu64 "\n",
+               covered, ex.total - 1);
+        missing += ex.total - covered;
+    }
+
+    complete = ex.n_blocks && !missing && !ex.n_bad;
+    printf(TAG " Blocks: %zu (%ld bad)\n", ex.n_blocks, ex.n_bad);
+    printf(TAG " Payload: %" PRIu64 " bytes, %s\n", ex.total,
+           (complete) ? "complete" : "incomplete");
+
+    /* Clean */
+    free(ex.blocks);
+    pthread_mutex_destroy(&ex.lock);
+    util_close_file(out);
+
+    return complete;
+}
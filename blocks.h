@@ -0,0 +1,71 @@
+/******************************************************************************
+ * blocks.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * blocks.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef BLOCKS_H_INCLUDE
+#define BLOCKS_H_INCLUDE
+
+#include <stdio.h>
+#include <stdint.h>
+#include "main.h"
+
+
+/* Framed blocks: each block of injected data is preceded by a header written
+ * as uppercase hex digits, so it can never look like a sync frame, "ID3" or
+ * "TAG":
+ *     "MNB1" seq(8) offset(16) length(8) total(16) crc32(8)
+ * 'offset' is where the block's data belongs in the payload, 'total' is the
+ * size of the whole payload and 'crc32' covers the block's data.
+ */
+#define BLOCK_MAGIC     "MNB1"
+#define BLOCK_MAGIC_SZ  4
+#define BLOCK_HDR_SZ    (BLOCK_MAGIC_SZ + 8 + 16 + 8 + 16 + 8)
+#define BLOCK_MAX_DATA  0xFFFFFFFFu
+
+
+/* Where the next block of a payload being injected goes */
+typedef struct _block_state_t
+{
+    uint32_t seq;
+    uint64_t offset;
+    uint64_t total;
+} block_state_t;
+
+
+/* Write the next 'len' bytes of 'src' (which is left after them) to 'out' as
+ * one or more framed blocks.
+ */
+extern void block_write(
+    FILE          *src,
+    FILE          *out,
+    uint64_t       len,
+    block_state_t *state);
+
+/* Reassemble the payload from framed blocks injected in 'fnames', in any
+ * order, using 'n_workers' threads.  Returns 1 if the payload is complete.
+ */
+extern int handle_as_framed_extract(
+    char  **fnames,
+    int     n_fnames,
+    flags_t flags,
+    int     n_workers);
+
+
+#endif /* BLOCKS_H_INCLUDE */
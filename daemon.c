@@ -0,0 +1,232 @@
+/******************************************************************************
+ * daemon.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * daemon.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "main.h"
+#include "pool.h"
+
+
+/* Size of the write buffer used for replies */
+#define REPLY_BUF_SZ (DEFAULT_BLK_SZ * 8)
+
+/* Wait before accepting again when out of descriptors or memory */
+#define ACCEPT_RETRY_MS 100
+
+
+/* State shared by all workers, buffers are per worker and reused */
+typedef struct _daemon_t
+{
+    flags_t  flags;
+    char   **lines;
+    size_t  *line_szs;
+    char   **replies;
+} daemon_t;
+
+
+/* Global so we can remove the socket when killed */
+static const char *daemon_sock_path = NULL;
+
+
+static void signal_handler(int signum)
+{
+    if (daemon_sock_path)
+      unlink(daemon_sock_path);
+
+    printf("\n" TAG " daemon gracefully terminated\n");
+    fflush(stdout);
+
+    exit(0);
+}
+
+
+/* Serve every request on a client connection, one request per line:
+ *     analyze <path>
+ *     extract <path>
+ *     insert <dest>\t<datasrc>
+ * Each request is answered with zero or more result records followed by a
+ * line containing "ok" or "err <reason>".
+ */
+static void serve_client(void *job, void *arg, int worker)
+{
+    int        sd, out_sd;
+    char      *c;
+    FILE      *in, *out;
+    daemon_t  *daemon = arg;
+    request_t  req;
+
+    sd = (int)(intptr_t)job;
+    in = out = NULL;
+
+    if (!(in = fdopen(sd, "r")))
+    {
+        close(sd);
+        return;
+    }
+
+    if (((out_sd = dup(sd)) == -1) || !(out = fdopen(out_sd, "w")))
+    {
+        if (out_sd != -1)
+          close(out_sd);
+        fclose(in);
+        return;
+    }
+    setvbuf(out, daemon->replies[worker], _IOFBF, REPLY_BUF_SZ);
+
+    while (getline(&daemon->lines[worker], &daemon->line_szs[worker], in) > 0)
+    {
+        if ((c = strchr(daemon->lines[worker], '\r')) ||
+            (c = strchr(daemon->lines[worker], '\n')))
+          *c = '\0';
+
+        if (!request_parse(daemon->lines[worker], &req))
+          fprintf(out, "err malformed request\n");
+        else if (!request_run(&req, daemon->flags, out, NULL))
+          fprintf(out, "err could not process '%s'\n", req.path);
+        else
+          fprintf(out, "ok\n");
+
+        if (fflush(out) == EOF)
+          break;
+    }
+
+    fclose(out);
+    fclose(in);
+}
+
+
+static void free_buffers(daemon_t *daemon, int n_workers)
+{
+    int i;
+
+    for (i=0; i<n_workers; i++)
+    {
+        free(daemon->lines[i]);
+        free(daemon->replies[i]);
+    }
+    free(daemon->lines);
+    free(daemon->line_szs);
+    free(daemon->replies);
+}
+
+
+void handle_as_daemon(
+    const char *sock_path,
+    flags_t     flags,
+    int         n_workers)
+{
+    int                 i, sd, client;
+    pool_t             *pool;
+    daemon_t            daemon;
+    struct sockaddr_un  addr;
+
+    if (strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        ERR("Socket path '%s' is too long\n", sock_path);
+        return;
+    }
+
+    if ((sd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        ERR("Could not create daemon socket\n");
+        return;
+    }
+
+    /* Replace a stale socket from a previous run */
+    unlink(sock_path);
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sock_path);
+
+    if ((bind(sd, (const struct sockaddr *)&addr,
+              sizeof(struct sockaddr_un)) == -1) ||
+        (listen(sd, SOMAXCONN) == -1))
+    {
+        ERR("Could not listen on '%s'\n", sock_path);
+        close(sd);
+        return;
+    }
+
+    /* Results go back over the socket, not stdout */
+    main_flags |= FLAG_QUIET;
+    daemon.flags = flags | FLAG_QUIET;
+
+    if (n_workers < 1)
+      n_workers = pool_n_cpus();
+
+    /* The buffers are in place before the workers can use them */
+    daemon.lines = calloc(n_workers, sizeof(char *));
+    daemon.line_szs = calloc(n_workers, sizeof(size_t));
+    daemon.replies = malloc(n_workers * sizeof(char *));
+    for (i=0; i<n_workers; i++)
+      daemon.replies[i] = malloc(REPLY_BUF_SZ);
+
+    if (!(pool = pool_create(n_workers, n_workers * 4, serve_client, &daemon)))
+    {
+        ERR("Could not start daemon workers\n");
+        free_buffers(&daemon, n_workers);
+        close(sd);
+        unlink(sock_path);
+        return;
+    }
+
+    /* Gracefully quit */
+    daemon_sock_path = sock_path;
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    VERBOSE(TAG " Listening on %s with %d workers\n", sock_path, n_workers);
+
+    /* Until a signal ends it: accept() failing for the moment (interrupted,
+     * a client gone before it was accepted, out of descriptors under load)
+     * is tried again, anything else is fatal
+     */
+    for ( ;; )
+    {
+        if ((client = accept(sd, NULL, NULL)) != -1)
+          pool_push(pool, (void *)(intptr_t)client);
+        else if ((errno == EMFILE) || (errno == ENFILE) ||
+                 (errno == ENOBUFS) || (errno == ENOMEM))
+          usleep(ACCEPT_RETRY_MS * 1000);
+        else if ((errno != EINTR) && (errno != ECONNABORTED) &&
+                 (errno != EPROTO))
+        {
+            ERR("Could not accept clients on '%s'\n", sock_path);
+            break;
+        }
+    }
+
+    /* Clean */
+    pool_destroy(pool);
+    free_buffers(&daemon, n_workers);
+    close(sd);
+    unlink(sock_path);
+}
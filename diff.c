@@ -0,0 +1,570 @@
+/******************************************************************************
+ * diff.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * diff.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "main.h"
+#include "diff.h"
+#include "fprint.h"
+#include "table.h"
+#include "utils.h"
+
+
+/* A frame by its hash */
+typedef struct _hash_ref_t
+{
+    uint64_t hash;
+    size_t   frame;
+} hash_ref_t;
+
+
+/* One side of the comparison */
+typedef struct _side_t
+{
+    const char          *fname;
+    const unsigned char *data;
+    size_t               size;
+    frame_table_t       *table;
+    uint64_t            *hashes;  /* Of each frame, header included */
+    hash_ref_t          *by_hash; /* Every frame, by hash then position */
+} side_t;
+
+
+typedef enum _change_t {INSERTED, REMOVED, MODIFIED} change_t;
+
+static const char *change_names[] = {"inserted", "removed", "modified"};
+
+
+/* What changed, counted for the summary */
+typedef struct _diff_counts_t
+{
+    long frames_equal;
+    long frames[3];  /* Indexed by change_t */
+    long oob[3];
+    long tags[3];
+    long other[3];
+} diff_counts_t;
+
+
+/* Frames that changed are written as runs */
+typedef struct _frame_run_t
+{
+    int      active;
+    change_t change;
+    uint64_t a_offset;
+    uint64_t b_offset;
+    long     count;
+} frame_run_t;
+
+
+/* The tags and OOB regions in front of a frame, in file order */
+typedef struct _gap_span_t
+{
+    const char *kind;
+    uint64_t    offset;
+    uint64_t    length;
+} gap_span_t;
+
+
+/* Everything a comparison needs */
+typedef struct _diff_t
+{
+    side_t         a;
+    side_t         b;
+    frame_run_t    run;
+    diff_counts_t  counts;
+    gap_span_t    *spans_a;
+    gap_span_t    *spans_b;
+    size_t         alloc_a;
+    size_t         alloc_b;
+} diff_t;
+
+
+static int cmp_refs(const void *x, const void *y)
+{
+    const hash_ref_t *a = x, *b = y;
+
+    if (a->hash != b->hash)
+      return (a->hash < b->hash) ? -1 : 1;
+    return (a->frame > b->frame) - (a->frame < b->frame);
+}
+
+
+static int load_side(side_t *s, const char *fname)
+{
+    size_t i;
+
+    memset(s, 0, sizeof(side_t));
+    s->fname = fname;
+    if (!util_map_file(fname, &s->data, &s->size))
+    {
+        ERR("Could not open '%s'\n", fname);
+        return 0;
+    }
+
+    s->table = table_new();
+    table_scan(s->table, s->data, s->size, 0, 1);
+
+    s->hashes = malloc((s->table->n_frames + 1) * sizeof(uint64_t));
+    s->by_hash = malloc((s->table->n_frames + 1) * sizeof(hash_ref_t));
+    for (i=0; i<s->table->n_frames; i++)
+    {
+        s->hashes[i] = fprint_hash(s->data + s->table->offsets[i],
+                                   s->table->lengths[i], 0);
+        s->by_hash[i].hash = s->hashes[i];
+        s->by_hash[i].frame = i;
+    }
+    qsort(s->by_hash, s->table->n_frames, sizeof(hash_ref_t), cmp_refs);
+
+    return 1;
+}
+
+
+static void free_side(side_t *s)
+{
+    if (!s->data)
+      return;
+    free(s->hashes);
+    free(s->by_hash);
+    table_free(s->table);
+    util_unmap_file(s->data, s->size);
+}
+
+
+static int same_frame(const side_t *a, size_t i, const side_t *b, size_t j)
+{
+    return (a->table->headers[i] == b->table->headers[j]) &&
+           (a->table->lengths[i] == b->table->lengths[j]) &&
+           (a->hashes[i] == b->hashes[j]);
+}
+
+
+/* Bytes before frame 'i' (or after the last frame, if 'i' is n_frames) */
+static void gap_before(
+    const side_t *s,
+    size_t        i,
+    uint64_t     *start,
+    uint64_t     *end)
+{
+    const frame_table_t *t = s->table;
+
+    *start = (i) ? t->offsets[i-1] + t->lengths[i-1] : 0;
+    *end = (i < t->n_frames) ? t->offsets[i] : s->size;
+}
+
+
+/* First span starting at or after 'offset' */
+static size_t span_from(const span_table_t *spans, uint64_t offset)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = spans->count;
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (spans->offsets[mid] < offset)
+          lo = mid + 1;
+        else
+          hi = mid;
+    }
+
+    return lo;
+}
+
+
+static void flush_run(diff_t *d)
+{
+    frame_run_t *run = &d->run;
+
+    if (!run->active)
+      return;
+
+    printf("frames %s a_offset=%" PRIu64 " b_offset=%" PRIu64 " count=%ld\n",
+           change_names[run->change], run->a_offset, run->b_offset,
+           run->count);
+    run->active = 0;
+}
+
+
+static void frame_change(
+    diff_t   *d,
+    change_t  change,
+    uint64_t  a_offset,
+    uint64_t  b_offset)
+{
+    frame_run_t *run = &d->run;
+
+    ++d->counts.frames[change];
+    if (run->active && (run->change == change))
+    {
+        ++run->count;
+        return;
+    }
+
+    flush_run(d);
+    run->active = 1;
+    run->change = change;
+    run->a_offset = a_offset;
+    run->b_offset = b_offset;
+    run->count = 1;
+}
+
+
+static void span_change(
+    diff_t     *d,
+    const char *kind,
+    change_t    change,
+    uint64_t    a_offset,
+    uint64_t    a_len,
+    uint64_t    b_offset,
+    uint64_t    b_len)
+{
+    flush_run(d);
+
+    if (strcmp(kind, "oob") == 0)
+      ++d->counts.oob[change];
+    else if (strcmp(kind, "tag") == 0)
+      ++d->counts.tags[change];
+    else
+      ++d->counts.other[change];
+
+    printf("%s %s a_offset=%" PRIu64 " a_length=%" PRIu64 " b_offset=%"
+           PRIu64 " b_length=%" PRIu64 "\n", kind, change_names[change],
+           a_offset, a_len, b_offset, b_len);
+}
+
+
+/* The tags and OOB regions in [start, end) */
+static size_t gap_spans(
+    const side_t *s,
+    uint64_t      start,
+    uint64_t      end,
+    gap_span_t  **spans,
+    size_t       *alloc)
+{
+    int    oob_ok, tag_ok;
+    size_t i, j, n;
+
+    n = 0;
+    i = span_from(&s->table->oob, start);
+    j = span_from(&s->table->tags, start);
+    for ( ;; )
+    {
+        oob_ok = (i < s->table->oob.count) && (s->table->oob.offsets[i] < end);
+        tag_ok = (j < s->table->tags.count) &&
+                 (s->table->tags.offsets[j] < end);
+
+        if (!oob_ok && !tag_ok)
+          break;
+
+        if (n == *alloc)
+        {
+            *alloc = (*alloc) ? *alloc * 2 : 16;
+            *spans = realloc(*spans, *alloc * sizeof(gap_span_t));
+        }
+
+        if (oob_ok && (!tag_ok ||
+                       s->table->oob.offsets[i] < s->table->tags.offsets[j]))
+        {
+            (*spans)[n].kind = "oob";
+            (*spans)[n].offset = s->table->oob.offsets[i];
+            (*spans)[n++].length = s->table->oob.lengths[i++];
+        }
+        else
+        {
+            (*spans)[n].kind = "tag";
+            (*spans)[n].offset = s->table->tags.offsets[j];
+            (*spans)[n++].length = s->table->tags.lengths[j++];
+        }
+    }
+
+    return n;
+}
+
+
+/* Compare what is in front of frame 'i' of 'a' with what is in front of
+ * frame 'j' of 'b' (either may be n_frames: the end of the file).  A side
+ * that is not 'used' has nothing there, only a position, as for a frame
+ * inserted or removed.
+ */
+static void compare_gaps(
+    diff_t *d,
+    int     use_a,
+    size_t  i,
+    int     use_b,
+    size_t  j)
+{
+    size_t      k, na, nb;
+    uint64_t    a_start, a_end, b_start, b_end;
+    gap_span_t *sa, *sb;
+
+    gap_before(&d->a, i, &a_start, &a_end);
+    gap_before(&d->b, j, &b_start, &b_end);
+    if (!use_a)
+      a_start = a_end;
+    if (!use_b)
+      b_start = b_end;
+
+    /* Nothing there, or the same bytes */
+    if ((a_end - a_start == b_end - b_start) &&
+        ((a_end == a_start) ||
+         !memcmp(d->a.data + a_start, d->b.data + b_start, a_end - a_start)))
+      return;
+
+    na = (use_a) ? gap_spans(&d->a, a_start, a_end, &d->spans_a,
+                             &d->alloc_a) : 0;
+    nb = (use_b) ? gap_spans(&d->b, b_start, b_end, &d->spans_b,
+                             &d->alloc_b) : 0;
+    sa = d->spans_a;
+    sb = d->spans_b;
+
+    /* Bytes that are not a tag or OOB region (an ID3v1 tag) */
+    if (!na && !nb)
+    {
+        span_change(d, "other", MODIFIED, a_start, a_end - a_start, b_start,
+                    b_end - b_start);
+        return;
+    }
+
+    /* Paired up in order, what is left over was inserted or removed */
+    for (k=0; (k < na) || (k < nb); k++)
+    {
+        if ((k < na) && (k < nb) && (sa[k].kind == sb[k].kind))
+        {
+            if ((sa[k].length != sb[k].length) ||
+                memcmp(d->a.data + sa[k].offset, d->b.data + sb[k].offset,
+                       sa[k].length))
+              span_change(d, sa[k].kind, MODIFIED, sa[k].offset,
+                          sa[k].length, sb[k].offset, sb[k].length);
+            continue;
+        }
+
+        if (k < na)
+          span_change(d, sa[k].kind, REMOVED, sa[k].offset, sa[k].length,
+                      b_end, 0);
+        if (k < nb)
+          span_change(d, sb[k].kind, INSERTED, a_end, 0, sb[k].offset,
+                      sb[k].length);
+    }
+}
+
+
+/* The first frame of 's' from 'from' on with 'hash' (n_frames if none) */
+static size_t find_hash(const side_t *s, uint64_t hash, size_t from)
+{
+    size_t lo, hi, mid;
+
+    lo = 0;
+    hi = s->table->n_frames;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if ((s->by_hash[mid].hash < hash) ||
+            ((s->by_hash[mid].hash == hash) && (s->by_hash[mid].frame < from)))
+          lo = mid + 1;
+        else
+          hi = mid;
+    }
+
+    return lo;
+}
+
+
+/* Where the files line up again after frames 'i' and 'j' differ: the
+ * fewest frames skipped (in both files together) to a matching pair.  Each
+ * frame of 'a' in the window is looked up in 'b' by its hash, rather than
+ * compared with every frame of the window in 'b'.
+ */
+static int resync(
+    const side_t *a,
+    size_t        i,
+    const side_t *b,
+    size_t        j,
+    size_t       *skip_a,
+    size_t       *skip_b)
+{
+    size_t k, r, best;
+
+    best = 2 * DIFF_RESYNC_FRAMES + 1;
+    for (k=0; (k <= DIFF_RESYNC_FRAMES) && (k < best) &&
+              (i + k < a->table->n_frames); k++)
+      for (r=find_hash(b, a->hashes[i+k], j);
+           (r < b->table->n_frames) && (b->by_hash[r].hash == a->hashes[i+k]) &&
+           (b->by_hash[r].frame - j <= DIFF_RESYNC_FRAMES) &&
+           (k + b->by_hash[r].frame - j < best); r++)
+        if (same_frame(a, i + k, b, b->by_hash[r].frame))
+        {
+            best = k + b->by_hash[r].frame - j;
+            *skip_a = k;
+            *skip_b = b->by_hash[r].frame - j;
+            break;
+        }
+
+    return best <= 2 * DIFF_RESYNC_FRAMES;
+}
+
+
+/* Does frame 'i' start where the one before it ends? */
+static int back_to_back(const side_t *s, size_t i)
+{
+    return s->table->offsets[i] ==
+           s->table->offsets[i-1] + s->table->lengths[i-1];
+}
+
+
+/* Frames [i, i+n) of 'a' and [j, j+n) of 'b' hash the same: confirm it
+ * with memcmp, a whole range at once where the frames are back to back
+ */
+static int run_equal(
+    const side_t *a,
+    size_t        i,
+    const side_t *b,
+    size_t        j,
+    size_t        n)
+{
+    uint64_t a_start, a_end, b_start, b_end;
+
+    a_start = a->table->offsets[i];
+    a_end = a->table->offsets[i+n-1] + a->table->lengths[i+n-1];
+    b_start = b->table->offsets[j];
+    b_end = b->table->offsets[j+n-1] + b->table->lengths[j+n-1];
+
+    return (a_end - a_start == b_end - b_start) &&
+           !memcmp(a->data + a_start, b->data + b_start, a_end - a_start);
+}
+
+
+int handle_as_diff(const char *fname_a, const char *fname_b)
+{
+    size_t        i, j, k, n, m, skip_a, skip_b;
+    diff_t        d;
+    const side_t *a = &d.a, *b = &d.b;
+
+    memset(&d, 0, sizeof(diff_t));
+    if (!load_side(&d.a, fname_a) || !load_side(&d.b, fname_b))
+    {
+        free_side(&d.a);
+        return 0;
+    }
+
+    i = j = 0;
+    while ((i < a->table->n_frames) && (j < b->table->n_frames))
+    {
+        /* A run of matching frames, and what is between them */
+        for (n=0; (i + n < a->table->n_frames) &&
+                  (j + n < b->table->n_frames) &&
+                  same_frame(a, i + n, b, j + n); n++)
+          ;
+
+        if (n)
+        {
+            /* Frames back to back in both files are checked in one go */
+            for (k=0; k<n; k=m)
+            {
+                for (m=k+1; (m < n) && back_to_back(a, i + m) &&
+                            back_to_back(b, j + m); m++)
+                  ;
+
+                compare_gaps(&d, 1, i + k, 1, j + k);
+                if (run_equal(a, i + k, b, j + k, m - k))
+                {
+                    d.counts.frames_equal += m - k;
+                    flush_run(&d);
+                    continue;
+                }
+
+                for ( ; k<m; k++)
+                  if (run_equal(a, i + k, b, j + k, 1))
+                  {
+                      ++d.counts.frames_equal;
+                      flush_run(&d);
+                  }
+                  else
+                    frame_change(&d, MODIFIED, a->table->offsets[i+k],
+                                 b->table->offsets[j+k]);
+            }
+            i += n;
+            j += n;
+            continue;
+        }
+
+        /* Frames that differ: as many modified as there are pairs, the rest
+         * removed from 'a' or inserted in 'b'
+         */
+        if (!resync(a, i, b, j, &skip_a, &skip_b))
+          skip_a = skip_b = 1;
+
+        for (k=0; (k < skip_a) || (k < skip_b); k++)
+        {
+            compare_gaps(&d, k < skip_a, (k < skip_a) ? i + k : i + skip_a,
+                         k < skip_b, (k < skip_b) ? j + k : j + skip_b);
+            if ((k < skip_a) && (k < skip_b))
+              frame_change(&d, MODIFIED, a->table->offsets[i+k],
+                           b->table->offsets[j+k]);
+            else if (k < skip_a)
+              frame_change(&d, REMOVED, a->table->offsets[i+k],
+                           b->table->offsets[j+skip_b]);
+            else
+              frame_change(&d, INSERTED, a->table->offsets[i+skip_a],
+                           b->table->offsets[j+k]);
+        }
+        i += skip_a;
+        j += skip_b;
+    }
+
+    /* Whatever is left in either file, then what follows the last frame */
+    for ( ; i<a->table->n_frames; i++)
+    {
+        compare_gaps(&d, 1, i, 0, b->table->n_frames);
+        frame_change(&d, REMOVED, a->table->offsets[i], b->size);
+    }
+    for ( ; j<b->table->n_frames; j++)
+    {
+        compare_gaps(&d, 0, a->table->n_frames, 1, j);
+        frame_change(&d, INSERTED, a->size, b->table->offsets[j]);
+    }
+    compare_gaps(&d, 1, a->table->n_frames, 1, b->table->n_frames);
+    flush_run(&d);
+
+    printf("diff a=%s b=%s frames_equal=%ld frames_inserted=%ld "
+           "frames_removed=%ld frames_modified=%ld oob_inserted=%ld "
+           "oob_removed=%ld oob_modified=%ld tags_inserted=%ld "
+           "tags_removed=%ld tags_modified=%ld other_modified=%ld\n",
+           fname_a, fname_b, d.counts.frames_equal,
+           d.counts.frames[INSERTED], d.counts.frames[REMOVED],
+           d.counts.frames[MODIFIED], d.counts.oob[INSERTED],
+           d.counts.oob[REMOVED], d.counts.oob[MODIFIED],
+           d.counts.tags[INSERTED], d.counts.tags[REMOVED],
+           d.counts.tags[MODIFIED], d.counts.other[MODIFIED]);
+
+    /* Clean */
+    free_side(&d.a);
+    free_side(&d.b);
+    free(d.spans_a);
+    free(d.spans_b);
+
+    return 1;
+}
@@ -0,0 +1,42 @@
+/******************************************************************************
+ * diff.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * diff.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef DIFF_H_INCLUDE
+#define DIFF_H_INCLUDE
+
+
+/* Frames looked ahead (in each file) for the two files to line up again
+ * after frames that differ
+ */
+#define DIFF_RESYNC_FRAMES 256
+
+
+/* Compare the structure of 'a' (the original) with 'b' (a modified copy):
+ * frames are lined up by header and payload hash, and the OOB regions and
+ * tags between them compared.  Writes a record for each run of frames, and
+ * each OOB region or tag, inserted, removed or modified, then a "diff"
+ * summary record.  Returns 1 if the files could be compared.
+ */
+extern int handle_as_diff(const char *a, const char *b);
+
+
+#endif /* DIFF_H_INCLUDE */
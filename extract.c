@@ -0,0 +1,278 @@
+/******************************************************************************
+ * extract.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * extract.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "main.h"
+#include "blocks.h"
+#include "pool.h"
+#include "table.h"
+#include "utils.h"
+
+
+/* A numbered file written by handle_as_insert() */
+typedef struct _injected_t
+{
+    char          *fname;
+    long           number;    /* 'N' in "injected-N" */
+    long           duplicate; /* 'K' in "injected-N-K", if the name was taken */
+    frame_table_t *table;
+    uint64_t       oob_sz;
+    uint64_t       offset;    /* Where this file's OOB data goes */
+} injected_t;
+
+
+/* State shared by the workers */
+typedef struct _reassembly_t
+{
+    injected_t *files;
+    int         out_fd;
+} reassembly_t;
+
+
+/* Returns 1 and the numbers in the name if 'name' is an injected file */
+static int parse_injected_name(const char *name, long *number, long *dup)
+{
+    char       *end;
+    const char *c;
+
+    if (!(c = strstr(name, "injected-")) ||
+        (strlen(name) < 4) || strcmp(name + strlen(name) - 4, ".mp3"))
+      return 0;
+
+    *number = strtol(c + strlen("injected-"), &end, 10);
+    if (end == c + strlen("injected-"))
+      return 0;
+
+    *dup = 0;
+    if (*end == '-')
+    {
+        c = end + 1;
+        *dup = strtol(c, &end, 10);
+        if (end == c)
+          return 0;
+    }
+
+    return *end == '.';
+}
+
+
+/* Numerically, so that injected-10 comes after injected-9 */
+static int cmp_injected(const void *a, const void *b)
+{
+    const injected_t *x = a, *y = b;
+
+    if (x->number != y->number)
+      return (x->number < y->number) ? -1 : 1;
+    if (x->duplicate != y->duplicate)
+      return (x->duplicate < y->duplicate) ? -1 : 1;
+    return strcmp(x->fname, y->fname);
+}
+
+
+/* First pass: index a file and total its OOB data */
+static void scan_file(void *job, void *arg, int worker)
+{
+    size_t        i;
+    reassembly_t *re = arg;
+    injected_t   *file = &re->files[(intptr_t)job];
+
+    if (!(file->table = table_scan_file(file->fname)))
+    {
+        ERR("Could not open '%s'\n", file->fname);
+        return;
+    }
+
+    for (i=0; i<file->table->oob.count; i++)
+      file->oob_sz += file->table->oob.lengths[i];
+}
+
+
+/* Second pass: write a file's OOB data at its place in the output */
+static void write_file(void *job, void *arg, int worker)
+{
+    size_t               i, size;
+    uint64_t             offset;
+    const unsigned char *data;
+    reassembly_t        *re = arg;
+    injected_t          *file = &re->files[(intptr_t)job];
+
+    if (!file->table || !util_map_file(file->fname, &data, &size))
+      return;
+
+    offset = file->offset;
+    for (i=0; i<file->table->oob.count; i++)
+    {
+        if (pwrite(re->out_fd, data + file->table->oob.offsets[i],
+                   file->table->oob.lengths[i], offset) !=
+            (ssize_t)file->table->oob.lengths[i])
+          ERR("Could not write out of band data from '%s'\n", file->fname);
+        offset += file->table->oob.lengths[i];
+    }
+
+    util_unmap_file(data, size);
+}
+
+
+/* Run 'fn' over every file on a pool of workers */
+static void for_each_file(
+    reassembly_t *re,
+    int           n_files,
+    pool_fn_t     fn,
+    int           n_workers)
+{
+    int     i;
+    pool_t *pool;
+
+    if (!(pool = pool_create(n_workers, 0, fn, re)))
+    {
+        for (i=0; i<n_files; i++)
+          fn((void *)(intptr_t)i, re, 0);
+        return;
+    }
+
+    for (i=0; i<n_files; i++)
+      pool_push(pool, (void *)(intptr_t)i);
+    pool_destroy(pool);
+}
+
+
+int handle_as_dir_extract(const char *dirname, flags_t flags, int n_workers)
+{
+    int             i, n_files, alloc, ok;
+    long            number, dup;
+    char          **fnames;
+    uint64_t        total;
+    DIR            *dir;
+    FILE           *out;
+    struct dirent  *entry;
+    reassembly_t    re;
+
+    if (!(dir = opendir(dirname)))
+    {
+        ERR("Could not open directory '%s'\n", dirname);
+        return 0;
+    }
+
+    /* Find the numbered outputs of an insert */
+    re.files = NULL;
+    n_files = alloc = 0;
+    while ((entry = readdir(dir)))
+    {
+        if (!parse_injected_name(entry->d_name, &number, &dup))
+          continue;
+
+        if (n_files == alloc)
+        {
+            alloc = (alloc) ? alloc * 2 : 64;
+            re.files = realloc(re.files, alloc * sizeof(injected_t));
+        }
+
+        memset(&re.files[n_files], 0, sizeof(injected_t));
+        re.files[n_files].fname = malloc(strlen(dirname) +
+                                         strlen(entry->d_name) + 2);
+        sprintf(re.files[n_files].fname, "%s/%s", dirname, entry->d_name);
+        re.files[n_files].number = number;
+        re.files[n_files].duplicate = dup;
+        ++n_files;
+    }
+    closedir(dir);
+
+    if (n_files == 0)
+    {
+        ERR("No injected files found in '%s'\n", dirname);
+        free(re.files);
+        return 0;
+    }
+
+    qsort(re.files, n_files, sizeof(injected_t), cmp_injected);
+
+    /* A second insert into the same directory numbers its files "-K" (the
+     * name being taken), and two payloads must not be joined into one
+     */
+    for (i=1; i<n_files; i++)
+      if (re.files[i].duplicate != re.files[0].duplicate)
+        break;
+    if (i < n_files)
+    {
+        ERR("'%s' holds the files of more than one insert (e.g. '%s' and "
+            "'%s'), move each insert's files to a directory of its own\n",
+            dirname, re.files[0].fname, re.files[i].fname);
+        for (i=0; i<n_files; i++)
+          free(re.files[i].fname);
+        free(re.files);
+        return 0;
+    }
+
+    /* Framed blocks know where they go, so order does not matter */
+    if (flags & FLAG_FRAMED_MODE)
+    {
+        fnames = malloc(n_files * sizeof(char *));
+        for (i=0; i<n_files; i++)
+          fnames[i] = re.files[i].fname;
+        ok = handle_as_framed_extract(fnames, n_files, flags, n_workers);
+        free(fnames);
+    }
+    else if ((out = util_create_file(dirname, "extracted-oob", "dat", 0)))
+    {
+        re.out_fd = fileno(out);
+
+        /* Index every file, then lay their OOB data out end to end */
+        for_each_file(&re, n_files, scan_file, n_workers);
+
+        total = 0;
+        for (i=0; i<n_files; i++)
+        {
+            re.files[i].offset = total;
+            total += re.files[i].oob_sz;
+            VERBOSE(TAG " %s: %" PRIu64 " bytes out-of-frame\n",
+                    re.files[i].fname, re.files[i].oob_sz);
+        }
+
+        if (ftruncate(re.out_fd, total) == -1)
+          ERR("Could not size the extracted data\n");
+
+        for_each_file(&re, n_files, write_file, n_workers);
+        util_close_file(out);
+
+        printf(TAG " Files: %d\n", n_files);
+        printf(TAG " Extracted: %" PRIu64 " bytes\n", total);
+        ok = 1;
+    }
+    else
+      ok = 0;
+
+    /* Clean */
+    for (i=0; i<n_files; i++)
+    {
+        free(re.files[i].fname);
+        table_free(re.files[i].table);
+    }
+    free(re.files);
+
+    return ok;
+}
@@ -21,55 +21,306 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include "main.h"
 #include "utils.h"
+#include "table.h"
+#include "layer3.h"
+#include "hdrbits.h"
+#include "triage.h"
+#include "fprint.h"
 
 
-void handle_as_file(const char *fname, flags_t flags)
+/* Report on the header fields that could carry data, with -e their bits are
+ * saved as well
+ */
+static void analyze_headers(
+    const char          *fname,
+    flags_t              flags,
+    const frame_table_t *table,
+    analysis_t          *result)
 {
-    int            n_frames, n_tags;
-    FILE          *fp, *oob_file;
-    mp3_frame_t   *frame;
-    id3_tag_t     *tag;
-    STREAM_OBJECT  type;
+    int              i;
+    char             desc[32];
+    FILE            *fp;
+    hdrbits_t        hb;
+    hdrbits_field_t *f;
 
-    if (!(fp = fopen(fname, "rb")))
-      abort();
+    hdrbits_analyze(table, &hb);
+
+    for (i=0; i<HDRBITS_N_FIELDS; i++)
+    {
+        f = &hb.fields[i];
+        if (!IS_QUIET)
+          printf(TAG " Header %s: %" PRIu64 " runs, longest %" PRIu64
+                 " frames, %.4f bits/frame%s\n", f->name, f->runs,
+                 f->longest_run, f->entropy,
+                 (f->anomalous) ? " (anomalous)" : "");
+
+        if (!f->anomalous)
+          continue;
+        ++result->n_hdr_anomalies;
+
+        if (!(flags & FLAG_EXTRACT_MODE))
+          continue;
+        snprintf(desc, sizeof(desc), "header-%s", f->name);
+        if (!(fp = util_create_file(fname, desc, "dat", 0)))
+        {
+            ERR("Could not create a file to store the %s bits\n", f->name);
+            continue;
+        }
+        VERBOSE(TAG " Saved %" PRIu64 " %s bits\n", hdrbits_dump(&hb, i, fp),
+                f->name);
+        util_close_file(fp);
+    }
+
+    VERBOSE(TAG " Padded frames: %" PRIu64 " (expected %.0f)\n",
+            hb.fields[HDRBITS_PADDING].counts[1], hb.expected_padding);
+
+    hdrbits_free(&hb);
+}
+
+
+int file_analyze(
+    const char     *fname,
+    flags_t         flags,
+    analysis_t     *result,
+    fprint_index_t *seen)
+{
+    int                  is_anc, keep;
+    char                 desc[128];
+    size_t               i, j, size;
+    uint16_t             stored, computed;
+    uint32_t             len;
+    uint64_t             offset;
+    const unsigned char *data;
+    FILE                *oob_file, *idx_file;
+    frame_table_t       *table;
+    span_table_t         anc;
+    triage_t             tri;
+    fprint_t             fp;
+
+    memset(result, 0, sizeof(analysis_t));
+
+    if (!util_map_file(fname, &data, &size))
+    {
+        ERR("Could not open '%s'\n", fname);
+        return 0;
+    }
 
     oob_file = NULL;
     if (flags & FLAG_EXTRACT_MODE)
       if (!(oob_file = util_create_file(fname, "extracted-oob", "dat", 0)))
         ERR("Could not create a file to store out of band data\n"
             "Normal analysis will still occur.\n");
-    
-    n_frames = n_tags = 0;
 
-    while ((type = util_next_mp3_frame_or_id3v2(fp, NULL, 0, 0,NULL,oob_file)))
+    table = table_new();
+    table_scan(table, data, size, 0, 1);
+
+    /* What the file is made of, to find others like it.  A copy of a file
+     * already analyzed in the run goes no further.
+     */
+    if (flags & FLAG_FINGERPRINT)
     {
-        switch (type)
+        fprint_table(table, data, size, &fp);
+        result->audio_fp = fp.audio;
+        result->rest_fp = fp.rest;
+        if (seen && !fprint_index_add(seen, fname, &fp))
         {
-            case STREAM_OBJECT_MP3_FRAME:
-                frame = mp3_get_frame(fp);
-                mp3_free_frame(frame);
-                ++n_frames;
-                break;
+            result->is_copy = 1;
+            if (oob_file)
+              util_close_file(oob_file);
+            table_free(table);
+            util_unmap_file(data, size);
+            return 1;
+        }
+    }
 
-            case STREAM_OBJECT_ID3V2_TAG:
-                tag = id3_get_tag(fp);
-                free(tag);
-                ++n_tags;
-                break;
+    /* Unused bytes inside Layer III frames */
+    memset(&anc, 0, sizeof(span_table_t));
+    if ((flags & FLAG_ANCILLARY_MODE) && (table->format != FORMAT_ADTS))
+      layer3_ancillary(table, data, &anc);
+
+    /* OOB regions, and any ancillary data, in the order they are in the file.
+     * Each is scored and only kept if it scores high enough.
+     */
+    i = j = 0;
+    while (i < table->oob.count || j < anc.count)
+    {
+        if ((is_anc = !(j == anc.count ||
+                        (i < table->oob.count &&
+                         table->oob.offsets[i] < anc.offsets[j]))))
+        {
+            offset = anc.offsets[j];
+            len = anc.lengths[j++];
+            result->anc_bytes += len;
+        }
+        else
+        {
+            offset = table->oob.offsets[i];
+            len = table->oob.lengths[i++];
+            result->oob_bytes += len;
+        }
 
-            default:
+        triage_region(&tri, data + offset, len);
+        if (tri.score > result->oob_max_score)
+          result->oob_max_score = tri.score;
+        if ((keep = (tri.score >= main_oob_threshold)))
+          ++result->n_oob_kept;
+
+        if (!IS_QUIET && (!is_anc || IS_VERBOSE))
+        {
+            triage_format(&tri, desc, sizeof(desc));
+            printf(TAG " %" PRIu32 " bytes %s at offset %" PRIu64 ": %s\n",
+                   len, (is_anc) ? "of ancillary data" : "out-of-frame",
+                   offset, desc);
+            if (IS_VERBOSE)
+              util_display_oob(data + offset, len, 0);
+        }
+
+        if (oob_file && keep)
+          fwrite(data + offset, len, 1, oob_file);
+    }
+
+    result->n_frames = table->n_frames;
+    result->n_tags = table->tags.count;
+    result->n_oob_regions = table->oob.count;
+    result->n_anc_regions = anc.count;
+    result->format = table->format;
+    result->secs = table->secs;
+    result->stats = table->stats;
+
+    /* Frame checksums (of MPEG audio) */
+    if ((flags & FLAG_CRC_MODE) && (table->format != FORMAT_ADTS))
+      for (i=0; i<table->n_frames; i++)
+        switch (mp3_check_crc(data + table->offsets[i], table->lengths[i],
+                              &stored, &computed))
+        {
+            case 0:
+                ++result->n_crc_failed;
+                if (!IS_QUIET)
+                  printf(TAG " CRC mismatch: frame %zu at offset %" PRIu64
+                         " (stored 0x%04x, computed 0x%04x)\n", i,
+                         table->offsets[i], stored, computed);
+                /* Fall through */
+            case 1:
+                ++result->n_crc_checked;
                 break;
         }
+
+    /* Header fields (of MPEG audio) */
+    if ((flags & FLAG_HEADER_MODE) && (table->format != FORMAT_ADTS))
+      analyze_headers(fname, flags, table, result);
+
+    /* Save the frame index */
+    if (flags & FLAG_INDEX_MODE)
+    {
+        table_identify(fname, &table->source);
+        if (!(idx_file = util_create_file(fname, "frame-index", "idx", 0)) ||
+            !table_save(table, idx_file))
+          ERR("Could not save the frame index\n");
+        if (idx_file)
+          util_close_file(idx_file);
     }
 
-    printf(TAG " Frames: %d\n", n_frames);
-    printf(TAG " ID3v2 Tags: %d\n", n_tags);
+    if (seen && (flags & FLAG_FINGERPRINT))
+      fprint_index_keep(seen, &fp, result);
 
     /* Clean */
     if (oob_file)
-      fclose(oob_file);
-    fclose(fp);
+      util_close_file(oob_file);
+    span_free(&anc);
+    table_free(table);
+    util_unmap_file(data, size);
+
+    return 1;
+}
+
+
+/* Average bit rate of the audio in kbps */
+static double avg_kbps(const analysis_t *result)
+{
+    return (result->secs > 0.0) ?
+           result->stats.audio_bytes * 8 / result->secs / 1000.0 : 0.0;
+}
+
+
+void file_report(
+    FILE             *out,
+    const char       *fname,
+    const analysis_t *result)
+{
+    int i;
+
+    fprintf(out, "file path=%s frames=%d tags=%d oob_regions=%d "
+            "oob_bytes=%ld oob_max_score=%d oob_kept=%d anc_regions=%d "
+            "anc_bytes=%ld crc_checked=%d crc_failed=%d hdr_anomalies=%d",
+            fname, result->n_frames, result->n_tags, result->n_oob_regions,
+            result->oob_bytes, result->oob_max_score, result->n_oob_kept,
+            result->n_anc_regions, result->anc_bytes, result->n_crc_checked,
+            result->n_crc_failed, result->n_hdr_anomalies);
+    if (result->audio_fp)
+      fprintf(out, " audio_fp=%016" PRIx64 " rest_fp=%016" PRIx64,
+              result->audio_fp, result->rest_fp);
+
+    fprintf(out, " format=%s secs=%.3f kbps=%.1f bitrates=%d frame_min=%d "
+            "frame_max=%d frame_avg=%.1f format_changes=%ld",
+            format_name(result->format), result->secs, avg_kbps(result),
+            result->stats.n_bitrates, result->stats.min_length,
+            result->stats.max_length,
+            (result->n_frames) ?
+            (double)result->stats.audio_bytes / result->n_frames : 0.0,
+            result->stats.format_changes);
+    if (result->stats.format_changes)
+      fprintf(out, " first_change=%" PRIu64, result->stats.first_change);
+    for (i=0; i<result->stats.n_bitrates; i++)
+      fprintf(out, "%s%d:%ld", (i) ? "," : " kbps_frames=",
+              result->stats.kbps[i], result->stats.kbps_frames[i]);
+    fprintf(out, "\n");
+}
+
+
+void handle_as_file(const char *fname, flags_t flags)
+{
+    int        i;
+    analysis_t result;
+
+    if (!file_analyze(fname, flags, &result, NULL))
+      abort();
+
+    printf(TAG " Frames: %d (%s)\n", result.n_frames,
+           format_name(result.format));
+    printf(TAG " Duration: %d:%06.3f\n", (int)(result.secs / 60),
+           result.secs - 60 * (int)(result.secs / 60));
+    printf(TAG " Bit rate: %.1f kbps average, %s\n", avg_kbps(&result),
+           (result.stats.n_bitrates > 1) ? "variable" : "constant");
+    for (i=0; (result.stats.n_bitrates > 1) && (i<result.stats.n_bitrates);
+         i++)
+      printf(TAG "   %3d kbps: %ld frames (%.1f%%)\n", result.stats.kbps[i],
+             result.stats.kbps_frames[i],
+             100.0 * result.stats.kbps_frames[i] / result.n_frames);
+    if (result.n_frames)
+      printf(TAG " Frame sizes: %d to %d bytes, %.1f average\n",
+             result.stats.min_length, result.stats.max_length,
+             (double)result.stats.audio_bytes / result.n_frames);
+    if (result.stats.format_changes)
+      printf(TAG " Format changes: %ld, the first at offset %" PRIu64
+             " (spliced?)\n", result.stats.format_changes,
+             result.stats.first_change);
+    printf(TAG " ID3v2 Tags: %d\n", result.n_tags);
+    if (flags & FLAG_ANCILLARY_MODE)
+      printf(TAG " Ancillary: %d regions, %ld bytes\n", result.n_anc_regions,
+             result.anc_bytes);
+    if (flags & FLAG_CRC_MODE)
+      printf(TAG " CRC: %d protected frames, %d failed (%.2f%%)\n",
+             result.n_crc_checked, result.n_crc_failed,
+             (result.n_crc_checked) ?
+             100.0 * result.n_crc_failed / result.n_crc_checked : 0.0);
+    if (flags & FLAG_HEADER_MODE)
+      printf(TAG " Anomalous header fields: %d\n", result.n_hdr_anomalies);
+    if (flags & FLAG_FINGERPRINT)
+      printf(TAG " Fingerprint: audio %016" PRIx64 ", rest %016" PRIx64 "\n",
+             result.audio_fp, result.rest_fp);
 }
@@ -0,0 +1,414 @@
+/******************************************************************************
+ * follow.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * follow.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "follow.h"
+#include "table.h"
+#include "triage.h"
+#include "utils.h"
+
+
+/* Where a followed file has been scanned to */
+typedef struct _follow_t
+{
+    const char    *fname;
+    int            fd;
+    uint64_t       inode;
+    format_t       format;         /* Of the frames, once it can be told */
+    uint64_t       cursor;         /* Everything before it has been scanned */
+    uint64_t       pending_offset; /* OOB region ending at the cursor, which */
+    uint64_t       pending_bytes;  /* may go on in what is appended next     */
+    unsigned char *buf;
+    size_t         buf_sz;
+    char          *cursor_name;
+    FILE          *oob_file;
+    uint64_t       bytes_scanned;  /* This run */
+    uint64_t       oob_bytes;
+    long           n_frames;
+    long           n_tags;
+    long           n_oob_regions;
+} follow_t;
+
+
+static volatile sig_atomic_t follow_stop = 0;
+
+
+static void follow_signal(int signum)
+{
+    follow_stop = 1;
+}
+
+
+/* Pick up from a saved cursor, unless the file is not the one it was saved
+ * for or has been cut short since
+ */
+static void load_cursor(follow_t *f, uint64_t size)
+{
+    FILE               *fp;
+    unsigned long long  offset, pend_off, pend_sz, inode;
+
+    if (!(fp = fopen(f->cursor_name, "r")))
+      return;
+
+    if ((fscanf(fp, "cursor offset=%llu pending_offset=%llu "
+                "pending_bytes=%llu inode=%llu", &offset, &pend_off,
+                &pend_sz, &inode) == 4) &&
+        (inode == f->inode) && (offset <= size) &&
+        (pend_off + pend_sz == offset || !pend_sz))
+    {
+        f->cursor = offset;
+        f->pending_offset = pend_off;
+        f->pending_bytes = pend_sz;
+        printf(TAG " Resuming '%s' at offset %" PRIu64 "\n", f->fname,
+               f->cursor);
+    }
+    else
+      printf(TAG " '%s' does not match the saved cursor, starting over\n",
+             f->fname);
+
+    fclose(fp);
+}
+
+
+/* Written aside and renamed, so a crash leaves the old or the new cursor */
+static void save_cursor(const follow_t *f)
+{
+    char *tmp;
+    FILE *fp;
+
+    tmp = malloc(strlen(f->cursor_name) + 5);
+    sprintf(tmp, "%s.tmp", f->cursor_name);
+
+    if (!(fp = fopen(tmp, "w")))
+    {
+        ERR("Could not save the cursor to '%s'\n", f->cursor_name);
+        free(tmp);
+        return;
+    }
+
+    fprintf(fp, "cursor offset=%" PRIu64 " pending_offset=%" PRIu64
+            " pending_bytes=%" PRIu64 " inode=%" PRIu64 "\n", f->cursor,
+            f->pending_offset, f->pending_bytes, f->inode);
+    if ((fclose(fp) != 0) || (rename(tmp, f->cursor_name) != 0))
+      ERR("Could not save the cursor to '%s'\n", f->cursor_name);
+
+    free(tmp);
+}
+
+
+/* The format of the frames from the start of the file, which a chunk
+ * appended later may be too short to tell
+ */
+static void detect_format(follow_t *f)
+{
+    ssize_t n;
+
+    f->format = FORMAT_UNKNOWN;
+    if ((n = pread(f->fd, f->buf, f->buf_sz, 0)) > 0)
+      f->format = format_detect(f->buf, n);
+}
+
+
+/* A whole OOB region: report it, and save it if it scores high enough */
+static void emit_region(follow_t *f, uint64_t offset, uint64_t len)
+{
+    char           desc[128];
+    unsigned char *data;
+    triage_t       tri;
+
+    ++f->n_oob_regions;
+    f->oob_bytes += len;
+
+    if (!(data = malloc(len)) ||
+        (pread(f->fd, data, len, offset) != (ssize_t)len))
+    {
+        ERR("Could not read %" PRIu64 " bytes at offset %" PRIu64 "\n",
+            len, offset);
+        free(data);
+        return;
+    }
+
+    triage_region(&tri, data, len);
+    triage_format(&tri, desc, sizeof(desc));
+    printf(TAG " %" PRIu64 " bytes out-of-frame at offset %" PRIu64 ": %s\n",
+           len, offset, desc);
+    if (IS_VERBOSE)
+      util_display_oob(data, len, 0);
+
+    if (f->oob_file && (tri.score >= main_oob_threshold))
+    {
+        fwrite(data, len, 1, f->oob_file);
+        fflush(f->oob_file);
+    }
+
+    free(data);
+}
+
+
+/* Where an ID3v1 tag (the last 128 bytes of a file) starts, or may be
+ * starting while it is still being written, else 'size'.  As in a whole
+ * file scan it is neither a tag nor OOB data, so it is only scanned once
+ * more is appended after it.
+ */
+static uint64_t id3v1_start(const follow_t *f, uint64_t size)
+{
+    size_t        i, len;
+    unsigned char tail[128];
+
+    len = (size < sizeof(tail)) ? size : sizeof(tail);
+    if (pread(f->fd, tail, len, size - len) != (ssize_t)len)
+      return size;
+
+    for (i=0; i+3<=len; i++)
+      if (memcmp(tail + i, "TAG", 3) == 0)
+        return size - len + i;
+
+    return size;
+}
+
+
+/* Scan what has been appended since the last call.  Only the bytes after
+ * the cursor are read, the start of a frame or tag that was cut short last
+ * time included.
+ */
+static void follow_update(follow_t *f)
+{
+    int            closed;
+    size_t         i, used;
+    ssize_t        n;
+    uint64_t       offset, len, end;
+    struct stat    st;
+    frame_table_t *table;
+
+    if (fstat(f->fd, &st) == -1)
+      return;
+
+    if ((uint64_t)st.st_size < f->cursor)
+    {
+        printf(TAG " '%s' was truncated, starting over\n", f->fname);
+        f->cursor = f->pending_offset = f->pending_bytes = 0;
+        detect_format(f);
+    }
+
+    /* The ID3v1 tag at the end is left alone, and taken back out of the
+     * region running into it if it was scanned before it was all there
+     */
+    end = id3v1_start(f, st.st_size);
+    if (f->pending_bytes && (end < f->cursor) && (end >= f->pending_offset))
+    {
+        f->bytes_scanned -= (f->bytes_scanned > f->cursor - end) ?
+                            f->cursor - end : f->bytes_scanned;
+        f->pending_bytes = end - f->pending_offset;
+        f->cursor = end;
+    }
+
+    while ((f->cursor < end) && !follow_stop)
+    {
+        n = (end - f->cursor < f->buf_sz) ? (ssize_t)(end - f->cursor) :
+                                            (ssize_t)f->buf_sz;
+        if ((n = pread(f->fd, f->buf, n, f->cursor)) <= 0)
+          break;
+
+        /* Until there are two frames to tell the format by, wait for more
+         * (a buffer full of neither is scanned as MPEG audio)
+         */
+        if ((f->format == FORMAT_UNKNOWN) &&
+            ((f->format = format_detect(f->buf, n)) == FORMAT_UNKNOWN) &&
+            ((size_t)n < f->buf_sz))
+          break;
+
+        table = table_new();
+        table->format = f->format;
+        used = table_scan(table, f->buf, n, f->cursor, 0);
+        if (table->n_frames)
+          f->format = table->format;
+
+        /* The scan only stops short of the end at a frame or tag */
+        closed = (n - used >= 4);
+
+        /* A region left open last time is ended by a frame or tag */
+        if (f->pending_bytes && (used || closed) &&
+            (!table->oob.count || (table->oob.offsets[0] != f->cursor)))
+        {
+            emit_region(f, f->pending_offset, f->pending_bytes);
+            f->pending_bytes = 0;
+        }
+
+        for (i=0; i<table->oob.count; i++)
+        {
+            offset = table->oob.offsets[i];
+            len = table->oob.lengths[i];
+            if (f->pending_bytes &&
+                (offset == f->pending_offset + f->pending_bytes))
+            {
+                offset = f->pending_offset;
+                len += f->pending_bytes;
+                f->pending_bytes = 0;
+            }
+
+            /* Running into the end of what has been written so far */
+            if (!closed && (offset + len == f->cursor + used))
+            {
+                f->pending_offset = offset;
+                f->pending_bytes = len;
+            }
+            else
+              emit_region(f, offset, len);
+        }
+
+        f->n_frames += table->n_frames;
+        f->n_tags += table->tags.count;
+        f->bytes_scanned += used;
+        f->cursor += used;
+        table_free(table);
+
+        /* Nothing consumed: a tag bigger than the buffer, or not enough
+         * data yet
+         */
+        if (!used)
+        {
+            if ((size_t)n < f->buf_sz)
+              break;
+            f->buf_sz *= 2;
+            f->buf = realloc(f->buf, f->buf_sz);
+        }
+    }
+
+    save_cursor(f);
+    fflush(stdout);
+}
+
+
+/* Block until the file changes (or for a while, in case the change was not
+ * seen).  Returns 0 once the file is gone.
+ */
+static int wait_for_append(int ino)
+{
+    int                         i, n, gone;
+    char                        events[4096];
+    const struct inotify_event *ev;
+    struct pollfd               pfd;
+
+    if (ino == -1)
+    {
+        poll(NULL, 0, FOLLOW_POLL_MS);
+        return 1;
+    }
+
+    pfd.fd = ino;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, FOLLOW_POLL_MS) <= 0)
+      return 1;
+
+    gone = 0;
+    while ((n = read(ino, events, sizeof(events))) > 0)
+      for (i=0; i<n; i+=sizeof(struct inotify_event) + ev->len)
+      {
+          ev = (const struct inotify_event *)(events + i);
+          if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+            gone = 1;
+      }
+
+    return !gone;
+}
+
+
+void handle_as_follow(const char *fname, flags_t flags)
+{
+    int         ino;
+    struct stat st;
+    follow_t    f;
+
+    memset(&f, 0, sizeof(follow_t));
+    f.fname = fname;
+    if (((f.fd = open(fname, O_RDONLY)) == -1) || (fstat(f.fd, &st) == -1))
+    {
+        ERR("Could not open '%s'\n", fname);
+        return;
+    }
+
+    f.inode = st.st_ino;
+    f.cursor_name = util_output_name(fname, "follow-cursor", "txt");
+    load_cursor(&f, st.st_size);
+
+    if (flags & FLAG_EXTRACT_MODE)
+      if (!(f.oob_file = util_create_file(fname, "extracted-oob", "dat", 0)))
+        ERR("Could not create a file to store out of band data\n"
+            "Normal analysis will still occur.\n");
+
+    f.buf_sz = FOLLOW_CHUNK_SZ;
+    f.buf = malloc(f.buf_sz);
+    detect_format(&f);
+
+    /* Appends are waited for with inotify, or by checking now and then */
+    if ((ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1 &&
+        (inotify_add_watch(ino, fname, IN_MODIFY | IN_DELETE_SELF |
+                           IN_MOVE_SELF) == -1))
+    {
+        close(ino);
+        ino = -1;
+    }
+
+    signal(SIGINT, follow_signal);
+    signal(SIGTERM, follow_signal);
+
+    printf(TAG " Following '%s' (Ctrl-C to stop)\n", fname);
+    fflush(stdout);
+    do
+      follow_update(&f);
+    while (!follow_stop && wait_for_append(ino));
+
+    /* A file that has gone away will not be appended to */
+    if (!follow_stop)
+    {
+        follow_update(&f);
+        printf(TAG " '%s' was removed or renamed\n", fname);
+    }
+
+    if (f.pending_bytes)
+      printf(TAG " %" PRIu64 " bytes out-of-frame at offset %" PRIu64
+             ": not ended yet\n", f.pending_bytes, f.pending_offset);
+
+    printf(TAG " Followed %" PRIu64 " bytes: %ld frames, %ld tags, "
+           "%ld out-of-frame regions (%" PRIu64 " bytes), cursor at %"
+           PRIu64 "\n", f.bytes_scanned, f.n_frames, f.n_tags,
+           f.n_oob_regions, f.oob_bytes, f.cursor);
+
+    /* Clean */
+    if (ino != -1)
+      close(ino);
+    if (f.oob_file)
+      util_close_file(f.oob_file);
+    close(f.fd);
+    free(f.buf);
+    free(f.cursor_name);
+}
@@ -0,0 +1,44 @@
+/******************************************************************************
+ * follow.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * follow.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef FOLLOW_H_INCLUDE
+#define FOLLOW_H_INCLUDE
+
+#include "main.h"
+
+
+/* Most read (and scanned) at once, and how often a file is checked for
+ * appends when inotify is not there to say so
+ */
+#define FOLLOW_CHUNK_SZ (1024 * 1024)
+#define FOLLOW_POLL_MS  1000
+
+
+/* Analyze 'fname' and keep analyzing what is appended to it until
+ * interrupted, reporting OOB regions as they are completed.  Where it got to
+ * is saved in "<name>-follow-cursor.txt" (in the output directory, see
+ * '-o') and a later run picks up from there.
+ */
+extern void handle_as_follow(const char *fname, flags_t flags);
+
+
+#endif /* FOLLOW_H_INCLUDE */
@@ -0,0 +1,87 @@
+/******************************************************************************
+ * format.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * format.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "main.h"
+#include "format.h"
+
+
+/* Does a frame start at 'i', followed by another in the same format? */
+FORMAT_INLINE int is_chain(
+    format_t             format,
+    const unsigned char *data,
+    size_t               size,
+    size_t               i)
+{
+    int len;
+
+    if ((i + format_hdr_size(format) > size) ||
+        !format_is_sync(format, data + i) ||
+        !(len = format_frame_length(format, data + i)) ||
+        (i + len + format_hdr_size(format) > size))
+      return 0;
+
+    return format_is_sync(format, data + i + len) &&
+           format_frame_length(format, data + i + len) &&
+           (format_key(format, data + i) ==
+            format_key(format, data + i + len));
+}
+
+
+format_t format_detect(const unsigned char *data, size_t size)
+{
+    size_t    i;
+    id3_tag_t tag;
+
+    /* Cover art in a tag could pass for frames */
+    i = 0;
+    if ((size >= 10) && (data[0] == 'I') && (data[1] == 'D') &&
+        (data[2] == '3'))
+    {
+        id3_set_header(&tag, (const char *)data);
+        i = 10 + tag.size + ((tag.footer) ? 10 : 0);
+    }
+
+    for ( ; i+2<=size; i++)
+    {
+        if (data[i] != 0xFF)
+          continue;
+        if (is_chain(FORMAT_MPEG, data, size, i))
+          return FORMAT_MPEG;
+        if (is_chain(FORMAT_ADTS, data, size, i))
+          return FORMAT_ADTS;
+    }
+
+    return FORMAT_UNKNOWN;
+}
+
+
+const char *format_name(format_t format)
+{
+    switch (format)
+    {
+        case FORMAT_MPEG: return "mpeg";
+        case FORMAT_ADTS: return "adts";
+        default:          return "unknown";
+    }
+}
@@ -0,0 +1,151 @@
+/******************************************************************************
+ * format.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * format.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef FORMAT_H_INCLUDE
+#define FORMAT_H_INCLUDE
+
+#include <stddef.h>
+#include <stdint.h>
+#include "utils.h"
+
+
+/* A scanner is specialized for each format_t (main.h) at compile time: the
+ * functions below are inlined with a constant format, so the switches fold
+ * away and nothing is dispatched per byte.  Anything not set
+ * (FORMAT_UNKNOWN) is taken to be MPEG audio.
+ */
+#ifdef __GNUC__
+#define FORMAT_INLINE static inline __attribute__((always_inline))
+#else
+#define FORMAT_INLINE static inline
+#endif
+
+
+/* Bytes of a header needed to validate it and work out the frame length */
+#define FORMAT_HDR_MAX 7
+
+/* ADTS sampling frequency index to Hz (13 and up are reserved) */
+static const int adts_sample_rates[16] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+    16000, 12000, 11025, 8000,  7350,  0,     0,     0
+};
+
+#define ADTS_HDR_SF_INDEX(_h) (((_h)[2] & 0x3C) >> 2)
+#define ADTS_HDR_CRC(_h)      (!((_h)[1] & 0x01)) /* Clear: protected */
+#define ADTS_HDR_LENGTH(_h)                                     \
+    ((((_h)[3] & 0x03) << 11) | ((_h)[4] << 3) | ((_h)[5] >> 5))
+
+
+FORMAT_INLINE int format_hdr_size(format_t format)
+{
+    return (format == FORMAT_ADTS) ? 7 : 4;
+}
+
+
+/* Could a frame start with the bytes at 'h'?  Two bytes, a quick test to do
+ * before format_frame_length().
+ */
+FORMAT_INLINE int format_is_sync(format_t format, const unsigned char *h)
+{
+    if (format == FORMAT_ADTS)
+      return (h[0] == 0xFF) && ((h[1] & 0xF6) == 0xF0); /* Layer is 0 */
+    return (h[0] == 0xFF) && ((h[1] & 0xE0) == 0xE0);
+}
+
+
+/* Length of the frame (header included) starting with the
+ * format_hdr_size() bytes at 'h', or 0 if it is not a valid header
+ */
+FORMAT_INLINE int format_frame_length(format_t format, const unsigned char *h)
+{
+    int len;
+
+    if (format != FORMAT_ADTS)
+      return mp3_header_length(h);
+
+    len = ADTS_HDR_LENGTH(h);
+    if (!adts_sample_rates[ADTS_HDR_SF_INDEX(h)] ||
+        (len < ((ADTS_HDR_CRC(h)) ? 9 : 7)))
+      return 0;
+    return len;
+}
+
+
+/* Sample rate (Hz) and samples per frame of the frame with header 'h' (the
+ * first 4 bytes are enough).  ADTS frames are taken to hold one raw data
+ * block, which is all that encoders write.
+ */
+FORMAT_INLINE int format_samplerate(format_t format, const unsigned char *h)
+{
+    if (format == FORMAT_ADTS)
+      return adts_sample_rates[ADTS_HDR_SF_INDEX(h)];
+    return mp3_header_samplerate(h);
+}
+
+FORMAT_INLINE int format_samples(format_t format, const unsigned char *h)
+{
+    if (format == FORMAT_ADTS)
+      return 1024;
+    return mp3_header_samples(h);
+}
+
+
+/* Bit rate (bits/s) of a 'length' byte frame with header 'h'.  ADTS has no
+ * nominal rate, so it is worked out from the length, to the nearest 8 kbps.
+ */
+FORMAT_INLINE int format_bitrate(
+    format_t             format,
+    const unsigned char *h,
+    int                  length)
+{
+    int rate;
+
+    if (format != FORMAT_ADTS)
+      return mp3_header_bitrate(h);
+
+    rate = adts_sample_rates[ADTS_HDR_SF_INDEX(h)];
+    return ((int)((double)length * 8 * rate / 1024 / 8000 + 0.5)) * 8000;
+}
+
+
+/* What must stay the same from frame to frame: version, layer, sample rate
+ * and mono/stereo (MPEG), or profile, sample rate and channels (ADTS)
+ */
+FORMAT_INLINE uint32_t format_key(format_t format, const unsigned char *h)
+{
+    if (format == FORMAT_ADTS)
+      return ((uint32_t)(h[1] & 0x08) << 16) | ((uint32_t)(h[2] & 0xFD) << 8) |
+             (h[3] & 0xC0);
+    return ((uint32_t)(h[1] & 0x1E) << 8) | (h[2] & 0x0C) |
+           (MP3_HDR_MODE(h) == MODE_MONO);
+}
+
+
+/* The format of the first frame in 'data' followed by another of the same
+ * kind (past any ID3v2 tag at the start), or FORMAT_UNKNOWN
+ */
+extern format_t format_detect(const unsigned char *data, size_t size);
+
+extern const char *format_name(format_t format);
+
+
+#endif /* FORMAT_H_INCLUDE */
@@ -0,0 +1,287 @@
+/******************************************************************************
+ * fprint.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * fprint.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "fprint.h"
+#include "utils.h"
+
+
+#define FPRINT_K1 0x9E3779B97F4A7C15ULL
+#define FPRINT_K2 0xC2B2AE3D27D4EB4FULL
+#define ROTL64(_x, _r) (((_x) << (_r)) | ((_x) >> (64 - (_r))))
+
+
+/* A word at a time, then the murmur3 finalizer so every bit counts */
+uint64_t fprint_hash(
+    const unsigned char *data,
+    size_t               len,
+    uint64_t             seed)
+{
+    uint64_t h, v;
+
+    h = seed ^ (len * FPRINT_K1);
+    for ( ; len >= 8; data += 8, len -= 8)
+    {
+        memcpy(&v, data, 8);
+        h ^= ROTL64(v * FPRINT_K2, 31) * FPRINT_K1;
+        h = ROTL64(h, 27) * 5 + 0x52DCE729;
+    }
+
+    v = 0;
+    memcpy(&v, data, len);
+    h ^= ROTL64(v * FPRINT_K2, 31) * FPRINT_K1;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+
+void fprint_table(
+    const frame_table_t *table,
+    const unsigned char *data,
+    size_t               size,
+    fprint_t            *fp)
+{
+    size_t   i;
+    uint64_t end;
+
+    /* Frames into one hash, and the bytes between them into the other */
+    fp->audio = fp->rest = 0;
+    fp->size = size;
+    end = 0;
+    for (i=0; i<table->n_frames; i++)
+    {
+        if (table->offsets[i] > end)
+          fp->rest = fprint_hash(data + end, table->offsets[i] - end,
+                                 fp->rest);
+        fp->audio = fprint_hash(data + table->offsets[i], table->lengths[i],
+                                fp->audio);
+        end = table->offsets[i] + table->lengths[i];
+    }
+
+    if (size > end)
+      fp->rest = fprint_hash(data + end, size - end, fp->rest);
+}
+
+
+static size_t slot_of(const fprint_t *fp, size_t n_slots)
+{
+    return (fp->audio ^ fp->rest ^ (fp->size * FPRINT_K1)) & (n_slots - 1);
+}
+
+
+static int same_file(const fprint_t *a, const fprint_t *b)
+{
+    return (a->audio == b->audio) && (a->rest == b->rest) &&
+           (a->size == b->size);
+}
+
+
+/* Kept under half full */
+static void grow_slots(fprint_index_t *idx)
+{
+    size_t i, s;
+
+    free(idx->slots);
+    idx->n_slots = (idx->n_slots) ? idx->n_slots * 2 : 1024;
+    idx->slots = calloc(idx->n_slots, sizeof(size_t));
+
+    for (i=0; i<idx->n_entries; i++)
+    {
+        for (s=slot_of(&idx->entries[i].fp, idx->n_slots); idx->slots[s];
+             s=(s + 1) & (idx->n_slots - 1))
+          ;
+        idx->slots[s] = i + 1;
+    }
+}
+
+
+void fprint_index_init(fprint_index_t *idx)
+{
+    memset(idx, 0, sizeof(fprint_index_t));
+    pthread_mutex_init(&idx->lock, NULL);
+}
+
+
+/* Slot of the file that is the same as 'fp', or of the empty slot where it
+ * would go
+ */
+static size_t find_slot(const fprint_index_t *idx, const fprint_t *fp)
+{
+    size_t s;
+
+    for (s=slot_of(fp, idx->n_slots); idx->slots[s];
+         s=(s + 1) & (idx->n_slots - 1))
+      if (same_file(&idx->entries[idx->slots[s] - 1].fp, fp))
+        break;
+
+    return s;
+}
+
+
+int fprint_index_add(
+    fprint_index_t *idx,
+    const char     *path,
+    const fprint_t *fp)
+{
+    int    first;
+    size_t s;
+
+    pthread_mutex_lock(&idx->lock);
+    if (idx->n_entries * 2 >= idx->n_slots)
+      grow_slots(idx);
+
+    if (idx->n_entries == idx->alloc)
+    {
+        idx->alloc = (idx->alloc) ? idx->alloc * 2 : 1024;
+        idx->entries = realloc(idx->entries,
+                               idx->alloc * sizeof(fprint_entry_t));
+    }
+    idx->entries[idx->n_entries].fp = *fp;
+    idx->entries[idx->n_entries].path = strdup(path);
+    idx->entries[idx->n_entries].result = NULL;
+    ++idx->n_entries;
+
+    /* The same file seen before? */
+    s = find_slot(idx, fp);
+    if ((first = !idx->slots[s]))
+      idx->slots[s] = idx->n_entries;
+    pthread_mutex_unlock(&idx->lock);
+
+    return first;
+}
+
+
+void fprint_index_keep(
+    fprint_index_t   *idx,
+    const fprint_t   *fp,
+    const analysis_t *result)
+{
+    size_t          s;
+    fprint_entry_t *ent;
+
+    pthread_mutex_lock(&idx->lock);
+    if (idx->slots[s = find_slot(idx, fp)])
+    {
+        ent = &idx->entries[idx->slots[s] - 1];
+        if (!ent->result)
+          ent->result = malloc(sizeof(analysis_t));
+        *ent->result = *result;
+    }
+    pthread_mutex_unlock(&idx->lock);
+}
+
+
+/* By carrier, copies of the same file together, then by path */
+static int cmp_entries(const void *a, const void *b)
+{
+    const fprint_entry_t *x = a, *y = b;
+
+    if (x->fp.audio != y->fp.audio)
+      return (x->fp.audio < y->fp.audio) ? -1 : 1;
+    if (x->fp.rest != y->fp.rest)
+      return (x->fp.rest < y->fp.rest) ? -1 : 1;
+    if (x->fp.size != y->fp.size)
+      return (x->fp.size < y->fp.size) ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+
+long fprint_index_report(fprint_index_t *idx, FILE *out)
+{
+    long        n_groups;
+    size_t      i, j, k, n_distinct;
+    analysis_t *result;
+
+    /* The slots are no use once the entries are moved around */
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->n_slots = 0;
+    qsort(idx->entries, idx->n_entries, sizeof(fprint_entry_t), cmp_entries);
+
+    /* Each set of copies: the results of the one analyzed, under the first
+     * path, and the rest as copies of it
+     */
+    for (i=0; i<idx->n_entries; i=j)
+    {
+        result = NULL;
+        for (j=i; (j < idx->n_entries) &&
+                  same_file(&idx->entries[j].fp, &idx->entries[i].fp); j++)
+          if (idx->entries[j].result)
+            result = idx->entries[j].result;
+
+        if (result)
+          file_report(out, idx->entries[i].path, result);
+        for (k=i+1; k<j; k++)
+          fprintf(out, "dup path=%s of=%s audio_fp=%016" PRIx64 "\n",
+                  idx->entries[k].path, idx->entries[i].path,
+                  idx->entries[k].fp.audio);
+    }
+
+    n_groups = 0;
+    for (i=0; i<idx->n_entries; i=j)
+    {
+        n_distinct = 1;
+        for (j=i+1; (j < idx->n_entries) &&
+                    (idx->entries[j].fp.audio == idx->entries[i].fp.audio);
+             j++)
+          n_distinct += !same_file(&idx->entries[j-1].fp,
+                                   &idx->entries[j].fp);
+        if (j - i < 2)
+          continue;
+
+        ++n_groups;
+        fprintf(out, "group audio_fp=%016" PRIx64 " files=%zu distinct=%zu\n",
+                idx->entries[i].fp.audio, j - i, n_distinct);
+        for (k=i; k<j; k++)
+          fprintf(out, "member audio_fp=%016" PRIx64 " path=%s rest_fp=%016"
+                  PRIx64 " size=%" PRIu64 "\n", idx->entries[k].fp.audio,
+                  idx->entries[k].path, idx->entries[k].fp.rest,
+                  idx->entries[k].fp.size);
+    }
+
+    return n_groups;
+}
+
+
+void fprint_index_free(fprint_index_t *idx)
+{
+    size_t i;
+
+    for (i=0; i<idx->n_entries; i++)
+    {
+        free(idx->entries[i].path);
+        free(idx->entries[i].result);
+    }
+    free(idx->entries);
+    free(idx->slots);
+    pthread_mutex_destroy(&idx->lock);
+}
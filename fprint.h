@@ -0,0 +1,109 @@
+/******************************************************************************
+ * fprint.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * fprint.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef FPRINT_H_INCLUDE
+#define FPRINT_H_INCLUDE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "main.h"
+#include "table.h"
+
+
+/* What a file is made of: its frames (the carrier) and everything else (tags
+ * and OOB data).  Files with the same 'audio' share a carrier, and files with
+ * the same 'audio', 'rest' and 'size' are the same file.  Hashes are of host
+ * order words, so only compare them between machines of the same byte order.
+ */
+typedef struct _fprint_t
+{
+    uint64_t audio;
+    uint64_t rest;
+    uint64_t size;
+} fprint_t;
+
+
+/* Every file fingerprinted in a run, by carrier.  Only one of each set of
+ * copies is analyzed, its results are kept until the run is over and then
+ * reported under the first path of the set, so that the report does not
+ * depend on which copy got there first.
+ */
+typedef struct _fprint_entry_t
+{
+    fprint_t    fp;
+    char       *path;
+    analysis_t *result; /* Of the copy that was analyzed, NULL for the rest */
+} fprint_entry_t;
+
+typedef struct _fprint_index_t
+{
+    fprint_entry_t  *entries;
+    size_t           n_entries;
+    size_t           alloc;
+    size_t          *slots;   /* Open addressing, entry index + 1 (0: empty) */
+    size_t           n_slots;
+    pthread_mutex_t  lock;    /* Shared by the workers of a run */
+} fprint_index_t;
+
+
+/* Fast (not cryptographic) 64 bit hash of 'len' bytes, chained by 'seed' */
+extern uint64_t fprint_hash(
+    const unsigned char *data,
+    size_t               len,
+    uint64_t             seed);
+
+/* Fingerprint the 'size' bytes of 'data' indexed by 'table' */
+extern void fprint_table(
+    const frame_table_t *table,
+    const unsigned char *data,
+    size_t               size,
+    fprint_t            *fp);
+
+extern void fprint_index_init(fprint_index_t *idx);
+
+/* Add 'path' to the index.  Returns 1 if it is the first of its copies, which
+ * the caller analyzes and passes to fprint_index_keep(), or 0 for a copy of a
+ * file added before.
+ */
+extern int fprint_index_add(
+    fprint_index_t *idx,
+    const char     *path,
+    const fprint_t *fp);
+
+/* Keep the results of analyzing the first of the copies of 'fp' */
+extern void fprint_index_keep(
+    fprint_index_t   *idx,
+    const fprint_t   *fp,
+    const analysis_t *result);
+
+/* Write the "file" record of each set of copies under its first path (by
+ * strcmp()) and a "dup" record naming that path for each of the others.  Then
+ * a "group" record for each carrier shared by more than one file, followed by
+ * a "member" record for each of its files.  Returns the number of groups.
+ */
+extern long fprint_index_report(fprint_index_t *idx, FILE *out);
+
+extern void fprint_index_free(fprint_index_t *idx);
+
+
+#endif /* FPRINT_H_INCLUDE */
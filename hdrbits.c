@@ -0,0 +1,303 @@
+/******************************************************************************
+ * hdrbits.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * hdrbits.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hdrbits.h"
+#include "utils.h"
+
+
+static const hdrbits_field_t field_defs[HDRBITS_N_FIELDS] = {
+    {"protection", 16, 1},
+    {"padding",    9,  1},
+    {"private",    8,  1},
+    {"mode",       6,  2},
+    {"mode_ext",   4,  2},
+    {"copyright",  3,  1},
+    {"original",   2,  1},
+    {"emphasis",   0,  2}
+};
+
+#define PLANE(_hb, _b) ((_hb)->planes + (_b) * (_hb)->n_words)
+
+/* Valid bits of the last word of a plane */
+#define TAIL_MASK(_n) \
+    (((_n) % 64) ? ((uint64_t)1 << ((_n) % 64)) - 1 : ~(uint64_t)0)
+
+
+/* Header bits that belong to a field */
+static uint32_t field_mask(void)
+{
+    int      i;
+    uint32_t mask = 0;
+
+    for (i=0; i<HDRBITS_N_FIELDS; i++)
+      mask |= ((1u << field_defs[i].width) - 1) << field_defs[i].shift;
+
+    return mask;
+}
+
+
+/* Scatter the field bits of every header into their planes.  SSE2 does 16
+ * headers at a time: each bit in turn is shifted into the sign bit, the 16
+ * sign bits are packed down to bytes and movemask gathers them into a word.
+ */
+static void extract_planes(hdrbits_t *hb, const uint32_t *headers)
+{
+    int      b;
+    size_t   i;
+    uint32_t mask;
+#ifdef __SSE2__
+    int      m;
+    __m128i  h[4], s[4], cnt;
+#endif
+
+    mask = field_mask();
+    i = 0;
+
+#ifdef __SSE2__
+    for ( ; i+16 <= hb->n_frames; i += 16)
+    {
+        h[0] = _mm_loadu_si128((const __m128i *)(headers + i));
+        h[1] = _mm_loadu_si128((const __m128i *)(headers + i + 4));
+        h[2] = _mm_loadu_si128((const __m128i *)(headers + i + 8));
+        h[3] = _mm_loadu_si128((const __m128i *)(headers + i + 12));
+
+        for (b=0; b<32; b++)
+        {
+            if (!(mask & (1u << b)))
+              continue;
+
+            cnt = _mm_cvtsi32_si128(31 - b);
+            s[0] = _mm_sll_epi32(h[0], cnt);
+            s[1] = _mm_sll_epi32(h[1], cnt);
+            s[2] = _mm_sll_epi32(h[2], cnt);
+            s[3] = _mm_sll_epi32(h[3], cnt);
+            m = _mm_movemask_epi8(
+                    _mm_packs_epi16(_mm_packs_epi32(s[0], s[1]),
+                                    _mm_packs_epi32(s[2], s[3])));
+            PLANE(hb, b)[i / 64] |= (uint64_t)(m & 0xFFFF) << (i % 64);
+        }
+    }
+#endif
+
+    /* Whatever is left a header at a time */
+    for ( ; i<hb->n_frames; i++)
+      for (b=0; b<32; b++)
+        if ((mask & (1u << b)) && (headers[i] & (1u << b)))
+          PLANE(hb, b)[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+
+/* Frames where field 'f' has the value 'value' */
+static uint64_t count_value(const hdrbits_t *hb, const hdrbits_field_t *f,
+                            int value)
+{
+    int      k;
+    size_t   w;
+    uint64_t bits, count;
+
+    count = 0;
+    for (w=0; w<hb->n_words; w++)
+    {
+        bits = (w == hb->n_words - 1) ? TAIL_MASK(hb->n_frames) : ~(uint64_t)0;
+        for (k=0; k<f->width; k++)
+          bits &= (value & (1 << k)) ? PLANE(hb, f->shift + k)[w] :
+                                       ~PLANE(hb, f->shift + k)[w];
+        count += __builtin_popcountll(bits);
+    }
+
+    return count;
+}
+
+
+/* Runs of frames with the same value, from where the value changes */
+static void count_runs(const hdrbits_t *hb, hdrbits_field_t *f)
+{
+    int      k;
+    size_t   w;
+    uint64_t changes, p, carry, run_start, at;
+
+    f->runs = 1;
+    f->longest_run = 0;
+    run_start = 0;
+    for (w=0; w<hb->n_words; w++)
+    {
+        changes = 0;
+        for (k=0; k<f->width; k++)
+        {
+            p = PLANE(hb, f->shift + k)[w];
+            carry = (w) ? PLANE(hb, f->shift + k)[w-1] >> 63 : (p & 1);
+            changes |= p ^ ((p << 1) | carry);
+        }
+        if (w == hb->n_words - 1)
+          changes &= TAIL_MASK(hb->n_frames);
+
+        f->runs += __builtin_popcountll(changes);
+        while (changes)
+        {
+            at = w * 64 + __builtin_ctzll(changes);
+            if (at - run_start > f->longest_run)
+              f->longest_run = at - run_start;
+            run_start = at;
+            changes &= changes - 1;
+        }
+    }
+
+    if (hb->n_frames - run_start > f->longest_run)
+      f->longest_run = hb->n_frames - run_start;
+}
+
+
+/* Padding an encoder would have used: the fraction of a slot that the exact
+ * frame length has left over, accumulated over the frames
+ */
+static double expected_padding(const frame_table_t *table)
+{
+    int           rate, coef;
+    size_t        i;
+    double        slots, expected;
+    unsigned char h[4];
+
+    expected = 0.0;
+    for (i=0; i<table->n_frames; i++)
+    {
+        TABLE_HDR_BYTES(table->headers[i], h);
+        if (!(rate = mp3_header_samplerate(h)))
+          continue;
+
+        if (MP3_HDR_LAYER(h) == L1)
+          coef = 12;
+        else if (MP3_HDR_LAYER(h) == L3 && MP3_HDR_VERSION(h) != V1)
+          coef = 72;
+        else
+          coef = 144;
+
+        slots = (double)coef * mp3_header_bitrate(h) / rate;
+        expected += slots - floor(slots);
+    }
+
+    return expected;
+}
+
+
+/* Frames with a mode extension set without being joint stereo */
+static uint64_t stray_mode_ext(const hdrbits_t *hb)
+{
+    size_t   w;
+    uint64_t bits, count;
+
+    count = 0;
+    for (w=0; w<hb->n_words; w++)
+    {
+        bits = (PLANE(hb, 4)[w] | PLANE(hb, 5)[w]) &
+               ~(~PLANE(hb, 7)[w] & PLANE(hb, 6)[w]);
+        if (w == hb->n_words - 1)
+          bits &= TAIL_MASK(hb->n_frames);
+        count += __builtin_popcountll(bits);
+    }
+
+    return count;
+}
+
+
+void hdrbits_analyze(const frame_table_t *table, hdrbits_t *hb)
+{
+    int              i, v;
+    double           p, slack;
+    hdrbits_field_t *f;
+
+    memset(hb, 0, sizeof(hdrbits_t));
+    memcpy(hb->fields, field_defs, sizeof(field_defs));
+    if (!(hb->n_frames = table->n_frames))
+      return;
+
+    hb->n_words = (hb->n_frames + 63) / 64;
+    hb->planes = calloc(32 * hb->n_words, sizeof(uint64_t));
+    extract_planes(hb, table->headers);
+    hb->expected_padding = expected_padding(table);
+
+    for (i=0; i<HDRBITS_N_FIELDS; i++)
+    {
+        f = &hb->fields[i];
+        for (v=0; v < (1 << f->width); v++)
+        {
+            f->counts[v] = count_value(hb, f, v);
+            if (f->counts[v])
+            {
+                p = (double)f->counts[v] / hb->n_frames;
+                f->entropy -= p * log2(p);
+            }
+        }
+        count_runs(hb, f);
+
+        /* Encoders set these once for a file, a change or two can come from
+         * joining files, more than that is somebody talking
+         */
+        f->anomalous = f->runs > 3;
+    }
+
+    /* Padding follows the bit rate, mode extension only means something for
+     * joint stereo and emphasis 2 is reserved
+     */
+    f = &hb->fields[HDRBITS_PADDING];
+    slack = 2.0 + hb->n_frames / 100.0;
+    f->anomalous = fabs(f->counts[1] - hb->expected_padding) > slack;
+    f = &hb->fields[HDRBITS_MODE_EXT];
+    f->anomalous = stray_mode_ext(hb) > 0;
+    f = &hb->fields[HDRBITS_EMPHASIS];
+    f->anomalous = f->anomalous || f->counts[2];
+}
+
+
+uint64_t hdrbits_dump(const hdrbits_t *hb, int field, FILE *out)
+{
+    int                    k, n_bits;
+    size_t                 i;
+    unsigned char          byte;
+    const hdrbits_field_t *f = &hb->fields[field];
+
+    byte = n_bits = 0;
+    for (i=0; i<hb->n_frames; i++)
+      for (k=f->width-1; k>=0; k--)
+      {
+          byte = (byte << 1) |
+                 ((PLANE(hb, f->shift + k)[i / 64] >> (i % 64)) & 1);
+          if (++n_bits % 8 == 0)
+            fputc(byte, out);
+      }
+
+    if (n_bits % 8)
+      fputc(byte << (8 - n_bits % 8), out);
+
+    return (uint64_t)hb->n_frames * f->width;
+}
+
+
+void hdrbits_free(hdrbits_t *hb)
+{
+    free(hb->planes);
+}
@@ -0,0 +1,81 @@
+/******************************************************************************
+ * hdrbits.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * hdrbits.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef HDRBITS_H_INCLUDE
+#define HDRBITS_H_INCLUDE
+
+#include <stdio.h>
+#include <stdint.h>
+#include "main.h"
+#include "table.h"
+
+
+#define HDRBITS_N_FIELDS 8
+
+/* Fields with rules of their own */
+#define HDRBITS_PADDING  1
+#define HDRBITS_MODE_EXT 4
+#define HDRBITS_EMPHASIS 7
+
+
+/* A header field that decoders ignore (or that has little effect on them),
+ * and so could carry a covert channel one frame at a time
+ */
+typedef struct _hdrbits_field_t
+{
+    const char *name;
+    int         shift;       /* Of its lowest bit in the 32 bit header */
+    int         width;
+    uint64_t    counts[4];   /* Frames having each value */
+    uint64_t    runs;        /* Of frames with the same value */
+    uint64_t    longest_run;
+    double      entropy;     /* Bits per frame */
+    int         anomalous;
+} hdrbits_field_t;
+
+
+/* The header fields of every frame in a file, as bit-planes: bit 'i' of plane
+ * 'b' is bit 'b' of the header of frame 'i'
+ */
+typedef struct _hdrbits_t
+{
+    size_t          n_frames;
+    size_t          n_words;          /* 64 bit words in each plane */
+    uint64_t       *planes;           /* 32 planes, one for each header bit */
+    double          expected_padding; /* Padded frames an encoder would write */
+    hdrbits_field_t fields[HDRBITS_N_FIELDS];
+} hdrbits_t;
+
+
+/* Split the headers of 'table' into bit-planes and work out the statistics of
+ * each field
+ */
+extern void hdrbits_analyze(const frame_table_t *table, hdrbits_t *hb);
+
+/* Write the values of field 'field', frame by frame, as a packed bitstream
+ * (most significant bit first).  Returns the number of bits written.
+ */
+extern uint64_t hdrbits_dump(const hdrbits_t *hb, int field, FILE *out);
+
+extern void hdrbits_free(hdrbits_t *hb);
+
+
+#endif /* HDRBITS_H_INCLUDE */
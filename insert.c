@@ -23,220 +23,212 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "main.h"
 #include "utils.h"
+#include "table.h"
+#include "blocks.h"
+#include "pool.h"
+#include "walk.h"
 
 
 /* Destinations (MP3 files that the inject data is spanned across/into) */
 typedef struct _data_dest_t data_dest_t;
-struct _data_dest_t {char *fname; size_t size; int frames;};
+struct _data_dest_t {char *fname; size_t size; int frames;
+                     frame_table_t *table;};
 
 
-static int count_frames(FILE *dst)
+/* A destination's share of the payload, as planned by plan_insert() */
+typedef struct _slice_t
 {
-    int            n_frames;
-    id3_tag_t     *tag;
-    mp3_frame_t   *frame;
-    STREAM_OBJECT  type;
+    uint64_t gaps;     /* Frames that data can follow */
+    uint64_t capacity; /* gaps * the per-gap limit, or UINT64_MAX */
+    uint64_t offset;   /* Where the slice starts in the payload */
+    uint64_t bytes;
+    uint32_t seq;      /* Framed blocks written before this slice's */
+} slice_t;
 
-    n_frames = 0;
-    while ((type = util_next_mp3_frame_or_id3v2(dst, NULL, 0, 0, NULL, NULL)))
-    {
-        switch (type)
-        {
-            case STREAM_OBJECT_MP3_FRAME:
-                frame = mp3_get_frame(dst);
-                mp3_free_frame(frame);
-                ++n_frames;
-                break;
-
-            case STREAM_OBJECT_ID3V2_TAG:
-                tag = id3_get_tag(dst);
-                free(tag);
-                break;
-
-            default: break;
-        }
-    }
 
-    return n_frames;
-}
-
-
-static void inject(FILE *dst, FILE *src, FILE *out, int bytes)
+/* State shared by the workers injecting each destination */
+typedef struct _injection_t
 {
-    int            i, n_frames, n_blocks, block_sz, remainder_sz;
-    long           start, end;
-    unsigned char *buf, *block;
-    id3_tag_t     *tag;
-    mp3_frame_t   *frame;
-
-    /* Chunks of data to break src into */
-    remainder_sz = 0;
-    n_frames = count_frames(dst);
-    n_blocks = bytes / (n_frames - FRAMES_TO_IGNORE);
-    if ((n_blocks == 0) || ((block_sz = bytes / n_blocks) == 0))
-    {
-        n_blocks = 1;
-        block_sz = bytes;
-    }
-    else
-      remainder_sz = bytes % n_blocks;
+    const char        *f_or_dir_name;
+    const char        *datasrc;
+    flags_t            flags;
+    const data_dest_t *dests;
+    const slice_t     *slices;
+    uint64_t           src_sz;
+    int                n_written;
+    pthread_mutex_t    lock;
+} injection_t;
+
+
+/* Copy 'dst' to 'out' adding the next part of the slice after each frame
+ * (ignoring the first few frames).  The slice is spread evenly over the
+ * gaps, the first 'bytes % gaps' of them taking a byte more.  Everything is
+ * streamed through a fixed size buffer, however large the blocks are.  If
+ * 'framing' is given, each block is written with a header (see blocks.h).
+ */
+static void inject(
+    FILE                *dst,
+    const frame_table_t *table,
+    FILE                *src,
+    FILE                *out,
+    const slice_t       *slice,
+    block_state_t       *framing)
+{
+    size_t   i, n_frames;
+    uint64_t gap, block_sz, extra, sz, start, end;
+
+    n_frames = table->n_frames;
+    block_sz = (slice->gaps) ? slice->bytes / slice->gaps : 0;
+    extra = (slice->gaps) ? slice->bytes % slice->gaps : 0;
 
     fseek(dst, 0, SEEK_SET);
-    buf = NULL;
-    block = malloc(block_sz + remainder_sz);
 
-    for (i=0; i<n_frames; i++)
+    start = 0;
+    for (i=0; i<=n_frames; i++)
     {
-        /* Start/end read points to copy frame/tag */
-        start = ftell(dst);
-        switch (util_next_mp3_frame_or_id3v2(dst, NULL, 0, 0, NULL, NULL))
-        {
-            case STREAM_OBJECT_MP3_FRAME:
-                frame = mp3_get_frame(dst);
-                mp3_free_frame(frame);
-                break;
-
-            case STREAM_OBJECT_ID3V2_TAG:
-                tag = id3_get_tag(dst);
-                free(tag);
-                break;
-
-            default:
-                break;
-        }
-        end = ftell(dst);
+        /* Copy up to the end of this frame (tags and OOB data in front of it
+         * included), or the rest of the file after the last frame
+         */
+        if (i < n_frames)
+          end = table->offsets[i] + table->lengths[i];
+        else
+          end = table->size;
 
-        /* Copy tag/frame */
-        free(buf);
-        buf = calloc(1, end - start);
-        fseek(dst, start, SEEK_SET);
-        fread(buf, end - start, 1, dst);
-        fseek(dst, end, SEEK_SET);
-        fwrite(buf, end - start, 1, out);
+        util_copy_bytes(dst, out, end - start);
+        start = end;
 
         /* Add in data (ignoring the first 'i' frames) */
-        if (i > FRAMES_TO_IGNORE && n_blocks)
+        if (i > FRAMES_TO_IGNORE && i < n_frames)
         {
-            /* Add in remainder data if odd size */
-            if ((n_blocks - 1) == 0)
-              block_sz += remainder_sz;
-
-            fread(block, block_sz, 1, src);
-            fwrite(block, block_sz, 1, out);
-            --n_blocks;
+            gap = i - FRAMES_TO_IGNORE - 1;
+            if (!(sz = block_sz + (gap < extra)))
+              continue;
+
+            if (framing)
+              block_write(src, out, sz, framing);
+            else
+              util_copy_bytes(src, out, sz);
         }
     }
-
-    free(buf);
-    free(block);
 }
 
 
-/* Add a data destination object to the array given at index given */
-static void add_dest(
-    data_dest_t *dests,
-    int          idx,
-    const char  *fpath,
-    const char  *fname)
+/* Fills in a data destination for the mp3 'fname' (which it takes) */
+static void load_dest(data_dest_t *dest, char *fname)
 {
-    int            n_frames;
-    struct stat    st;
-    FILE          *dst;
-    mp3_frame_t   *frame;
-    id3_tag_t     *tag;
-    STREAM_OBJECT  type;
-
-    dests[idx].fname = malloc(2 + strlen(fname) + ((fpath)?strlen(fpath) : 0));
-    if (!fpath)
-      sprintf(dests[idx].fname, "%s", fname);
-    else
-      sprintf(dests[idx].fname, "%s/%s", fpath, fname);
+    struct stat st;
 
-    stat(dests[idx].fname, &st);
-    dests[idx].size = st.st_size;
+    dest->fname = fname;
+    dest->size = (stat(fname, &st) == 0) ? st.st_size : 0;
 
-    if (!(dst = fopen(dests[idx].fname, "r")))
+    /* Index the frames, the table is used again when injecting */
+    if (!(dest->table = table_scan_file(fname)))
     {
-        dests[idx].frames = 0;
+        dest->frames = 0;
         ERR("Could not open destination mp3 to obtain frame count");
         return;
     }
 
-    /* Count frames */
-    n_frames = 0;
-    while ((type = util_next_mp3_frame_or_id3v2(dst, NULL, 0, 0, NULL, NULL)))
+    dest->frames = dest->table->n_frames;
+}
+
+
+/* Destinations found so far in a directory */
+typedef struct _dest_list_t
+{
+    data_dest_t     *dests;
+    int              n_dests;
+    int              alloc;
+    pthread_mutex_t  lock;
+} dest_list_t;
+
+
+/* Worker: index a destination as soon as the walk finds it */
+static void index_dest(void *job, void *arg, int worker)
+{
+    data_dest_t  dest;
+    dest_list_t *list = arg;
+
+    load_dest(&dest, job);
+
+    pthread_mutex_lock(&list->lock);
+    if (list->n_dests == list->alloc)
     {
-        switch (type)
-        {
-            case STREAM_OBJECT_MP3_FRAME:
-                frame = mp3_get_frame(dst);
-                mp3_free_frame(frame);
-                ++n_frames;
-                break;
-
-            case STREAM_OBJECT_ID3V2_TAG:
-                tag = id3_get_tag(dst);
-                free(tag);
-                break;
-
-            default: break;
-        }
+        list->alloc = (list->alloc) ? list->alloc * 2 : 64;
+        list->dests = realloc(list->dests, list->alloc * sizeof(data_dest_t));
     }
+    list->dests[list->n_dests++] = dest;
+    pthread_mutex_unlock(&list->lock);
+}
+
+
+static void push_dest(const char *path, void *arg)
+{
+    pool_push((pool_t *)arg, strdup(path));
+}
 
-    fclose(dst);
-    dests[idx].frames = n_frames;
+
+/* By name, so the numbering of the outputs does not depend on the walk */
+static int cmp_dest(const void *a, const void *b)
+{
+    return strcmp(((const data_dest_t *)a)->fname,
+                  ((const data_dest_t *)b)->fname);
 }
 
 
 /* Returns an array of data destinations (mp3 files) that the source data is to
- * be injected into.
+ * be injected into.  A directory is searched recursively for mp3s (by their
+ * content), which are indexed by 'n_workers' threads while the search goes on.
  */
-static data_dest_t *load_data_dests(const char *f_or_dir_name, int *n_dests)
+static data_dest_t *load_data_dests(
+    const char *f_or_dir_name,
+    int        *n_dests,
+    int         n_workers)
 {
-    int            n_files;
-    DIR           *dir;
-    FILE          *dst;
-    data_dest_t   *dests;
-    struct dirent *entry;
-    struct stat    st;
-     
-    dests = NULL;
-    stat(f_or_dir_name, &st);
+    FILE        *dst;
+    pool_t      *pool;
+    dest_list_t  list;
+    struct stat  st;
 
     if (n_dests)
       *n_dests = 0;
 
+    if (stat(f_or_dir_name, &st) == -1)
+    {
+        ERR("Could not open mp3 to inject data into");
+        return NULL;
+    }
+
     /* Directory or single file */
+    memset(&list, 0, sizeof(dest_list_t));
     if (S_ISDIR(st.st_mode))
     {
-        /* Count number of MP3 files */
-        if (!(dir = opendir(f_or_dir_name)))
+        pthread_mutex_init(&list.lock, NULL);
+        if (!(pool = pool_create(n_workers, 0, index_dest, &list)))
         {
-            ERR("Could not open directory of mp3 files to inject data into");
+            pthread_mutex_destroy(&list.lock);
             return NULL;
         }
 
-        /* Assumes, by extension and not file data */
-        n_files = 0;
-        while ((entry = readdir(dir)))
-          if (strstr(entry->d_name, ".mp3"))
-            ++n_files;
-
-        /* Load */
-        dests = malloc(sizeof(data_dest_t) * n_files);
-        n_files = 0;
-        rewinddir(dir);
-        while ((entry = readdir(dir)))
-          if (strstr(entry->d_name, ".mp3"))
-            add_dest(dests, n_files++, f_or_dir_name, entry->d_name);
-
-        closedir(dir);
+        if (walk_tree(f_or_dir_name, push_dest, pool) == -1)
+          ERR("Could not open directory of mp3 files to inject data into");
+        pool_destroy(pool);
+        pthread_mutex_destroy(&list.lock);
+
+        if (list.n_dests == 0)
+        {
+            free(list.dests);
+            return NULL;
+        }
+        qsort(list.dests, list.n_dests, sizeof(data_dest_t), cmp_dest);
     }
     else /* Treat as a single file */
     {
@@ -245,17 +237,17 @@ static data_dest_t *load_data_dests(const char *f_or_dir_name, int *n_dests)
             ERR("Could not open mp3 to inject data into");
             return NULL;
         }
-
-        dests = malloc(sizeof(data_dest_t));
-        add_dest(dests, 0, NULL, f_or_dir_name);
-        n_files = 1;
         fclose(dst);
+
+        list.dests = malloc(sizeof(data_dest_t));
+        load_dest(&list.dests[0], strdup(f_or_dir_name));
+        list.n_dests = 1;
     }
 
     if (n_dests)
-      *n_dests = n_files;
+      *n_dests = list.n_dests;
 
-    return dests;
+    return list.dests;
 }
 
 
@@ -264,68 +256,244 @@ static void free_dests(data_dest_t *dests, int n_dests)
     int i;
 
     for (i=0; i<n_dests; i++)
-      free(dests[i].fname);
+    {
+        free(dests[i].fname);
+        table_free(dests[i].table);
+    }
     free(dests);
 }
 
 
-void handle_as_insert(
+/* Give each destination a slice of the payload in proportion to the gaps
+ * between its frames, no gap taking more than 'gap_limit' bytes (0 for no
+ * limit).  Returns 0 if the payload does not fit.
+ */
+static int plan_insert(
+    const data_dest_t *dests,
+    slice_t           *slices,
+    int                n_dests,
+    uint64_t           src_sz,
+    uint64_t           gap_limit)
+{
+    int      i;
+    uint64_t total_gaps, total_cap, assigned, more, offset;
+    uint32_t seq;
+
+    total_gaps = total_cap = 0;
+    for (i=0; i<n_dests; i++)
+    {
+        memset(&slices[i], 0, sizeof(slice_t));
+        if (dests[i].table && dests[i].frames > FRAMES_TO_IGNORE + 1)
+          slices[i].gaps = dests[i].frames - FRAMES_TO_IGNORE - 1;
+
+        if (!gap_limit)
+          slices[i].capacity = (slices[i].gaps) ? UINT64_MAX : 0;
+        else if (slices[i].gaps > UINT64_MAX / gap_limit)
+          slices[i].capacity = UINT64_MAX;
+        else
+          slices[i].capacity = slices[i].gaps * gap_limit;
+
+        total_gaps += slices[i].gaps;
+        total_cap = (total_cap > UINT64_MAX - slices[i].capacity) ?
+                    UINT64_MAX : total_cap + slices[i].capacity;
+    }
+
+    if (src_sz > total_cap)
+      return 0;
+    if (!total_gaps)
+      return 1;
+
+    /* In proportion to the gaps (exactly, without overflowing), then what
+     * was rounded away to whoever has room for it
+     */
+    assigned = 0;
+    for (i=0; i<n_dests; i++)
+    {
+        slices[i].bytes = (src_sz / total_gaps) * slices[i].gaps +
+                          ((src_sz % total_gaps) * slices[i].gaps) /
+                          total_gaps;
+        assigned += slices[i].bytes;
+    }
+    for (i=0; (i < n_dests) && (assigned < src_sz); i++)
+    {
+        more = slices[i].capacity - slices[i].bytes;
+        if (more > src_sz - assigned)
+          more = src_sz - assigned;
+        slices[i].bytes += more;
+        assigned += more;
+    }
+
+    /* Where each slice comes from, and how its framed blocks are numbered */
+    offset = seq = 0;
+    for (i=0; i<n_dests; i++)
+    {
+        slices[i].offset = offset;
+        slices[i].seq = seq;
+        offset += slices[i].bytes;
+        seq += (slices[i].bytes < slices[i].gaps) ? slices[i].bytes :
+                                                     slices[i].gaps;
+    }
+
+    return 1;
+}
+
+
+static void print_plan(
+    const data_dest_t *dests,
+    const slice_t     *slices,
+    int                n_dests,
+    uint64_t           src_sz,
+    int                fits)
+{
+    int      i;
+    uint64_t total_cap;
+
+    total_cap = 0;
+    for (i=0; i<n_dests; i++)
+    {
+        printf("plan path=%s frames=%d gaps=%" PRIu64, dests[i].fname,
+               dests[i].frames, slices[i].gaps);
+        if (slices[i].capacity == UINT64_MAX)
+          printf(" capacity=unlimited");
+        else
+          printf(" capacity=%" PRIu64, slices[i].capacity);
+        printf(" offset=%" PRIu64 " bytes=%" PRIu64 " per_gap=%" PRIu64
+               "\n", slices[i].offset, slices[i].bytes,
+               (slices[i].gaps) ?
+               (slices[i].bytes + slices[i].gaps - 1) / slices[i].gaps : 0);
+        total_cap = (total_cap > UINT64_MAX - slices[i].capacity) ?
+                    UINT64_MAX : total_cap + slices[i].capacity;
+    }
+
+    printf("plan destinations=%d payload=%" PRIu64, n_dests, src_sz);
+    if (total_cap == UINT64_MAX)
+      printf(" capacity=unlimited");
+    else
+      printf(" capacity=%" PRIu64, total_cap);
+    printf(" fits=%s\n", (fits) ? "yes" : "no");
+}
+
+
+/* Worker: inject one destination's slice, reading the payload through its
+ * own handle from where the slice starts
+ */
+static void inject_dest(void *job, void *arg, int worker)
+{
+    int                i = (intptr_t)job;
+    char               dest_modifier[32];
+    FILE              *dest, *src, *out;
+    injection_t       *inj = arg;
+    block_state_t      framing;
+    const slice_t     *slice = &inj->slices[i];
+    const data_dest_t *d = &inj->dests[i];
+
+    if (!d->table)
+      return;
+
+    snprintf(dest_modifier, sizeof(dest_modifier), "injected-%d", i+1);
+    if (!(src = fopen(inj->datasrc, "r")))
+    {
+        ERR("Could not open data file to read from");
+        return;
+    }
+    if (!(dest = fopen(d->fname, "r")))
+    {
+        fclose(src);
+        return;
+    }
+    if (!(out = util_create_file(inj->f_or_dir_name, dest_modifier, "mp3",
+                                 0)))
+    {
+        fclose(dest);
+        fclose(src);
+        return;
+    }
+
+    fseeko(src, slice->offset, SEEK_SET);
+    framing.seq = slice->seq;
+    framing.offset = slice->offset;
+    framing.total = inj->src_sz;
+
+    inject(dest, d->table, src, out, slice,
+           (inj->flags & FLAG_FRAMED_MODE) ? &framing : NULL);
+
+    fclose(dest);
+    util_close_file(out);
+    fclose(src);
+
+    pthread_mutex_lock(&inj->lock);
+    ++inj->n_written;
+    pthread_mutex_unlock(&inj->lock);
+}
+
+
+int handle_as_insert(
     const char *f_or_dir_name,
     flags_t     flags,
-    const char *datasrc)
+    const char *datasrc,
+    int         n_workers)
 {
-    int          i, n_dests, err;
-    char         dest_modifier[16];
-    size_t       src_sz, sz;
-    FILE         *dest, *src, *out;
-    struct stat  st;
-    data_dest_t *dests;
+    int            i, n_dests, fits;
+    uint64_t       gap_limit;
+    struct stat    st;
+    pool_t        *pool;
+    data_dest_t   *dests;
+    slice_t       *slices;
+    injection_t    inj;
 
     /* Where we pull data to insert into */
-    if (!(src = fopen(datasrc, "r")))
+    if (stat(datasrc, &st) == -1)
     {
         ERR("Could not open data file to read from");
-        return;
+        return 0;
     }
 
     /* Single file or directory? */
-    if (!(dests = load_data_dests(f_or_dir_name, &n_dests)))
-      return;
-        
-    /* Amount  of data to inject */
-    stat(datasrc, &st);
-    src_sz = st.st_size;
-    fseek(src, 0, SEEK_SET);
-
-    /* For each file we are to span accross */
-    err = 0;
-    for (i=0; i<n_dests; i++)
+    if (!(dests = load_data_dests(f_or_dir_name, &n_dests, n_workers)))
+      return 0;
+
+    /* Framed blocks are one per gap, so no bigger than a block can be */
+    gap_limit = main_gap_limit;
+    if ((flags & FLAG_FRAMED_MODE) &&
+        (!gap_limit || (gap_limit > BLOCK_MAX_DATA)))
+      gap_limit = BLOCK_MAX_DATA;
+
+    slices = malloc(n_dests * sizeof(slice_t));
+    fits = plan_insert(dests, slices, n_dests, st.st_size, gap_limit);
+    if ((flags & FLAG_DRY_RUN) || (IS_VERBOSE && fits))
+      print_plan(dests, slices, n_dests, st.st_size, fits);
+    if (!fits)
+      ERR("%" PRIu64 " bytes of data do not fit in the gaps between the "
+          "frames of '%s'\n", (uint64_t)st.st_size, f_or_dir_name);
+
+    /* Each destination is injected on its own, straight from the plan */
+    memset(&inj, 0, sizeof(injection_t));
+    if (fits && !(flags & FLAG_DRY_RUN))
     {
-        snprintf(dest_modifier, sizeof(dest_modifier), "injected-%d", i+1); 
-        out = util_create_file(f_or_dir_name, dest_modifier, "mp3", 0);
-        
-        /* Insert info between frame skipping two frames so data
-         * is not always in the first frame.
-         */
-        if (!(dest = fopen(dests[i].fname, "r")))
+        inj.f_or_dir_name = f_or_dir_name;
+        inj.datasrc = datasrc;
+        inj.flags = flags;
+        inj.dests = dests;
+        inj.slices = slices;
+        inj.src_sz = st.st_size;
+        pthread_mutex_init(&inj.lock, NULL);
+
+        if ((pool = pool_create(n_workers, 0, inject_dest, &inj)))
         {
-            ++err;
-            continue;
+            for (i=0; i<n_dests; i++)
+              pool_push(pool, (void *)(intptr_t)i);
+            pool_destroy(pool);
         }
+        else
+          for (i=0; i<n_dests; i++)
+            inject_dest((void *)(intptr_t)i, &inj, 0);
 
-        /* Last one? Add in remainder for odd sizes */
-        sz = src_sz / (n_dests - err);
-        if (i+1 == n_dests)
-          sz += src_sz % (n_dests - err);
-
-        fseek(dest, 0, SEEK_SET);
-        inject(dest, src, out, sz);
-
-        fclose(dest);
-        fclose(out);
+        pthread_mutex_destroy(&inj.lock);
     }
 
     /* Clean */
+    free(slices);
     free_dests(dests, n_dests);
-    fclose(src);
+
+    return inj.n_written;
 }
@@ -0,0 +1,236 @@
+/******************************************************************************
+ * layer3.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * layer3.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "layer3.h"
+#include "utils.h"
+
+
+/* The bit reservoir of a run of consecutive Layer III frames.  Positions are
+ * in "main data" space: the frames' data areas (what follows the side info)
+ * laid end to end, starting from the first frame of the run.
+ */
+typedef struct _reservoir_t
+{
+    size_t    first;    /* Frames in the run */
+    size_t    last;
+    size_t    n_frames;
+    uint64_t *starts;   /* Main data position of each frame's data area */
+    uint64_t  size;     /* Main data so far */
+    uint64_t  used_end; /* End of the last frame's audio */
+    int       version;
+} reservoir_t;
+
+
+static unsigned get_bits(const unsigned char *p, int *pos, int n)
+{
+    unsigned v = 0;
+
+    while (n--)
+    {
+        v = (v << 1) | ((p[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        ++*pos;
+    }
+
+    return v;
+}
+
+
+/* main_data_begin and the total length, in bits, of the frame's audio */
+static void parse_side_info(
+    const unsigned char  h[4],
+    const unsigned char *side,
+    int                 *main_data_begin,
+    int                 *main_data_bits)
+{
+    int i, pos, n_ch, n_granules, skip;
+
+    pos = 0;
+    n_ch = (MP3_HDR_MODE(h) == MODE_MONO) ? 1 : 2;
+    if (MP3_HDR_VERSION(h) == V1)
+    {
+        *main_data_begin = get_bits(side, &pos, 9);
+        pos += (n_ch == 1) ? 5 : 3; /* Private bits */
+        pos += 4 * n_ch;            /* scfsi */
+        n_granules = 2;
+        skip = 47;
+    }
+    else
+    {
+        *main_data_begin = get_bits(side, &pos, 8);
+        pos += n_ch;
+        n_granules = 1;
+        skip = 51; /* scalefac_compress is 9 bits rather than 4 */
+    }
+
+    /* part2_3_length, then the rest of the granule/channel */
+    *main_data_bits = 0;
+    for (i=0; i<n_granules*n_ch; i++)
+    {
+        *main_data_bits += get_bits(side, &pos, 12);
+        pos += skip;
+    }
+}
+
+
+/* Where frame 'i's data area is in the file */
+static void data_area(
+    const frame_table_t *table,
+    size_t               i,
+    const unsigned char  h[4],
+    uint64_t            *start,
+    uint64_t            *end)
+{
+    *start = table->offsets[i] + (MP3_HDR_CRC(h) ? 4 : 6) +
+             mp3_side_info_size(h);
+    *end = table->offsets[i] + table->lengths[i];
+}
+
+
+/* The Xing/Info and VBRI headers written by encoders live in the data area of
+ * an otherwise empty frame
+ */
+static int is_info_frame(
+    const unsigned char *frame,
+    uint64_t             area,
+    uint64_t             len)
+{
+    return ((area + 4 <= len) && (!memcmp(frame + area, "Xing", 4) ||
+                                  !memcmp(frame + area, "Info", 4))) ||
+           ((36 + 4 <= len) && !memcmp(frame + 36, "VBRI", 4));
+}
+
+
+/* Add main data positions 'from' to 'to' as file spans, 'last' is the last
+ * frame in the reservoir
+ */
+static void add_unused(
+    const frame_table_t *table,
+    const reservoir_t   *res,
+    size_t               last,
+    uint64_t             from,
+    uint64_t             to,
+    span_table_t        *anc)
+{
+    size_t        i;
+    uint64_t      start, end, a, b;
+    unsigned char h[4];
+
+    for (i=last; i>res->first && res->starts[i] > from; i--)
+      ;
+
+    for ( ; i<=last && from<to; i++)
+    {
+        TABLE_HDR_BYTES(table->headers[i], h);
+        data_area(table, i, h, &start, &end);
+        if (res->starts[i] + (end - start) <= from)
+          continue;
+
+        a = start + (from - res->starts[i]);
+        b = (res->starts[i] + (end - start) < to) ?
+            end : start + (to - res->starts[i]);
+        span_add(anc, a, b - a);
+        from += b - a;
+    }
+}
+
+
+/* Whatever follows the last frame's audio is unused */
+static void end_run(
+    const frame_table_t *table,
+    reservoir_t         *res,
+    span_table_t        *anc)
+{
+    if (res->n_frames && res->size > res->used_end)
+      add_unused(table, res, res->last, res->used_end, res->size, anc);
+
+    res->n_frames = 0;
+    res->size = 0;
+}
+
+
+void layer3_ancillary(
+    const frame_table_t *table,
+    const unsigned char *data,
+    span_table_t        *anc)
+{
+    int           usable, main_data_begin, main_data_bits;
+    size_t        i;
+    uint64_t      start, end, used;
+    unsigned char h[4];
+    reservoir_t   res;
+
+    if (!table->n_frames)
+      return;
+
+    memset(&res, 0, sizeof(reservoir_t));
+    res.starts = malloc(table->n_frames * sizeof(uint64_t));
+
+    for (i=0; i<table->n_frames; i++)
+    {
+        TABLE_HDR_BYTES(table->headers[i], h);
+
+        usable = 0;
+        if (MP3_HDR_LAYER(h) == L3)
+        {
+            data_area(table, i, h, &start, &end);
+            usable = (start < end) &&
+                     !is_info_frame(data + table->offsets[i],
+                                    start - table->offsets[i],
+                                    table->lengths[i]);
+        }
+
+        /* Anything but another Layer III frame of the same version ends the
+         * run, the reservoir does not carry over
+         */
+        if (!usable || (res.n_frames && MP3_HDR_VERSION(h) != res.version))
+          end_run(table, &res, anc);
+        if (!usable)
+          continue;
+
+        if (!res.n_frames)
+        {
+            res.first = i;
+            res.version = MP3_HDR_VERSION(h);
+        }
+        res.starts[i] = res.size;
+        parse_side_info(h, data + start - mp3_side_info_size(h),
+                        &main_data_begin, &main_data_bits);
+
+        /* Audio reaching back before the run started is not ours to judge */
+        used = (res.size > (uint64_t)main_data_begin) ?
+               res.size - main_data_begin : 0;
+        if (res.n_frames && used > res.used_end)
+          add_unused(table, &res, i, res.used_end, used, anc);
+
+        used += (main_data_bits + 7) / 8;
+        if (!res.n_frames || used > res.used_end)
+          res.used_end = used;
+        res.size += end - start;
+        res.last = i;
+        ++res.n_frames;
+    }
+
+    end_run(table, &res, anc);
+    free(res.starts);
+}
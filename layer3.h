@@ -0,0 +1,43 @@
+/******************************************************************************
+ * layer3.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * layer3.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef LAYER3_H_INCLUDE
+#define LAYER3_H_INCLUDE
+
+#include <stdint.h>
+#include "main.h"
+#include "table.h"
+
+
+/* Finds the bytes inside the Layer III frames of 'table' that no frame's
+ * audio uses: ancillary data after a frame's main data, and bit reservoir
+ * space that the next frame's main_data_begin skips over.  Only the side info
+ * is parsed, nothing is decoded.  The regions are added to 'anc' as file
+ * offsets in file order; a region split by a frame header and side info
+ * becomes two spans.  'data' holds the whole file.
+ */
+extern void layer3_ancillary(
+    const frame_table_t *table,
+    const unsigned char *data,
+    span_table_t        *anc);
+
+
+#endif /* LAYER3_H_INCLUDE */
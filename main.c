@@ -23,10 +23,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 #include "main.h"
+#include "blocks.h"
+#include "sample.h"
+#include "follow.h"
+#include "range.h"
+#include "diff.h"
 
 
 flags_t main_flags = 0;
+int     main_oob_threshold = 0;
+int     main_sample_windows = 8;
+int     main_gap_limit = 0;
+int     main_shard = 0;
+int     main_n_shards = 0;
+char   *main_output_dir = NULL;
 
 
 void usage(void)
@@ -42,11 +57,65 @@ void usage(void)
            "An MP3 analysis, data capturing, and data hiding utility\n");
 
     printf("Usage: ./mp3nema <source.mp3 | stream> "
-           "[-c] [[-e] | [-i file]] [-v]\n"
+           "[-c [-C MB] [-T secs]] [[-e] | [-i file [-g bytes] [-n]]]\n"
+           "                                          "
+           "[-F] [-x]\n"
+           "                                          "
+           "[-a] [-k] [-H] [-t score] [-s] [-D ms] [-I]\n"
+           "                                          "
+           "[-S windows[r]] [-f] [-r from-to[a]] [-u] [-o dir] [-v]\n"
+           "       ./mp3nema -e -F <injected.mp3 ...> [-j workers]\n"
+           "       ./mp3nema -e [-F] <directory> [-j workers]\n"
+           "       ./mp3nema -m <manifest | -> [-0] [-j workers] "
+           "[[-e] | [-i file]]\n"
+           "       ./mp3nema <-m manifest | directory> --shard i/N ...\n"
+           "       ./mp3nema --merge <shard results ...>\n"
+           "       ./mp3nema --diff <original.mp3> <modified.mp3>\n"
+           "       ./mp3nema -d <socket> [-j workers] [-v]\n"
            "\t-c Capture audio from network stream\n"
+           "\t-C <MB> Start a new capture file every 'MB' megabytes\n"
+           "\t-T <secs> Start a new capture file every 'secs' seconds of "
+           "audio\n"
            "\t-i <file> Inject data from 'file' into the mp3 between frames\n"
+           "\t-g <bytes> Inject no more than 'bytes' after any one frame\n"
+           "\t-n Only print how the data would be spread over the mp3s\n"
            "\t-e Extract out of band data to a file\n"
-           "\t-v Display more information (out-of-frame data)\n");
+           "\t-t <score> Only save OOB regions scoring 'score' (0-100) "
+           "or more\n"
+           "\t-F Inject/extract data as self-describing (framed) blocks\n"
+           "\t-x Save the frame index of the mp3 to a file\n"
+           "\t-a Also find/extract unused bytes inside Layer III frames\n"
+           "\t-k Verify the CRC of protected frames\n"
+           "\t-H Look for data carried in the header bits of the frames\n"
+           "\t-S <windows> Quick triage: only read the head, tail and "
+           "'windows'\n"
+           "\t   windows in between (with 'r', at random) looking for OOB "
+           "data\n"
+           "\t-r <from-to> Only look at the OOB data between two times "
+           "([[h:]m:]s), with\n"
+           "\t   'a' also save the audio in between\n"
+           "\t-u Fingerprint the audio, grouping files that share it and "
+           "skipping copies\n"
+           "\t-f Follow a growing file, analyzing data as it is appended\n"
+           "\t-s Display stream statistics and time each OOB region\n"
+           "\t-D <ms> Analyze stream data once it has waited 'ms' "
+           "milliseconds\n"
+           "\t-I Ask for ICY (Shoutcast) metadata and save it apart from "
+           "the stream\n"
+           "\t-v Display more information (out-of-frame data)\n"
+           "\t-m <manifest> Process every file listed in 'manifest' "
+           "('-' for stdin)\n"
+           "\t-0 Manifest entries are NUL terminated (e.g. find -print0)\n"
+           "\t--shard <i/N> Only process this node's share of the entries, "
+           "saving the\n"
+           "\t   results to a file (not with -u)\n"
+           "\t--merge Combine the result files of every shard into one "
+           "report\n"
+           "\t--diff List the frames, tags and OOB regions that differ "
+           "between two mp3s\n"
+           "\t-d <socket> Run as a daemon serving requests on a unix socket\n"
+           "\t-o <dir> Write output files to 'dir' (created if need be)\n"
+           "\t-j <workers> Number of worker threads (default: one per cpu)\n");
 
     exit(0);
 }
@@ -66,23 +135,56 @@ int is_file(const char *name)
 }
 
 
+int is_dir(const char *name)
+{
+    struct stat st;
+
+    return (stat(name, &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+
 int main(
     int    argc,
     char **argv)
 {
-    int   i;
-    char *datasrc, *fname;
+    int           i, n_workers, delim, n_fnames, merge, diff, audio;
+    double        from, to;
+    stream_opts_t stream_opts;
+    char         *datasrc, *fname, *sock_path, *manifest, *range, **fnames;
 
     if (argc < 2)
       usage();
 
-    fname = datasrc = NULL;
+    fname = datasrc = sock_path = manifest = range = NULL;
+    n_workers = n_fnames = merge = diff = 0;
+    memset(&stream_opts, 0, sizeof(stream_opts_t));
+    delim = '\n';
+    fnames = malloc(sizeof(char *) * argc);
 
     /* Args */
     for (i=1; i<argc; i++)
     {
+        /* Process one of 'N' shards of the entries */
+        if (strcmp(argv[i], "--shard") == 0)
+        {
+            if (i+1<argc &&
+                sscanf(argv[i+1], "%d/%d", &main_shard, &main_n_shards) == 2 &&
+                main_shard >= 1 && main_shard <= main_n_shards)
+              ++i;
+            else
+              usage();
+        }
+
+        /* Combine shard results */
+        else if (strcmp(argv[i], "--merge") == 0)
+          merge = 1;
+
+        /* Compare an mp3 with a modified copy */
+        else if (strcmp(argv[i], "--diff") == 0)
+          diff = 1;
+
         /* Insert */
-        if (strncmp(argv[i], "-i", 2) == 0)
+        else if (strncmp(argv[i], "-i", 2) == 0)
         {
             if (i+1<argc && argv[i+1][0] != '-')
             {
@@ -93,32 +195,243 @@ int main(
               usage();
         }
 
+        /* Per-gap limit for an insert */
+        else if (strncmp(argv[i], "-g", 2) == 0)
+        {
+            if (i+1<argc && atoi(argv[i+1]) > 0)
+              main_gap_limit = atoi(argv[++i]);
+            else
+              usage();
+        }
+
+        /* Plan an insert without doing it */
+        else if (strncmp(argv[i], "-n", 2) == 0)
+          main_flags |= FLAG_DRY_RUN;
+
         /* Extract to file */
         else if (strncmp(argv[i], "-e", 2) == 0)
           main_flags |= FLAG_EXTRACT_MODE;
 
+        /* Framed blocks */
+        else if (strncmp(argv[i], "-F", 2) == 0)
+          main_flags |= FLAG_FRAMED_MODE;
+
+        /* Save the frame index */
+        else if (strncmp(argv[i], "-x", 2) == 0)
+          main_flags |= FLAG_INDEX_MODE;
+
+        /* Ancillary data and bit reservoir slack */
+        else if (strncmp(argv[i], "-a", 2) == 0)
+          main_flags |= FLAG_ANCILLARY_MODE;
+
+        /* Verify frame checksums */
+        else if (strncmp(argv[i], "-k", 2) == 0)
+          main_flags |= FLAG_CRC_MODE;
+
+        /* Triage threshold */
+        else if (strncmp(argv[i], "-t", 2) == 0)
+        {
+            if (i+1<argc && argv[i+1][0] != '-')
+              main_oob_threshold = atoi(argv[++i]);
+            else
+              usage();
+        }
+
+        /* Quick triage */
+        else if (strncmp(argv[i], "-S", 2) == 0)
+        {
+            if (i+1<argc && isdigit(argv[i+1][0]))
+            {
+                main_flags |= FLAG_SAMPLE_MODE;
+                main_sample_windows = atoi(argv[++i]);
+                if (strchr(argv[i], 'r'))
+                  main_flags |= FLAG_SAMPLE_RANDOM;
+            }
+            else
+              usage();
+        }
+
+        /* Time range */
+        else if (strncmp(argv[i], "-r", 2) == 0)
+        {
+            if (i+1<argc && range_parse(argv[i+1], &from, &to, &audio))
+              range = argv[++i];
+            else
+              usage();
+        }
+
+        /* Fingerprint the audio */
+        else if (strncmp(argv[i], "-u", 2) == 0)
+          main_flags |= FLAG_FINGERPRINT;
+
+        /* Follow a growing file */
+        else if (strncmp(argv[i], "-f", 2) == 0)
+          main_flags |= FLAG_FOLLOW_MODE;
+
+        /* Header bit analysis */
+        else if (strncmp(argv[i], "-H", 2) == 0)
+          main_flags |= FLAG_HEADER_MODE;
+
+        /* Stream statistics */
+        else if (strncmp(argv[i], "-s", 2) == 0)
+          main_flags |= FLAG_STATS_MODE;
+
         /* Capture Stream */
         else if (strncmp(argv[i], "-c", 2) == 0)
           main_flags |= FLAG_CAPTURE_MODE;
 
+        /* Daemon */
+        else if (strncmp(argv[i], "-d", 2) == 0)
+        {
+            if (i+1<argc && argv[i+1][0] != '-')
+              sock_path = argv[++i];
+            else
+              usage();
+        }
+
+        /* Manifest of files to process */
+        else if (strncmp(argv[i], "-m", 2) == 0)
+        {
+            if (i+1<argc &&
+                (argv[i+1][0] != '-' || strcmp(argv[i+1], "-") == 0))
+              manifest = argv[++i];
+            else
+              usage();
+        }
+
+        /* NUL terminated manifest entries */
+        else if (strncmp(argv[i], "-0", 2) == 0)
+          delim = '\0';
+
+        /* Worker threads */
+        else if (strncmp(argv[i], "-j", 2) == 0)
+        {
+            if (i+1<argc && atoi(argv[i+1]) > 0)
+              n_workers = atoi(argv[++i]);
+            else
+              usage();
+        }
+
+        /* Output directory */
+        else if (strncmp(argv[i], "-o", 2) == 0)
+        {
+            if (i+1<argc && argv[i+1][0] != '-')
+              main_output_dir = argv[++i];
+            else
+              usage();
+        }
+
+        /* ICY metadata */
+        else if (strncmp(argv[i], "-I", 2) == 0)
+          main_flags |= FLAG_ICY_MODE;
+
+        /* Stream analysis deadline */
+        else if (strncmp(argv[i], "-D", 2) == 0)
+        {
+            if (i+1<argc && atoi(argv[i+1]) > 0)
+              stream_opts.deadline_ms = atoi(argv[++i]);
+            else
+              usage();
+        }
+
+        /* Capture segment size (in megabytes) */
+        else if (strncmp(argv[i], "-C", 2) == 0)
+        {
+            if (i+1<argc && atoi(argv[i+1]) > 0)
+              stream_opts.seg_bytes = (uint64_t)atoi(argv[++i]) << 20;
+            else
+              usage();
+        }
+
+        /* Capture segment duration (in seconds) */
+        else if (strncmp(argv[i], "-T", 2) == 0)
+        {
+            if (i+1<argc && atoi(argv[i+1]) > 0)
+              stream_opts.seg_secs = atoi(argv[++i]);
+            else
+              usage();
+        }
+
         /* Speak up! */
         else if (strncmp(argv[i], "-v", 2) == 0)
           main_flags |= FLAG_VERBOSE;
 
         /* Source file or stream */
         else if (argv[i][0] != '-')
-          fname = argv[i];
+          fname = fnames[n_fnames++] = argv[i];
+    }
+
+    /* Copies are found and grouped within a process, a shard would only see
+     * its own share of them and the merged report would differ from a
+     * single node's
+     */
+    if (main_n_shards && (main_flags & FLAG_FINGERPRINT))
+    {
+        ERR("'-u' cannot be used with '--shard', copies on different shards "
+            "would not be found\n");
+        return 1;
+    }
+
+    if (main_output_dir && (mkdir(main_output_dir, 0755) == -1) &&
+        (errno != EEXIST))
+    {
+        ERR("Could not create output directory '%s'\n", main_output_dir);
+        return 1;
+    }
+
+    if (sock_path)
+    {
+        handle_as_daemon(sock_path, main_flags, n_workers);
+        return 0;
+    }
+
+    if (merge)
+    {
+        return !handle_as_merge(fnames, n_fnames);
+    }
+
+    if (diff)
+    {
+        if (n_fnames != 2)
+          usage();
+        handle_as_diff(fnames[0], fnames[1]);
+        return 0;
+    }
+
+    if (manifest)
+    {
+        handle_as_manifest(manifest, main_flags, datasrc, delim, n_workers);
+        return 0;
     }
 
     if (!fname)
       usage();
 
-    if (main_flags & FLAG_INSERT_MODE)
-      handle_as_insert(fname, main_flags, datasrc);
+    /* Reassemble data spread across a directory by an insert */
+    if ((main_flags & FLAG_EXTRACT_MODE) && !(main_flags & FLAG_INSERT_MODE) &&
+        is_dir(fname))
+      handle_as_dir_extract(fname, main_flags, n_workers);
+
+    /* Framed blocks can be extracted from many files at once */
+    else if ((main_flags & FLAG_EXTRACT_MODE) &&
+             (main_flags & FLAG_FRAMED_MODE) &&
+             !(main_flags & FLAG_INSERT_MODE))
+      handle_as_framed_extract(fnames, n_fnames, main_flags, n_workers);
+    else if (main_flags & FLAG_INSERT_MODE)
+      handle_as_insert(fname, main_flags, datasrc, n_workers);
+    else if (is_dir(fname))
+      handle_as_tree(fname, main_flags, datasrc, n_workers);
+    else if (is_file(fname) && range)
+      handle_as_range(fname, main_flags, from, to, audio);
+    else if (is_file(fname) && (main_flags & FLAG_FOLLOW_MODE))
+      handle_as_follow(fname, main_flags);
+    else if (is_file(fname) && (main_flags & FLAG_SAMPLE_MODE))
+      handle_as_sample(fname, main_flags);
     else if (is_file(fname))
       handle_as_file(fname, main_flags);
     else
-      handle_as_stream(fname, main_flags);
-    
+      handle_as_stream(fname, main_flags, &stream_opts);
+
+    free(fnames);
     return 0;
 }
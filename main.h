@@ -23,6 +23,9 @@
 #ifndef MAIN_H_INCLUDE
 #define MAIN_H_INCLUDE
 
+#include <stdio.h>
+#include <stdint.h>
+
 
 /* Thanks to the wonderful resource found at:
  * http://mpgedit.org/mpgedit/mpeg_format/mpeghdr.htm
@@ -38,13 +41,42 @@
 #define VERSION _VER(0, 4) /* Major, Minor */
 
 /* Main Argument Flags */
-#define FLAG_INSERT_MODE  1
-#define FLAG_CAPTURE_MODE 2
-#define FLAG_EXTRACT_MODE 4
-#define FLAG_VERBOSE      8
-typedef unsigned short int flags_t;
+#define FLAG_INSERT_MODE    1
+#define FLAG_CAPTURE_MODE   2
+#define FLAG_EXTRACT_MODE   4
+#define FLAG_VERBOSE        8
+#define FLAG_QUIET          16 /* Internal: no per-region chatter on stdout */
+#define FLAG_INDEX_MODE     32
+#define FLAG_FRAMED_MODE    64
+#define FLAG_STATS_MODE     128
+#define FLAG_ICY_MODE       256
+#define FLAG_CRC_MODE       512
+#define FLAG_ANCILLARY_MODE 1024
+#define FLAG_HEADER_MODE    2048
+#define FLAG_SAMPLE_MODE    4096
+#define FLAG_SAMPLE_RANDOM  8192
+#define FLAG_FOLLOW_MODE    16384
+#define FLAG_DRY_RUN        32768
+#define FLAG_FINGERPRINT    65536
+typedef unsigned int flags_t;
 extern flags_t main_flags;
 
+/* OOB regions scoring lower than this (0-100) are not saved */
+extern int main_oob_threshold;
+
+/* Windows read between the head and tail of a file in quick triage (-S) */
+extern int main_sample_windows;
+
+/* Most bytes injected after any one frame (0 for no limit) */
+extern int main_gap_limit;
+
+/* This node's share (1..main_n_shards) of a directory or manifest run */
+extern int main_shard;
+extern int main_n_shards;
+
+/* Where output files are written (NULL for the working directory) */
+extern char *main_output_dir;
+
 /* Error Reporting */
 #define ERR(...) {fprintf(stderr, TAG "Error: " __VA_ARGS__);}
 
@@ -52,9 +84,18 @@ extern flags_t main_flags;
 #define IS_VERBOSE (main_flags & FLAG_VERBOSE)
 #define VERBOSE(...) {if (IS_VERBOSE) {printf(__VA_ARGS__);}}
 
+/* Quiet (daemon and other front ends that report results themselves) */
+#define IS_QUIET (main_flags & FLAG_QUIET)
+
 /* For array allocation */
 #define DEFAULT_BLK_SZ 512 /* Bytes */
 
+/* Buffer used when copying data between files */
+#define COPY_BUF_SZ (DEFAULT_BLK_SZ * 128) /* Bytes */
+
+/* Buffer given to each output file */
+#define OUTPUT_BUF_SZ (DEFAULT_BLK_SZ * 512) /* Bytes */
+
 /* Out of Band data (OOB) what we are looking for */
 #define OOB_BLK_SIZE DEFAULT_BLK_SZ
 
@@ -77,11 +118,20 @@ typedef struct _mp3_frame_t
 } mp3_frame_t;
 
 
+/* Framings of audio the scanners understand (see format.h) */
+typedef enum _format_t
+{
+    FORMAT_UNKNOWN,
+    FORMAT_MPEG,    /* MPEG-1/2/2.5 audio, Layers I-III */
+    FORMAT_ADTS     /* AAC in ADTS framing */
+} format_t;
+
+
 /* What we have found in the mp3 */
 typedef enum _stream_thang
 {
     STREAM_OBJECT_UNKNOWN,   /* Error */
-    STREAM_OBJECT_MP3_FRAME,
+    STREAM_OBJECT_MP3_FRAME, /* A frame, of any format */
     STREAM_OBJECT_ID3V2_TAG
 } STREAM_OBJECT;
 
@@ -91,18 +141,23 @@ typedef enum _stream_thang
 #define V1   0x3
 #define V2   0x2
 #define V2_5 0x0
+#define V_RESERVED 0x1
 
 /* MP3 Layer */
 #define MP3_HDR_LAYER(_h) ((_h[1] & 0x06) >> 1)
 #define L1 0x3
 #define L2 0x2
 #define L3 0x1
+#define L_RESERVED 0x0
 
 /* Other Header Fields */
 #define MP3_HDR_CRC(_h)         ((_h[1] & 0x01))
 #define MP3_HDR_PADDING(_h)     ((_h[2] & 0x02) >> 1)
 #define MP3_HDR_BIT_RATE(_h)    ((_h[2] & 0xF0) >> 4)
 #define MP3_HDR_SAMPLE_RATE(_h) ((_h[2] & 0x0C) >> 2)
+#define MP3_HDR_MODE(_h)        ((_h[3] & 0xC0) >> 6)
+#define MODE_JOINT_STEREO 0x1
+#define MODE_MONO         0x3
 
 
 /* Bit Rate Table
@@ -146,6 +201,78 @@ static const int sample_rate_table[][3] = {
 };
 
 
+/* Most distinct bit rates counted (MPEG audio has 14, and free format) */
+#define STATS_MAX_BITRATES 16
+
+/* What the audio is like, gathered as the frames are indexed */
+typedef struct _audio_stats_t
+{
+    uint64_t audio_bytes;    /* In frames, headers included */
+    int      min_length;     /* Of a frame */
+    int      max_length;
+    uint32_t format;         /* Version, layer, sample rate and channels */
+    long     format_changes; /* Frames in another format than the one before */
+    uint64_t first_change;   /* Offset of the first of them */
+    int      n_bitrates;
+    int      kbps[STATS_MAX_BITRATES]; /* In order, 0 for free format */
+    long     kbps_frames[STATS_MAX_BITRATES];
+} audio_stats_t;
+
+
+/* Result of analyzing a single file */
+typedef struct _analysis_t
+{
+    int      n_frames;
+    int      n_tags;
+    int      n_oob_regions;
+    long     oob_bytes;
+    int      oob_max_score;   /* Highest triage score of a region (triage.h) */
+    int      n_oob_kept;      /* Regions scoring at least main_oob_threshold */
+    int      n_anc_regions;   /* Unused bytes inside Layer III frames */
+    long     anc_bytes;
+    int      n_crc_checked;   /* Protected frames whose CRC was verified */
+    int      n_crc_failed;
+    int      n_hdr_anomalies; /* Header fields that look like they carry data */
+    uint64_t audio_fp;        /* Fingerprints (see fprint.h), with -u */
+    uint64_t rest_fp;
+    format_t format;          /* Of the frames */
+    double   secs;            /* Of audio */
+    audio_stats_t stats;      /* Bit rates, frame sizes and format */
+    int      is_copy;         /* Of a file already analyzed, so it was not */
+} analysis_t;
+
+
+/* Operations understood by the daemon and manifest front ends */
+typedef enum _request_op
+{
+    REQUEST_UNKNOWN,
+    REQUEST_ANALYZE,
+    REQUEST_EXTRACT,
+    REQUEST_INSERT
+} REQUEST_OP;
+
+
+/* A single analyze/extract/insert request */
+struct _fprint_index_t;
+
+typedef struct _request_t
+{
+    REQUEST_OP              op;
+    const char             *path;    /* To analyze/extract, or insert into */
+    const char             *datasrc; /* Insert only: data to inject */
+    struct _fprint_index_t *seen;    /* Analyze only: -u files (fprint.h) */
+} request_t;
+
+
+/* How a stream is analyzed and captured */
+typedef struct _stream_opts_t
+{
+    int      deadline_ms; /* Analyze data once it has waited this long */
+    uint64_t seg_bytes;   /* Start a new capture file after this many bytes */
+    int      seg_secs;    /* ... or this many seconds of audio */
+} stream_opts_t;
+
+
 /* ID3v2 Tag */
 typedef struct _tag
 {
@@ -155,10 +282,12 @@ typedef struct _tag
 } id3_tag_t;
 
 
-#define ID3_HDR_EXTENDED(_h) ((_h[2] & 0x40) >> 4)
-#define ID3_HDR_FOOTER(_h)   ((_h[2] & 0x10) >> 4)
-#define ID3_HDR_SIZE(_h)  \
-    (((_h[6] << 23) | (_h[7] << 16)) | ((_h[8] << 7) | (_h[9])))
+/* Flags are in byte 5, and the size is "syncsafe" (7 bits per byte) */
+#define ID3_HDR_EXTENDED(_h) ((_h[5] & 0x40) >> 6)
+#define ID3_HDR_FOOTER(_h)   ((_h[5] & 0x10) >> 4)
+#define ID3_HDR_SIZE(_h)                                  \
+    ((((_h[6] & 0x7F) << 21) | ((_h[7] & 0x7F) << 14)) |  \
+     (((_h[8] & 0x7F) << 7)  |  (_h[9] & 0x7F)))
 
 
 /* 
@@ -166,18 +295,100 @@ typedef struct _tag
  */
 
 /* Handle the fname as a directory or single mp3 file that data from 'datasrc'
- * file is to be injected into
+ * file is to be injected into, using 'n_workers' threads (0 means one per
+ * cpu).  Returns the number of files written.
  */ 
-extern void handle_as_insert(
+extern int handle_as_insert(
     const char *f_or_dir_name,
     flags_t     flags,
-    const char *datasrc);
+    const char *datasrc,
+    int         n_workers);
 
 /* Handle the name as a mp3 file */
 extern void handle_as_file(const char *fname, flags_t flags);
 
+/* Analyze (and extract OOB data from, if requested in 'flags') a single mp3
+ * file without displaying the results.  With FLAG_FINGERPRINT and 'seen', the
+ * file is added to 'seen' and a copy of a file already there is only
+ * fingerprinted ('is_copy' is set), else its results are kept there (see
+ * fprint.h).  Returns 1 on success, 0 otherwise.
+ */
+extern int file_analyze(
+    const char             *fname,
+    flags_t                 flags,
+    analysis_t             *result,
+    struct _fprint_index_t *seen);
+
+/* Write the results from file_analyze() as a single "key=value" record */
+extern void file_report(
+    FILE             *out,
+    const char       *fname,
+    const analysis_t *result);
+
+/* Extract the OOB data from the numbered files written by handle_as_insert()
+ * found in 'dirname', in order, into a single file.  Returns 1 on success.
+ */
+extern int handle_as_dir_extract(
+    const char *dirname,
+    flags_t     flags,
+    int         n_workers);
+
+/* Listen on the unix domain socket 'sock_path' and serve requests using a pool
+ * of 'n_workers' threads (0 means one per cpu)
+ */
+extern void handle_as_daemon(
+    const char *sock_path,
+    flags_t     flags,
+    int         n_workers);
+
+/* Process every file listed in 'manifest' ("-" for stdin), one entry per
+ * 'delim' terminated record, using 'n_workers' threads.  An entry is either a
+ * request line or a bare path, bare paths are analyzed (or extracted/injected
+ * into with 'datasrc' depending on 'flags').
+ */
+extern void handle_as_manifest(
+    const char *manifest,
+    flags_t     flags,
+    const char *datasrc,
+    int         delim,
+    int         n_workers);
+
+/* Same as handle_as_manifest(), for every mp3 under 'dirname', which are
+ * processed as they are found
+ */
+extern void handle_as_tree(
+    const char *dirname,
+    flags_t     flags,
+    const char *datasrc,
+    int         n_workers);
+
+/* Combine the result files of a sharded (--shard) run into the records and
+ * summary a single node would have written, ordered by path.  Returns 0,
+ * writing nothing, if a shard is missing, given twice or not a finished
+ * result of the same sharding.
+ */
+extern int handle_as_merge(char **fnames, int n_fnames);
+
+/* Parse a request line of the form "<op> <path>[\t<datasrc>]" in place.  The
+ * line is not modified if it does not start with a known operation.
+ */
+extern int request_parse(char *line, request_t *req);
+
+/* Run a request, writing result records to 'out'.  If 'analysis' is given,
+ * the analysis results are stored there.  An analysis with 'seen' set is
+ * reported by fprint_index_report() instead.  Returns 1 on success.
+ */
+extern int request_run(
+    const request_t *req,
+    flags_t          flags,
+    FILE            *out,
+    analysis_t      *analysis);
+
 /* Only scan the incoming data for OOB info */
-extern void handle_as_stream(const char *url, flags_t flags);
+extern void handle_as_stream(
+    const char          *url,
+    flags_t              flags,
+    const stream_opts_t *opts);
 
 
 #endif /* MAIN_H_INCLUDE */
@@ -0,0 +1,641 @@
+/******************************************************************************
+ * manifest.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * manifest.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "main.h"
+#include <inttypes.h>
+#include "pool.h"
+#include "fprint.h"
+#include "utils.h"
+#include "walk.h"
+
+
+/* Totals across every entry in the manifest */
+typedef struct _summary_t
+{
+    long n_files;
+    long n_ok;
+    long n_failed;
+    long n_frames;
+    long n_tags;
+    long n_oob_files;
+    long n_oob_regions;
+    long oob_bytes;
+    long n_oob_kept;
+    long n_anc_regions;
+    long anc_bytes;
+    long n_crc_checked;
+    long n_crc_failed;
+    long n_hdr_anomalies;
+    long n_duplicates;
+    long n_groups;
+    long audio_secs;
+    long n_format_changed; /* Files whose format changes mid-file */
+} summary_t;
+
+
+/* A record line and the part of it it is ordered by */
+typedef struct _merge_rec_t
+{
+    char       *line;
+    const char *key;
+} merge_rec_t;
+
+
+/* Records held until they are all in, then written in order, so that a run
+ * on one node and the merged results of a sharded one are the same
+ */
+typedef struct _record_set_t
+{
+    merge_rec_t *recs;
+    long         count;
+    long         alloc;
+} record_set_t;
+
+
+/* By path, then by the whole line, so the order does not depend on which
+ * node or worker got to a file first
+ */
+static int cmp_records(const void *a, const void *b)
+{
+    int                c;
+    const merge_rec_t *x = a, *y = b;
+
+    if ((c = strcmp(x->key, y->key)))
+      return c;
+    return strcmp(x->line, y->line);
+}
+
+
+/* Add the 'len' byte record 'line' (not NUL terminated) */
+static void record_add(record_set_t *set, const char *line, size_t len)
+{
+    merge_rec_t *rec;
+
+    if (set->count == set->alloc)
+    {
+        set->alloc = (set->alloc) ? set->alloc * 2 : 1024;
+        set->recs = realloc(set->recs, set->alloc * sizeof(merge_rec_t));
+    }
+
+    rec = &set->recs[set->count++];
+    rec->line = strndup(line, len);
+    if (!(rec->key = strstr(rec->line, " path=")))
+      rec->key = rec->line;
+}
+
+
+/* Move every record of 'src' to 'dst' */
+static void record_move(record_set_t *dst, record_set_t *src)
+{
+    long i;
+
+    for (i=0; i<src->count; i++)
+    {
+        if (dst->count == dst->alloc)
+        {
+            dst->alloc = (dst->alloc) ? dst->alloc * 2 : 1024;
+            dst->recs = realloc(dst->recs, dst->alloc * sizeof(merge_rec_t));
+        }
+        dst->recs[dst->count++] = src->recs[i];
+    }
+    free(src->recs);
+    memset(src, 0, sizeof(record_set_t));
+}
+
+
+/* Write the records in order to 'out' (unless NULL) and free them */
+static void record_flush(record_set_t *set, FILE *out)
+{
+    long i;
+
+    if (out)
+      qsort(set->recs, set->count, sizeof(merge_rec_t), cmp_records);
+    for (i=0; i<set->count; i++)
+    {
+        if (out)
+          fprintf(out, "%s\n", set->recs[i].line);
+        free(set->recs[i].line);
+    }
+    free(set->recs);
+    memset(set, 0, sizeof(record_set_t));
+}
+
+
+/* State shared by all workers, the record buffers are per worker */
+typedef struct _manifest_t
+{
+    flags_t          flags;
+    const char      *datasrc;
+    FILE           **records;
+    char           **record_bufs;
+    size_t          *record_szs;
+    summary_t        summary;
+    int              n_workers;
+    FILE            *out;      /* Where records go, a shard's result file */
+    int              shard;    /* 1..n_shards, or 0 when not sharding */
+    int              n_shards;
+    record_set_t     results;  /* Of every entry, written at the end */
+    fprint_index_t   fprints;  /* With -u, every file analyzed so far */
+    pthread_mutex_t  lock;
+} manifest_t;
+
+
+/* Deterministic: the same path lands in the same shard on every node */
+static int shard_of(const char *path, int n_shards)
+{
+    uint64_t hash = 14695981039346656037ULL; /* FNV-1a */
+
+    while (*path)
+      hash = (hash ^ (unsigned char)*path++) * 1099511628211ULL;
+
+    return (int)(hash % (uint64_t)n_shards) + 1;
+}
+
+
+static void process_entry(void *job, void *arg, int worker)
+{
+    int         ok, dup;
+    long        len;
+    char       *line = job, *c, *nl;
+    FILE       *rec;
+    manifest_t *man = arg;
+    request_t   req;
+    analysis_t  result;
+
+    /* Bare paths get the operation selected on the command line */
+    if (!request_parse(line, &req))
+    {
+        if (man->flags & FLAG_INSERT_MODE)
+          req.op = REQUEST_INSERT;
+        else if (man->flags & FLAG_EXTRACT_MODE)
+          req.op = REQUEST_EXTRACT;
+        else
+          req.op = REQUEST_ANALYZE;
+        req.path = line;
+        req.datasrc = man->datasrc;
+    }
+
+    /* Another node's share */
+    if (man->n_shards && (shard_of(req.path, man->n_shards) != man->shard))
+    {
+        free(line);
+        return;
+    }
+
+    /* Collect this entry's records so they are not interleaved with others */
+    rec = man->records[worker];
+    rewind(rec);
+
+    /* A copy of a file already analyzed is not analyzed again, and all are
+     * reported once the run is over
+     */
+    if ((man->flags & FLAG_FINGERPRINT) && (req.op == REQUEST_ANALYZE))
+      req.seen = &man->fprints;
+
+    if (!(ok = (req.datasrc || req.op != REQUEST_INSERT) &&
+               request_run(&req, man->flags, rec, &result)))
+      fprintf(rec, "err path=%s\n", req.path);
+    dup = ok && result.is_copy;
+    fflush(rec);
+    len = ftell(rec);
+
+    pthread_mutex_lock(&man->lock);
+    for (c=man->record_bufs[worker]; c<man->record_bufs[worker] + len;
+         c=nl + 1)
+    {
+        if (!(nl = memchr(c, '\n', man->record_bufs[worker] + len - c)))
+          nl = man->record_bufs[worker] + len;
+        if (nl > c)
+          record_add(&man->results, c, nl - c);
+    }
+
+    ++man->summary.n_files;
+    if (dup)
+    {
+        ++man->summary.n_ok;
+        ++man->summary.n_duplicates;
+    }
+    else if (ok)
+    {
+        ++man->summary.n_ok;
+        man->summary.n_frames += result.n_frames;
+        man->summary.n_tags += result.n_tags;
+        man->summary.n_oob_regions += result.n_oob_regions;
+        man->summary.oob_bytes += result.oob_bytes;
+        man->summary.n_oob_kept += result.n_oob_kept;
+        man->summary.n_anc_regions += result.n_anc_regions;
+        man->summary.anc_bytes += result.anc_bytes;
+        man->summary.n_crc_checked += result.n_crc_checked;
+        man->summary.n_crc_failed += result.n_crc_failed;
+        man->summary.n_hdr_anomalies += result.n_hdr_anomalies;
+        man->summary.audio_secs += (long)(result.secs + 0.5);
+        if (result.oob_bytes)
+          ++man->summary.n_oob_files;
+        if (result.stats.format_changes)
+          ++man->summary.n_format_changed;
+    }
+    else
+      ++man->summary.n_failed;
+    pthread_mutex_unlock(&man->lock);
+
+    free(line);
+}
+
+
+/* The per worker record buffers */
+static void free_records(manifest_t *man)
+{
+    int i;
+
+    for (i=0; i<man->n_workers; i++)
+    {
+        fclose(man->records[i]);
+        free(man->record_bufs[i]);
+    }
+    free(man->records);
+    free(man->record_bufs);
+    free(man->record_szs);
+}
+
+
+/* Start the workers, 'man' is set up for them.  With --shard the records
+ * go to a result file named after 'source' instead of stdout.
+ */
+static pool_t *start_workers(
+    manifest_t *man,
+    const char *source,
+    flags_t     flags,
+    const char *datasrc,
+    int         n_workers)
+{
+    int     i;
+    char    desc[64], *name;
+    pool_t *pool;
+
+    /* Results are written as records, not per-region chatter */
+    main_flags |= FLAG_QUIET;
+
+    memset(man, 0, sizeof(manifest_t));
+    man->flags = flags | FLAG_QUIET;
+    man->datasrc = datasrc;
+    man->n_workers = n_workers;
+    man->out = stdout;
+    if ((man->n_shards = main_n_shards))
+    {
+        man->shard = main_shard;
+        snprintf(desc, sizeof(desc), "shard-%d-of-%d", man->shard,
+                 man->n_shards);
+        if (strcmp(source, "-") == 0)
+          source = NAME;
+        if (!(man->out = util_create_file_named(source, desc, "txt", 0,
+                                                &name)))
+          return NULL;
+        printf(TAG " Shard %d/%d: %s\n", man->shard, man->n_shards, name);
+        free(name);
+    }
+    man->records = malloc(n_workers * sizeof(FILE *));
+    man->record_bufs = calloc(n_workers, sizeof(char *));
+    man->record_szs = calloc(n_workers, sizeof(size_t));
+    for (i=0; i<n_workers; i++)
+      man->records[i] = open_memstream(&man->record_bufs[i],
+                                       &man->record_szs[i]);
+    pthread_mutex_init(&man->lock, NULL);
+    fprint_index_init(&man->fprints);
+
+    if (!(pool = pool_create(n_workers, n_workers * 64, process_entry, man)))
+    {
+        ERR("Could not start manifest workers\n");
+        if (man->out != stdout)
+          util_close_file(man->out);
+        free_records(man);
+        fprint_index_free(&man->fprints);
+        pthread_mutex_destroy(&man->lock);
+    }
+
+    return pool;
+}
+
+
+/* Wait for the workers to finish, then write the summary */
+static void finish_workers(manifest_t *man, pool_t *pool)
+{
+    pool_destroy(pool);
+    record_flush(&man->results, man->out);
+
+    /* Files sharing a carrier, whose OOB data is worth comparing */
+    if (man->flags & FLAG_FINGERPRINT)
+      man->summary.n_groups = fprint_index_report(&man->fprints, man->out);
+
+    fprintf(man->out, "summary files=%ld ok=%ld failed=%ld frames=%ld "
+            "tags=%ld oob_files=%ld oob_regions=%ld oob_bytes=%ld "
+            "oob_kept=%ld anc_regions=%ld anc_bytes=%ld crc_checked=%ld "
+            "crc_failed=%ld hdr_anomalies=%ld duplicates=%ld groups=%ld "
+            "audio_secs=%ld format_changed=%ld\n",
+            man->summary.n_files, man->summary.n_ok, man->summary.n_failed,
+            man->summary.n_frames, man->summary.n_tags,
+            man->summary.n_oob_files, man->summary.n_oob_regions,
+            man->summary.oob_bytes, man->summary.n_oob_kept,
+            man->summary.n_anc_regions, man->summary.anc_bytes,
+            man->summary.n_crc_checked, man->summary.n_crc_failed,
+            man->summary.n_hdr_anomalies, man->summary.n_duplicates,
+            man->summary.n_groups, man->summary.audio_secs,
+            man->summary.n_format_changed);
+
+    /* Last, so that a shard cut short is not mistaken for a finished one */
+    if (man->n_shards)
+    {
+        fprintf(man->out, "shard index=%d count=%d\n", man->shard,
+                man->n_shards);
+        util_close_file(man->out);
+    }
+
+    /* Clean */
+    free_records(man);
+    fprint_index_free(&man->fprints);
+    pthread_mutex_destroy(&man->lock);
+}
+
+
+void handle_as_manifest(
+    const char *manifest,
+    flags_t     flags,
+    const char *datasrc,
+    int         delim,
+    int         n_workers)
+{
+    char       *line;
+    size_t      line_sz;
+    ssize_t     len;
+    FILE       *fp;
+    pool_t     *pool;
+    manifest_t  man;
+
+    if (strcmp(manifest, "-") == 0)
+      fp = stdin;
+    else if (!(fp = fopen(manifest, "r")))
+    {
+        ERR("Could not open manifest '%s'\n", manifest);
+        return;
+    }
+
+    if (n_workers < 1)
+      n_workers = pool_n_cpus();
+
+    if (!(pool = start_workers(&man, manifest, flags, datasrc,
+                               n_workers)))
+    {
+        if (fp != stdin)
+          fclose(fp);
+        return;
+    }
+
+    /* Entries are handed to the workers as they are read */
+    line = NULL;
+    line_sz = 0;
+    while ((len = getdelim(&line, &line_sz, delim, fp)) > 0)
+    {
+        if (line[len-1] == delim)
+          line[--len] = '\0';
+        if (len && line[len-1] == '\r' && delim == '\n')
+          line[--len] = '\0';
+        if (len)
+          pool_push(pool, strdup(line));
+    }
+
+    finish_workers(&man, pool);
+
+    /* Clean */
+    free(line);
+    if (fp != stdin)
+      fclose(fp);
+}
+
+
+static void push_path(const char *path, void *arg)
+{
+    pool_push((pool_t *)arg, strdup(path));
+}
+
+
+void handle_as_tree(
+    const char *dirname,
+    flags_t     flags,
+    const char *datasrc,
+    int         n_workers)
+{
+    pool_t     *pool;
+    manifest_t  man;
+
+    if (n_workers < 1)
+      n_workers = pool_n_cpus();
+
+    if (!(pool = start_workers(&man, dirname, flags, datasrc,
+                               n_workers)))
+      return;
+
+    /* Files are handed to the workers as they are found */
+    if (walk_tree(dirname, push_path, pool) == -1)
+      ERR("Could not open directory '%s'\n", dirname);
+
+    finish_workers(&man, pool);
+}
+
+
+/* Add the "key=value" counts of a summary record to 'totals', keeping the
+ * order the keys were first seen in
+ */
+static void add_summary(const char *line, char ***keys, long **totals)
+{
+    int   i;
+    long  val;
+    char *key, *eq, *save, *copy;
+
+    copy = strdup(line);
+    strtok_r(copy, " ", &save);
+    while ((key = strtok_r(NULL, " ", &save)))
+    {
+        if (!(eq = strchr(key, '=')))
+          break;
+        *eq = '\0';
+        val = strtol(eq + 1, NULL, 10);
+        for (i=0; (*keys)[i] && strcmp((*keys)[i], key); i++)
+          ;
+        if (!(*keys)[i])
+        {
+            *keys = realloc(*keys, (i + 2) * sizeof(char *));
+            *totals = realloc(*totals, (i + 1) * sizeof(long));
+            (*keys)[i] = strdup(key);
+            (*keys)[i+1] = NULL;
+            (*totals)[i] = 0;
+        }
+        (*totals)[i] += val;
+    }
+
+    free(copy);
+}
+
+
+/* Read one shard result file, its records into 'file_recs' and its summary
+ * into '*summary'.  Returns the shard's index once its closing record has
+ * been checked against the others, else 0.
+ */
+static int read_shard(
+    const char    *fname,
+    int           *n_shards,
+    int          **seen,
+    record_set_t  *file_recs,
+    char         **summary)
+{
+    int      index, count;
+    char    *line;
+    size_t   line_sz;
+    ssize_t  len;
+    FILE    *fp;
+
+    if (!(fp = fopen(fname, "r")))
+    {
+        ERR("Could not open shard result '%s'\n", fname);
+        return 0;
+    }
+
+    index = 0;
+    line = NULL;
+    line_sz = 0;
+    while ((len = getline(&line, &line_sz, fp)) > 0)
+    {
+        if (line[len-1] == '\n')
+          line[--len] = '\0';
+        if (!len)
+          continue;
+
+        /* The last record, nothing of the file counts without it */
+        if (strncmp(line, "shard ", 6) == 0)
+        {
+            if ((sscanf(line, "shard index=%d count=%d", &index,
+                        &count) != 2) || (count < 1) || (index < 1) ||
+                (index > count) || (*n_shards && (count != *n_shards)))
+            {
+                ERR("'%s' is not a result of the same sharding as the "
+                    "others\n", fname);
+                index = -1;
+            }
+            else
+            {
+                if (!*n_shards)
+                  *seen = calloc((*n_shards = count) + 1, sizeof(int));
+                if ((*seen)[index]++)
+                {
+                    ERR("Shard %d/%d was given more than once ('%s')\n",
+                        index, count, fname);
+                    index = -1;
+                }
+            }
+            break;
+        }
+        else if (strncmp(line, "summary ", 8) == 0)
+        {
+            free(*summary);
+            *summary = strdup(line);
+        }
+        else
+          record_add(file_recs, line, len);
+    }
+
+    if (index == 0)
+      ERR("'%s' is not a finished shard result\n", fname);
+
+    free(line);
+    fclose(fp);
+    return (index > 0) ? index : 0;
+}
+
+
+int handle_as_merge(char **fnames, int n_fnames)
+{
+    int           i, ok, n_shards, *seen;
+    long         *totals;
+    char         *summary, **keys;
+    record_set_t  recs, file_recs;
+
+    ok = 1;
+    n_shards = 0;
+    seen = NULL;
+    memset(&recs, 0, sizeof(record_set_t));
+    keys = calloc(1, sizeof(char *));
+    totals = NULL;
+
+    /* A file's records and summary only count once it has been accepted */
+    for (i=0; i<n_fnames; i++)
+    {
+        memset(&file_recs, 0, sizeof(record_set_t));
+        summary = NULL;
+        if (read_shard(fnames[i], &n_shards, &seen, &file_recs, &summary))
+        {
+            record_move(&recs, &file_recs);
+            if (summary)
+              add_summary(summary, &keys, &totals);
+        }
+        else
+        {
+            record_flush(&file_recs, NULL);
+            ok = 0;
+        }
+        free(summary);
+    }
+
+    for (i=1; i<=n_shards; i++)
+      if (!seen[i])
+      {
+          ERR("Shard %d/%d is missing\n", i, n_shards);
+          ok = 0;
+      }
+
+    /* One report, as a single node would have written it, or none at all */
+    if (ok && n_shards)
+    {
+        record_flush(&recs, stdout);
+        printf("summary");
+        for (i=0; keys[i]; i++)
+          printf(" %s=%ld", keys[i], totals[i]);
+        printf("\n");
+    }
+    else
+    {
+        ERR("The results are incomplete, nothing was merged\n");
+        record_flush(&recs, NULL);
+        ok = 0;
+    }
+
+    /* Clean */
+    for (i=0; keys[i]; i++)
+      free(keys[i]);
+    free(keys);
+    free(totals);
+    free(seen);
+
+    return ok;
+}
@@ -0,0 +1,179 @@
+/******************************************************************************
+ * pool.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * pool.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pool.h"
+
+
+/* Worker identity (each thread needs to know its index) */
+typedef struct _worker_t
+{
+    pool_t *pool;
+    int     idx;
+} worker_t;
+
+
+struct _pool_t
+{
+    pthread_mutex_t  lock;
+    pthread_cond_t   not_empty;
+    pthread_cond_t   not_full;
+    pthread_t       *threads;
+    worker_t        *workers;
+    int              n_threads;
+    void           **queue;   /* Ring buffer of jobs */
+    int              queue_sz;
+    int              head;
+    int              count;
+    int              done;
+    pool_fn_t        fn;
+    void            *arg;
+};
+
+
+static void *worker_main(void *data)
+{
+    void     *job;
+    worker_t *me = data;
+    pool_t   *pool = me->pool;
+
+    for ( ;; )
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->count && !pool->done)
+          pthread_cond_wait(&pool->not_empty, &pool->lock);
+
+        /* Only quit once the queue has drained */
+        if (!pool->count)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_sz;
+        --pool->count;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->fn(job, pool->arg, me->idx);
+    }
+
+    return NULL;
+}
+
+
+int pool_n_cpus(void)
+{
+    long n;
+
+    if ((n = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+      return 1;
+
+    return (int)n;
+}
+
+
+pool_t *pool_create(
+    int        n_threads,
+    int        queue_sz,
+    pool_fn_t  fn,
+    void      *arg)
+{
+    int     i;
+    pool_t *pool;
+
+    if (n_threads < 1)
+      n_threads = pool_n_cpus();
+    if (queue_sz < 1)
+      queue_sz = n_threads * 2;
+
+    pool = calloc(1, sizeof(pool_t));
+    pool->queue = malloc(sizeof(void *) * queue_sz);
+    pool->queue_sz = queue_sz;
+    pool->fn = fn;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    pool->threads = malloc(sizeof(pthread_t) * n_threads);
+    pool->workers = malloc(sizeof(worker_t) * n_threads);
+    for (i=0; i<n_threads; i++)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].idx = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main,
+                           &pool->workers[i]))
+          break;
+    }
+
+    /* Run with what we could get */
+    pool->n_threads = i;
+    if (pool->n_threads == 0)
+    {
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+
+void pool_push(pool_t *pool, void *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->queue_sz)
+      pthread_cond_wait(&pool->not_full, &pool->lock);
+
+    pool->queue[(pool->head + pool->count) % pool->queue_sz] = job;
+    ++pool->count;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void pool_destroy(pool_t *pool)
+{
+    int i;
+
+    if (!pool)
+      return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=0; i<pool->n_threads; i++)
+      pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->queue);
+    free(pool);
+}
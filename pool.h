@@ -0,0 +1,56 @@
+/******************************************************************************
+ * pool.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * pool.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef POOL_H_INCLUDE
+#define POOL_H_INCLUDE
+
+
+/* Called by a worker thread for each job pushed onto the pool.  'worker' is
+ * the index (0 to n_threads-1) of the thread running the job, so callers can
+ * keep per-thread buffers around between jobs.
+ */
+typedef void (*pool_fn_t)(void *job, void *arg, int worker);
+
+
+/* Fixed set of worker threads pulling jobs from a bounded queue */
+typedef struct _pool_t pool_t;
+
+
+/* Number of online processors, at least 1 */
+extern int pool_n_cpus(void);
+
+/* Starts 'n_threads' workers that call 'fn' for each job.  At most 'queue_sz'
+ * jobs can be waiting, pool_push() blocks after that.
+ */
+extern pool_t *pool_create(
+    int        n_threads,
+    int        queue_sz,
+    pool_fn_t  fn,
+    void      *arg);
+
+/* Queue a job, blocks while the queue is full */
+extern void pool_push(pool_t *pool, void *job);
+
+/* Run all queued jobs, then stop and free the workers */
+extern void pool_destroy(pool_t *pool);
+
+
+#endif /* POOL_H_INCLUDE */
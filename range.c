@@ -0,0 +1,340 @@
+/******************************************************************************
+ * range.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * range.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "range.h"
+#include "table.h"
+#include "triage.h"
+#include "utils.h"
+
+
+/* [[h:]m:]s, returns where parsing stopped */
+static const char *parse_time(const char *str, double *secs)
+{
+    char   *end;
+    double  val;
+
+    *secs = 0.0;
+    for ( ;; )
+    {
+        val = strtod(str, &end);
+        if (end == str)
+          return NULL;
+        *secs += val;
+        if (*end != ':')
+          return end;
+        *secs *= 60.0;
+        str = end + 1;
+    }
+}
+
+
+int range_parse(
+    const char *arg,
+    double     *from,
+    double     *to,
+    int        *audio)
+{
+    const char *c;
+
+    *from = 0.0;
+    *to = 1e18;
+    *audio = 0;
+
+    c = arg;
+    if ((*c != '-') && !(c = parse_time(c, from)))
+      return 0;
+    if (*c++ != '-')
+      return 0;
+    if (*c && (*c != 'a') && !(c = parse_time(c, to)))
+      return 0;
+    if (*c == 'a')
+    {
+        *audio = 1;
+        ++c;
+    }
+
+    return (*c == '\0') && (*from >= 0.0) && (*to > *from);
+}
+
+
+static void format_time(double secs, char *buf, size_t buf_sz)
+{
+    long ms = (long)(secs * 1000.0 + 0.5);
+
+    if (ms >= 3600000)
+      snprintf(buf, buf_sz, "%ld:%02ld:%02ld.%03ld", ms / 3600000,
+               (ms / 60000) % 60, (ms / 1000) % 60, ms % 1000);
+    else
+      snprintf(buf, buf_sz, "%ld:%02ld.%03ld", ms / 60000, (ms / 1000) % 60,
+               ms % 1000);
+}
+
+
+static double frame_secs(const frame_table_t *table, size_t i)
+{
+    int           rate;
+    unsigned char h[4];
+
+    TABLE_HDR_BYTES(table->headers[i], h);
+    return ((rate = format_samplerate(table->format, h))) ?
+           (double)format_samples(table->format, h) / rate : 0.0;
+}
+
+
+/* Saves the index under its fixed name by way of a new file, so that a
+ * reader never sees half of one and two writers never mix theirs
+ */
+static void save_index(
+    const char          *fname,
+    const char          *idx_name,
+    const frame_table_t *table)
+{
+    int   ok;
+    char *tmp_name;
+    FILE *fp;
+
+    if (!(fp = util_create_file_named(fname, "frame-index", "idx.tmp", 0,
+                                      &tmp_name)))
+    {
+        ERR("Could not save the frame index\n");
+        return;
+    }
+
+    ok = table_save(table, fp);
+    if ((util_close_file(fp) != 0) || !ok ||
+        (rename(tmp_name, idx_name) != 0))
+    {
+        ERR("Could not save the frame index\n");
+        unlink(tmp_name);
+    }
+    else
+      printf(TAG " Saved the frame index to '%s'\n", idx_name);
+
+    free(tmp_name);
+}
+
+
+/* The saved index if it is for this file as it is now, else a new one */
+static frame_table_t *get_index(const char *fname)
+{
+    char           *idx_name;
+    FILE           *fp;
+    frame_table_t  *table;
+    table_source_t  src;
+
+    table = NULL;
+    idx_name = util_output_name(fname, "frame-index", "idx");
+    if ((fp = fopen(idx_name, "rb")))
+    {
+        table = table_load(fp);
+        fclose(fp);
+        if (table &&
+            (!table_identify(fname, &src) || !table_is_from(table, &src)))
+        {
+            printf(TAG " '%s' is out of date or for another file\n",
+                   idx_name);
+            table_free(table);
+            table = NULL;
+        }
+    }
+
+    if (!table && (table = table_scan_file(fname)))
+      save_index(fname, idx_name, table);
+
+    free(idx_name);
+    return table;
+}
+
+
+/* Frames [first, last) to 'out', reading runs of adjacent frames at once */
+static void copy_frames(
+    int                  fd,
+    const frame_table_t *table,
+    size_t               first,
+    size_t               last,
+    FILE                *out)
+{
+    size_t        i, run_sz;
+    uint64_t      run_start;
+    unsigned char buf[COPY_BUF_SZ];
+
+    run_start = run_sz = 0;
+    for (i=first; i<=last; i++)
+    {
+        if ((i < last) && run_sz &&
+            (table->offsets[i] == run_start + run_sz) &&
+            (run_sz + table->lengths[i] <= sizeof(buf)))
+        {
+            run_sz += table->lengths[i];
+            continue;
+        }
+
+        if (run_sz &&
+            ((pread(fd, buf, run_sz, run_start) != (ssize_t)run_sz) ||
+             (fwrite(buf, run_sz, 1, out) != 1)))
+        {
+            ERR("Could not copy the frames at offset %" PRIu64 "\n",
+                run_start);
+            return;
+        }
+
+        if (i < last)
+        {
+            run_start = table->offsets[i];
+            run_sz = table->lengths[i];
+        }
+    }
+}
+
+
+void handle_as_range(
+    const char *fname,
+    flags_t     flags,
+    double      from,
+    double      to,
+    int         audio)
+{
+    int            fd;
+    char           when[32], desc[128], *name;
+    size_t         first, last, i, j, lo_idx, hi_idx, mid;
+    uint64_t       lo, hi, offset, oob_bytes, n_regions;
+    uint32_t       len;
+    double         start, end, secs;
+    unsigned char *data;
+    FILE          *oob_file, *audio_file;
+    frame_table_t *table;
+    triage_t       tri;
+
+    if ((fd = open(fname, O_RDONLY)) == -1)
+    {
+        ERR("Could not open '%s'\n", fname);
+        return;
+    }
+
+    if (!(table = get_index(fname)))
+    {
+        ERR("Could not index '%s'\n", fname);
+        close(fd);
+        return;
+    }
+
+    /* Frames in the range, and the bytes from the end of the frame before
+     * the first to the start of the one after the last
+     */
+    first = table_frame_at(table, from, &start);
+    last = table_frame_at(table, to, &end);
+    if (first == last)
+    {
+        format_time(table->secs, when, sizeof(when));
+        printf(TAG " No frames in that range, the audio is %s long\n", when);
+        table_free(table);
+        close(fd);
+        return;
+    }
+
+    lo = (first) ? table->offsets[first-1] + table->lengths[first-1] : 0;
+    hi = (last < table->n_frames) ? table->offsets[last] : table->size;
+
+    oob_file = NULL;
+    if (flags & FLAG_EXTRACT_MODE)
+      if (!(oob_file = util_create_file(fname, "extracted-oob", "dat", 0)))
+        ERR("Could not create a file to store out of band data\n");
+
+    /* First OOB region in the range */
+    lo_idx = 0;
+    hi_idx = table->oob.count;
+    while (lo_idx < hi_idx)
+    {
+        mid = (lo_idx + hi_idx) / 2;
+        if (table->oob.offsets[mid] < lo)
+          lo_idx = mid + 1;
+        else
+          hi_idx = mid;
+    }
+
+    /* Each is timed by the frame after it */
+    oob_bytes = n_regions = 0;
+    secs = start;
+    j = first;
+    for (i=lo_idx; (i < table->oob.count) && (table->oob.offsets[i] < hi);
+         i++)
+    {
+        offset = table->oob.offsets[i];
+        len = table->oob.lengths[i];
+        for ( ; (j < last) && (table->offsets[j] < offset); j++)
+          secs += frame_secs(table, j);
+
+        if (!(data = malloc(len)) ||
+            (pread(fd, data, len, offset) != (ssize_t)len))
+        {
+            ERR("Could not read %" PRIu32 " bytes at offset %" PRIu64 "\n",
+                len, offset);
+            free(data);
+            continue;
+        }
+
+        ++n_regions;
+        oob_bytes += len;
+        triage_region(&tri, data, len);
+        triage_format(&tri, desc, sizeof(desc));
+        format_time(secs, when, sizeof(when));
+        printf(TAG " %" PRIu32 " bytes out-of-frame at offset %" PRIu64
+               " (%s): %s\n", len, offset, when, desc);
+        if (IS_VERBOSE)
+          util_display_oob(data, len, 0);
+        if (oob_file && (tri.score >= main_oob_threshold))
+          fwrite(data, len, 1, oob_file);
+
+        free(data);
+    }
+
+    format_time(start, when, sizeof(when));
+    format_time(end, desc, sizeof(desc));
+    printf(TAG " %s-%s: frames %zu-%zu, offsets %" PRIu64 "-%" PRIu64
+           ", %" PRIu64 " out-of-frame regions (%" PRIu64 " bytes)\n", when,
+           desc, first, last - 1, lo, hi, n_regions, oob_bytes);
+
+    /* The audio itself */
+    if (audio &&
+        (audio_file = util_create_file_named(fname, "range-audio", "mp3", 0,
+                                             &name)))
+    {
+        copy_frames(fd, table, first, last, audio_file);
+        util_close_file(audio_file);
+        printf(TAG " Saved %zu frames of audio to '%s'\n", last - first,
+               name);
+        free(name);
+    }
+
+    /* Clean */
+    if (oob_file)
+      util_close_file(oob_file);
+    table_free(table);
+    close(fd);
+}
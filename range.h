@@ -0,0 +1,52 @@
+/******************************************************************************
+ * range.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * range.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#ifndef RANGE_H_INCLUDE
+#define RANGE_H_INCLUDE
+
+#include "main.h"
+
+
+/* Parse a time range, "<from>-<to>" with times as [[h:]m:]s (either may be
+ * left out to mean the start or the end), and an 'a' after it to ask for the
+ * audio.  Returns 1 if it could be parsed.
+ */
+extern int range_parse(
+    const char *arg,
+    double     *from,
+    double     *to,
+    int        *audio);
+
+/* Report (and with '-e' save) the OOB regions between 'from' and 'to'
+ * seconds into the audio of 'fname', and if 'audio' is set save the frames
+ * too.  The frame index saved next to the outputs is used to go straight to
+ * the range; without one the file is scanned and its index saved first.
+ */
+extern void handle_as_range(
+    const char *fname,
+    flags_t     flags,
+    double      from,
+    double      to,
+    int         audio);
+
+
+#endif /* RANGE_H_INCLUDE */
@@ -0,0 +1,588 @@
+/******************************************************************************
+ * replay.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * replay.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+/* mp3nema-replay: serves an mp3 file like an internet radio station, so the
+ * stream code can be measured without one.  Frames are paced by their
+ * duration (optionally sped up), delivery can be made bursty or slow, and
+ * numbered OOB regions can be slipped in between frames.  Everything sent is
+ * logged as "key=value" records for bench-stream.sh to compare against what
+ * "mp3nema -s" saw.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "main.h"
+#include "table.h"
+#include "utils.h"
+
+
+#define REPLAY_TAG      "[mp3nema-replay]"
+#define MAX_OOB         64
+#define OOB_MARKER_SZ   24 /* Room for "OOB#<id>#" */
+
+
+/* Needed by utils.c */
+flags_t main_flags;
+char   *main_output_dir;
+
+
+/* OOB region to inject at the first frame boundary at or after 'offset'
+ * (in bytes of the original file).  It goes straight after the frame before,
+ * ahead of any OOB data already in the file.
+ */
+typedef struct _oob_spec_t
+{
+    uint64_t offset;
+    int      size;
+} oob_spec_t;
+
+
+/* OOB region waiting in the send buffer */
+typedef struct _pending_t
+{
+    int      id;
+    uint64_t offset; /* In the stream sent */
+    int      size;
+} pending_t;
+
+
+typedef struct _replay_t
+{
+    int                  port;
+    double               rate;     /* Speed up, 0 is as fast as possible */
+    int                  icy;
+    int                  metaint;  /* ICY metadata interval, if asked for */
+    int                  redirect;
+    const char          *content_type;
+    int                  burst;    /* Bytes sent at a time */
+    int                  stall_ms; /* Pause after each burst */
+    int                  n_conns;
+    uint64_t             every;    /* OOB every this many bytes */
+    int                  every_sz;
+    oob_spec_t           oobs[MAX_OOB];
+    int                  n_oobs;
+    FILE                *log;
+    const unsigned char *data;
+    size_t               size;
+    frame_table_t       *table;
+} replay_t;
+
+
+static void usage(const char *execname)
+{
+    printf("Usage: %s [-p port] [-r rate] [-I [-M metaint]] [-R] [-T type] "
+           "[-O offset:bytes]\n"
+           "       [-E every:bytes] [-B burst] [-S ms] [-n connections] "
+           "[-l log] file.mp3\n"
+           "\t-p Port to listen on (default 8000)\n"
+           "\t-r Times faster than real time, 0 is unthrottled (default 1)\n"
+           "\t-I Answer as a Shoutcast (ICY) server rather than HTTP/1.0\n"
+           "\t-M Send ICY metadata every 'metaint' bytes to clients that "
+           "ask for it\n"
+           "\t-R Answer with a playlist pointing at /stream first\n"
+           "\t-T Content type of the stream, e.g. audio/aacp (default "
+           "audio/mpeg,\n"
+           "\t   or audio/aac for ADTS AAC)\n"
+           "\t-O Inject 'bytes' of OOB data at the first frame at or after "
+           "'offset'\n"
+           "\t-E Inject 'bytes' of OOB data every 'every' bytes\n"
+           "\t-B Send at least 'burst' bytes at a time\n"
+           "\t-S Stall 'ms' milliseconds after each send\n"
+           "\t-n Serve 'connections' streams then quit (default 1, 0 never)\n"
+           "\t-l Log to a file rather than stdout\n",
+           execname);
+    exit(0);
+}
+
+
+static double now_secs(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+static void sleep_until(double when)
+{
+    double wait;
+
+    if ((wait = when - now_secs()) > 0)
+      usleep(wait * 1000000);
+}
+
+
+static int send_all(int sd, const void *data, size_t size)
+{
+    ssize_t              n;
+    const unsigned char *c = data;
+
+    while (size)
+    {
+        if ((n = write(sd, c, size)) <= 0)
+          return 0;
+        c += n;
+        size -= n;
+    }
+
+    return 1;
+}
+
+
+/* Audio with ICY metadata blocks every 'metaint' bytes, a title in every
+ * eighth one and the rest empty (as Shoutcast does between title changes)
+ */
+typedef struct _icy_out_t
+{
+    int metaint;
+    int audio_left;
+    int n_blocks;
+} icy_out_t;
+
+
+static int send_meta(int sd, icy_out_t *icy)
+{
+    int           len;
+    unsigned char block[1 + 255 * 16];
+
+    memset(block, 0, sizeof(block));
+    len = 0;
+    if (icy->n_blocks++ % 8 == 0)
+      len = snprintf((char *)block + 1, sizeof(block) - 1,
+                     "StreamTitle='mp3nema-replay %d';", icy->n_blocks / 8);
+    block[0] = (len + 15) / 16;
+
+    return send_all(sd, block, 1 + block[0] * 16);
+}
+
+
+static int send_audio(
+    int                  sd,
+    icy_out_t           *icy,
+    const unsigned char *data,
+    size_t               size)
+{
+    size_t n;
+
+    if (!icy->metaint)
+      return send_all(sd, data, size);
+
+    while (size)
+    {
+        n = ((size_t)icy->audio_left < size) ? (size_t)icy->audio_left : size;
+        if (!send_all(sd, data, n))
+          return 0;
+        data += n;
+        size -= n;
+
+        if (!(icy->audio_left -= n))
+        {
+            if (!send_meta(sd, icy))
+              return 0;
+            icy->audio_left = icy->metaint;
+        }
+    }
+
+    return 1;
+}
+
+
+/* Read the request and hand back its path, and whether it asked for ICY
+ * metadata
+ */
+static int read_request(int sd, char *path, size_t path_sz, int *metadata)
+{
+    int     total;
+    char    req[DEFAULT_BLK_SZ], *c;
+    ssize_t n;
+
+    total = 0;
+    while (total < (int)sizeof(req) - 1)
+    {
+        if ((n = read(sd, req + total, sizeof(req) - 1 - total)) <= 0)
+          return 0;
+        total += n;
+        req[total] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+          break;
+    }
+
+    if (strncmp(req, "GET ", 4) != 0)
+      return 0;
+
+    *metadata = 0;
+    for (c=req; c; c=strchr(c, '\n'))
+    {
+        while (*c == '\r' || *c == '\n')
+          ++c;
+        if (strncasecmp(c, "Icy-MetaData:", 13) == 0)
+          *metadata = atoi(c + 13);
+    }
+
+    snprintf(path, path_sz, "%s", req + 4);
+    if ((c = strpbrk(path, " \r\n")))
+      *c = '\0';
+
+    return 1;
+}
+
+
+/* The OOB region to put in front of the frame at 'offset' (the previous one
+ * was at 'prev'), 0 if none.  Regions never contain 0xFF or "ID3" so they
+ * cannot be mistaken for frames.
+ */
+static int oob_before(
+    const replay_t *rp,
+    int             first,
+    uint64_t        prev,
+    uint64_t        offset,
+    unsigned char  *buf,
+    int             id)
+{
+    int      i, size, n;
+    uint64_t point;
+
+    size = 0;
+    for (i=0; i<rp->n_oobs; i++)
+      if ((first || rp->oobs[i].offset > prev) &&
+          (rp->oobs[i].offset <= offset))
+        size += rp->oobs[i].size;
+
+    /* Crossed a multiple of 'every' since the last frame */
+    if (rp->every)
+    {
+        point = (offset / rp->every) * rp->every;
+        if (point > prev && point <= offset && point)
+          size += rp->every_sz;
+    }
+
+    if (size <= 0)
+      return 0;
+
+    n = snprintf((char *)buf, OOB_MARKER_SZ, "OOB#%d#", id);
+    if (n > size)
+      n = size;
+    memset(buf + n, 'x', size - n);
+
+    return size;
+}
+
+
+static void serve(const replay_t *rp, int sd, int conn, int metadata)
+{
+    int             j, id, oob_sz, buf_sz, out_sz, samples, rate;
+    int             n_pending, alloc, ok;
+    size_t          i;
+    size_t          out_alloc;
+    uint64_t        prev, prev_end, sent, frame_off, frame_end, n_oob_bytes;
+    double          start, audio_secs, when;
+    unsigned char   h[4], *buf, *out;
+    char            hdr[DEFAULT_BLK_SZ];
+    const uint32_t *raw;
+    pending_t      *pending;
+    icy_out_t       icy;
+
+    /* Response header */
+    memset(&icy, 0, sizeof(icy_out_t));
+    if (rp->icy && rp->metaint && metadata)
+      icy.metaint = icy.audio_left = rp->metaint;
+
+    if (rp->icy && icy.metaint)
+      snprintf(hdr, sizeof(hdr), "ICY 200 OK\r\nicy-name: mp3nema-replay\r\n"
+               "content-type: %s\r\nicy-metaint: %d\r\n\r\n",
+               rp->content_type, icy.metaint);
+    else if (rp->icy)
+      snprintf(hdr, sizeof(hdr), "ICY 200 OK\r\nicy-name: mp3nema-replay\r\n"
+               "content-type: %s\r\n\r\n", rp->content_type);
+    else
+      snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+               "Content-Type: %s\r\n\r\n", rp->content_type);
+    if (!send_all(sd, hdr, strlen(hdr)))
+      return;
+
+    /* Largest OOB region */
+    buf_sz = rp->every_sz + OOB_MARKER_SZ;
+    for (id=0; id<rp->n_oobs; id++)
+      buf_sz += rp->oobs[id].size;
+    out_sz = 0;
+    buf = malloc(buf_sz);
+    out_alloc = rp->burst + UINT16_MAX;
+    out = malloc(out_alloc);
+    pending = NULL;
+    n_pending = alloc = 0;
+
+    raw = rp->table->headers;
+    start = now_secs();
+    audio_secs = 0.0;
+    sent = n_oob_bytes = 0;
+    prev = 0;
+    id = 0;
+
+    /* Everything before the first frame (ID3 tags) goes out as is */
+    frame_off = (rp->table->n_frames) ? rp->table->offsets[0] : rp->size;
+    if ((ok = send_audio(sd, &icy, rp->data, frame_off)))
+      sent += frame_off;
+    prev_end = frame_off;
+
+    for (i=0; ok && i<rp->table->n_frames; i++)
+    {
+        frame_off = rp->table->offsets[i];
+
+        if ((oob_sz = oob_before(rp, i == 0, prev, frame_off, buf, id)))
+        {
+            if (n_pending == alloc)
+            {
+                alloc = (alloc) ? alloc * 2 : 16;
+                pending = realloc(pending, alloc * sizeof(pending_t));
+            }
+            pending[n_pending].id = id;
+            pending[n_pending].offset = sent + out_sz;
+            pending[n_pending].size = oob_sz;
+            ++n_pending;
+
+            if (out_sz + oob_sz > out_alloc)
+            {
+                out_alloc = out_sz + oob_sz + UINT16_MAX;
+                out = realloc(out, out_alloc);
+            }
+            memcpy(out + out_sz, buf, oob_sz);
+            out_sz += oob_sz;
+            n_oob_bytes += oob_sz;
+            ++id;
+        }
+        prev = frame_off;
+
+        /* Anything between the last frame and this one, then the frame */
+        frame_end = frame_off + rp->table->lengths[i];
+        if (out_sz + (frame_end - prev_end) > out_alloc)
+        {
+            out_alloc = out_sz + (frame_end - prev_end) + UINT16_MAX;
+            out = realloc(out, out_alloc);
+        }
+        memcpy(out + out_sz, rp->data + prev_end, frame_end - prev_end);
+        out_sz += frame_end - prev_end;
+        prev_end = frame_end;
+
+        /* When this frame would start playing */
+        TABLE_HDR_BYTES(raw[i], h);
+        samples = format_samples(rp->table->format, h);
+        if ((rate = format_samplerate(rp->table->format, h)))
+          audio_secs += (double)samples / rate;
+
+        if (out_sz < rp->burst && i + 1 < rp->table->n_frames)
+          continue;
+
+        if (rp->rate > 0)
+          sleep_until(start + audio_secs / rp->rate);
+        when = now_secs();
+        if (!(ok = send_audio(sd, &icy, out, out_sz)))
+          break;
+        sent += out_sz;
+        out_sz = 0;
+
+        /* Log the OOB regions that just went out */
+        for (j=0; j<n_pending; j++)
+          fprintf(rp->log, "oob id=%d offset=%" PRIu64 " bytes=%d "
+                  "sent=%.6f\n", pending[j].id, pending[j].offset,
+                  pending[j].size, when);
+        n_pending = 0;
+
+        if (rp->stall_ms)
+          usleep(rp->stall_ms * 1000);
+    }
+
+    /* Whatever follows the last frame */
+    if (ok && send_audio(sd, &icy, rp->data + prev_end, rp->size - prev_end))
+      sent += rp->size - prev_end;
+
+    fprintf(rp->log, "replay conn=%d bytes=%" PRIu64 " seconds=%.3f "
+            "oob_regions=%d oob_bytes=%" PRIu64 "\n", conn, sent,
+            now_secs() - start, id, n_oob_bytes);
+    fflush(rp->log);
+    free(pending);
+    free(buf);
+    free(out);
+}
+
+
+static int listen_on(int port)
+{
+    int                sd, on;
+    struct sockaddr_in addr;
+
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+      return -1;
+
+    on = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(sd, 8) == -1)
+    {
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+
+int main(int argc, char **argv)
+{
+    int       i, sd, client, conn, metadata;
+    char      path[DEFAULT_BLK_SZ], body[DEFAULT_BLK_SZ];
+    char     *fname, *c;
+    replay_t  rp;
+
+    memset(&rp, 0, sizeof(replay_t));
+    rp.port = 8000;
+    rp.rate = 1.0;
+    rp.n_conns = 1;
+    rp.log = stdout;
+    fname = NULL;
+
+    for (i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-p") == 0 && i+1 < argc)
+          rp.port = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i+1 < argc)
+          rp.rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-I") == 0)
+          rp.icy = 1;
+        else if (strcmp(argv[i], "-M") == 0 && i+1 < argc)
+          rp.metaint = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-R") == 0)
+          rp.redirect = 1;
+        else if (strcmp(argv[i], "-T") == 0 && i+1 < argc)
+          rp.content_type = argv[++i];
+        else if (strcmp(argv[i], "-O") == 0 && i+1 < argc &&
+                 rp.n_oobs < MAX_OOB)
+        {
+            rp.oobs[rp.n_oobs].offset = strtoull(argv[++i], &c, 10);
+            rp.oobs[rp.n_oobs].size = (*c == ':') ? atoi(c + 1) : 0;
+            if (rp.oobs[rp.n_oobs].size > 0)
+              ++rp.n_oobs;
+        }
+        else if (strcmp(argv[i], "-E") == 0 && i+1 < argc)
+        {
+            rp.every = strtoull(argv[++i], &c, 10);
+            rp.every_sz = (*c == ':') ? atoi(c + 1) : 0;
+            if (rp.every_sz <= 0)
+              rp.every = 0;
+        }
+        else if (strcmp(argv[i], "-B") == 0 && i+1 < argc)
+          rp.burst = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-S") == 0 && i+1 < argc)
+          rp.stall_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0 && i+1 < argc)
+          rp.n_conns = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i+1 < argc)
+        {
+            if (!(rp.log = fopen(argv[++i], "w")))
+            {
+                ERR("Could not open log '%s'\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (argv[i][0] == '-')
+          usage(argv[0]);
+        else
+          fname = argv[i];
+    }
+
+    if (!fname)
+      usage(argv[0]);
+
+    if (!util_map_file(fname, &rp.data, &rp.size) ||
+        !(rp.table = table_scan_file(fname)))
+    {
+        ERR("Could not open '%s'\n", fname);
+        return -1;
+    }
+
+    if (!rp.content_type)
+      rp.content_type = (rp.table->format == FORMAT_ADTS) ? "audio/aac" :
+                                                            "audio/mpeg";
+
+    if ((sd = listen_on(rp.port)) == -1)
+    {
+        ERR("Could not listen on port %d\n", rp.port);
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf(REPLAY_TAG " Serving %s (%zu frames) on port %d\n", fname,
+           rp.table->n_frames, rp.port);
+    fflush(stdout);
+
+    /* One listener at a time, playlist requests do not count */
+    conn = 0;
+    while ((rp.n_conns == 0) || (conn < rp.n_conns))
+    {
+        if ((client = accept(sd, NULL, NULL)) == -1)
+          continue;
+
+        if (!read_request(client, path, sizeof(path), &metadata))
+        {
+            close(client);
+            continue;
+        }
+
+        if (rp.redirect && strcmp(path, "/stream") != 0)
+        {
+            snprintf(body, sizeof(body), "HTTP/1.0 200 OK\r\n"
+                     "Content-Type: audio/x-scpls\r\n\r\n"
+                     "[playlist]\nNumberOfEntries=1\n"
+                     "File1=http://127.0.0.1:%d/stream\n", rp.port);
+            send_all(client, body, strlen(body));
+            fprintf(rp.log, "redirect path=%s\n", path);
+        }
+        else
+          serve(&rp, client, conn++, metadata);
+
+        close(client);
+    }
+
+    close(sd);
+    table_free(rp.table);
+    util_unmap_file(rp.data, rp.size);
+    if (rp.log != stdout)
+      fclose(rp.log);
+
+    return 0;
+}
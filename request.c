@@ -0,0 +1,218 @@
+/******************************************************************************
+ * request.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * request.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "main.h"
+#include "utils.h"
+#include "sample.h"
+
+
+/* Analysis results are cached by path and invalidated when the file changes
+ * (different inode, size or modification time).  The cache is direct mapped,
+ * a colliding path simply replaces the older entry.
+ */
+#define CACHE_SLOTS 4096
+
+typedef struct _cache_entry_t
+{
+    char       *path;
+    dev_t       dev;
+    ino_t       ino;
+    off_t       size;
+    time_t      mtime;
+    analysis_t  result;
+} cache_entry_t;
+
+static cache_entry_t   cache[CACHE_SLOTS];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned int cache_slot(const char *path)
+{
+    unsigned int hash = 2166136261u; /* FNV-1a */
+
+    while (*path)
+      hash = (hash ^ (unsigned char)*path++) * 16777619u;
+
+    return hash % CACHE_SLOTS;
+}
+
+
+static int cache_get(
+    const char        *path,
+    const struct stat *st,
+    analysis_t        *result)
+{
+    int            hit;
+    cache_entry_t *ent;
+
+    pthread_mutex_lock(&cache_lock);
+    ent = &cache[cache_slot(path)];
+    hit = ent->path && (strcmp(ent->path, path) == 0) &&
+          (ent->dev == st->st_dev) && (ent->ino == st->st_ino) &&
+          (ent->size == st->st_size) && (ent->mtime == st->st_mtime);
+    if (hit)
+      *result = ent->result;
+    pthread_mutex_unlock(&cache_lock);
+
+    return hit;
+}
+
+
+static void cache_put(
+    const char        *path,
+    const struct stat *st,
+    const analysis_t  *result)
+{
+    cache_entry_t *ent;
+
+    pthread_mutex_lock(&cache_lock);
+    ent = &cache[cache_slot(path)];
+    free(ent->path);
+    ent->path = strdup(path);
+    ent->dev = st->st_dev;
+    ent->ino = st->st_ino;
+    ent->size = st->st_size;
+    ent->mtime = st->st_mtime;
+    ent->result = *result;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+
+int request_parse(char *line, request_t *req)
+{
+    int         i;
+    size_t      len;
+    static const struct {const char *name; REQUEST_OP op;} ops[] = {
+        {"analyze ", REQUEST_ANALYZE},
+        {"extract ", REQUEST_EXTRACT},
+        {"insert ",  REQUEST_INSERT}
+    };
+
+    memset(req, 0, sizeof(request_t));
+
+    /* Operation (line is left untouched if there is not one) */
+    for (i=0; i<sizeof(ops)/sizeof(ops[0]); i++)
+    {
+        len = strlen(ops[i].name);
+        if (strncmp(line, ops[i].name, len) == 0)
+        {
+            req->op = ops[i].op;
+            req->path = line + len;
+            break;
+        }
+    }
+
+    if (req->op == REQUEST_UNKNOWN)
+      return 0;
+
+    /* Path is the rest of the line (insert takes a tab separated source) */
+    if (req->op == REQUEST_INSERT)
+    {
+        if (!(line = strchr(req->path, '\t')))
+          return 0;
+        *line = '\0';
+        req->datasrc = line + 1;
+    }
+
+    return strlen(req->path) > 0;
+}
+
+
+int request_run(
+    const request_t *req,
+    flags_t          flags,
+    FILE            *out,
+    analysis_t      *analysis)
+{
+    int         n_written;
+    analysis_t  tmp, *result;
+    sample_t    sample;
+    struct stat st;
+
+    result = (analysis) ? analysis : &tmp;
+    memset(result, 0, sizeof(analysis_t));
+
+    switch (req->op)
+    {
+        case REQUEST_ANALYZE:
+            if (flags & FLAG_SAMPLE_MODE)
+            {
+                if (!sample_file(req->path, main_sample_windows,
+                                 flags & FLAG_SAMPLE_RANDOM, &sample))
+                  return 0;
+
+                result->n_frames = sample.n_frames;
+                result->n_oob_regions = sample.n_oob_regions;
+                result->oob_bytes = sample.oob_bytes;
+                sample_report(out, req->path, &sample);
+                return 1;
+            }
+
+            /* Every copy has to be seen, so no cache, and the results are
+             * reported once they all have been
+             */
+            if (req->seen)
+              return file_analyze(req->path, flags & ~FLAG_EXTRACT_MODE,
+                                  result, req->seen);
+
+            if (stat(req->path, &st) == -1)
+              return 0;
+
+            if (!cache_get(req->path, &st, result))
+            {
+                if (!file_analyze(req->path, flags & ~FLAG_EXTRACT_MODE,
+                                  result, NULL))
+                  return 0;
+                cache_put(req->path, &st, result);
+            }
+
+            file_report(out, req->path, result);
+            return 1;
+
+        case REQUEST_EXTRACT:
+            if (!file_analyze(req->path, flags | FLAG_EXTRACT_MODE, result,
+                              NULL))
+              return 0;
+
+            file_report(out, req->path, result);
+            return 1;
+
+        case REQUEST_INSERT:
+            /* Requests already run in the workers of a daemon or manifest */
+            if (!(n_written = handle_as_insert(req->path, flags, req->datasrc,
+                                               1)))
+              return 0;
+
+            fprintf(out, "insert path=%s datasrc=%s outputs=%d\n",
+                    req->path, req->datasrc, n_written);
+            return 1;
+
+        default:
+            return 0;
+    }
+}
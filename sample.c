@@ -0,0 +1,251 @@
+/******************************************************************************
+ * sample.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * sample.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "sample.h"
+#include "table.h"
+#include "utils.h"
+
+
+/* Does a run of SAMPLE_CHAIN frames of the same kind start at 'h'?  A run cut
+ * short by the end of the window is believed after two frames.
+ */
+FORMAT_INLINE int is_chain(
+    format_t             format,
+    const unsigned char *h,
+    size_t               avail)
+{
+    int    n, len;
+    size_t at;
+
+    for (n=0, at=0; n<SAMPLE_CHAIN; n++, at+=len)
+    {
+        if (at + format_hdr_size(format) > avail)
+          return n >= 2;
+        if (!format_is_sync(format, h + at) ||
+            (format_key(format, h + at) != format_key(format, h)) ||
+            !(len = format_frame_length(format, h + at)))
+          return 0;
+    }
+
+    return 1;
+}
+
+
+FORMAT_INLINE size_t find_chain(
+    format_t             format,
+    const unsigned char *buf,
+    size_t               n)
+{
+    size_t i;
+
+    for (i=0; i+format_hdr_size(format)<=n; i++)
+      if (format_is_sync(format, buf + i) && is_chain(format, buf + i, n - i))
+        return i;
+
+    return n;
+}
+
+
+/* Where the frames start in a window that began at an arbitrary offset */
+static size_t resync(format_t format, const unsigned char *buf, size_t n)
+{
+    switch (format)
+    {
+        case FORMAT_ADTS:
+            return find_chain(FORMAT_ADTS, buf, n);
+        default:
+            return find_chain(FORMAT_MPEG, buf, n);
+    }
+}
+
+
+/* Offsets of the windows between the head and the tail */
+static int place_windows(
+    uint64_t  size,
+    int       n_windows,
+    int       random,
+    uint64_t *offsets)
+{
+    int      i, n;
+    uint64_t span, prev_end, v;
+    unsigned seed;
+
+    span = size - 2 * SAMPLE_WINDOW_SZ;
+    seed = (unsigned)size;
+    for (i=0; i<n_windows; i++)
+    {
+        if (random)
+          offsets[i] = SAMPLE_WINDOW_SZ +
+                       (uint64_t)((double)rand_r(&seed) / RAND_MAX *
+                                  (span - SAMPLE_WINDOW_SZ));
+        else
+          offsets[i] = SAMPLE_WINDOW_SZ +
+                       (span - SAMPLE_WINDOW_SZ) * (i + 1) / (n_windows + 1);
+    }
+
+    /* Random ones are read in order, and not twice */
+    if (random)
+      for (i=1; i<n_windows; i++)
+      {
+          v = offsets[i];
+          for (n=i; n>0 && offsets[n-1]>v; n--)
+            offsets[n] = offsets[n-1];
+          offsets[n] = v;
+      }
+
+    prev_end = SAMPLE_WINDOW_SZ;
+    for (i=n=0; i<n_windows; i++)
+      if (offsets[i] >= prev_end)
+      {
+          offsets[n++] = offsets[i];
+          prev_end = offsets[i] + SAMPLE_WINDOW_SZ;
+      }
+
+    return n;
+}
+
+
+int sample_file(
+    const char *fname,
+    int         n_windows,
+    int         random,
+    sample_t   *s)
+{
+    int            i, n, fd, final;
+    size_t         got, start, used;
+    uint64_t      *offsets;
+    unsigned char *buf;
+    frame_table_t *table;
+    struct stat    st;
+
+    memset(s, 0, sizeof(sample_t));
+    if ((fd = open(fname, O_RDONLY)) == -1)
+      return 0;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return 0;
+    }
+    s->size = st.st_size;
+
+    /* Small files are read whole, otherwise head, windows and tail */
+    offsets = malloc((n_windows + 2) * sizeof(uint64_t));
+    if (s->size <= (uint64_t)(n_windows + 2) * SAMPLE_WINDOW_SZ)
+    {
+        n = 1;
+        offsets[0] = 0;
+    }
+    else
+    {
+        offsets[0] = 0;
+        n = 1 + place_windows(s->size, n_windows, random, offsets + 1);
+        offsets[n++] = s->size - SAMPLE_WINDOW_SZ;
+    }
+
+    buf = malloc((n == 1) ? s->size + 1 : SAMPLE_WINDOW_SZ);
+    table = table_new();
+    for (i=0; i<n; i++)
+    {
+        final = (i == n - 1);
+        got = pread(fd, buf, (n == 1) ? s->size : SAMPLE_WINDOW_SZ,
+                    offsets[i]);
+        if ((ssize_t)got <= 0)
+          continue;
+        s->bytes_read += got;
+        ++s->n_windows;
+
+        /* The head starts at the start, anywhere else could be mid-frame */
+        start = (offsets[i] == 0) ? 0 : resync(table->format, buf, got);
+        if (start == got)
+          continue;
+
+        used = table_scan(table, buf + start, got - start, offsets[i] + start,
+                          final);
+        s->bytes_scanned += used;
+    }
+
+    s->n_frames = table->n_frames;
+    s->n_oob_regions = table->oob.count;
+    for (i=0; i<(int)table->oob.count; i++)
+      s->oob_bytes += table->oob.lengths[i];
+
+    /* Each frame seen is a gap that could have held OOB data: having seen
+     * none in 'n' of them, we are this sure that under 1% of gaps hold any
+     * (unless the whole file was read)
+     */
+    s->density = (s->bytes_scanned) ?
+                 (double)s->oob_bytes / s->bytes_scanned : 0.0;
+    s->confidence = (s->n_oob_regions || n == 1) ?
+                    1.0 : 1.0 - pow(0.99, s->n_frames);
+
+    /* Clean */
+    table_free(table);
+    free(buf);
+    free(offsets);
+    close(fd);
+
+    return 1;
+}
+
+
+void sample_report(FILE *out, const char *fname, const sample_t *s)
+{
+    fprintf(out, "sample path=%s size=%" PRIu64 " read=%" PRIu64 " scanned=%"
+            PRIu64 " windows=%ld frames=%ld oob=%s oob_regions=%ld oob_bytes=%"
+            PRIu64 " density=%.6f est_oob_bytes=%.0f confidence=%.4f\n",
+            fname, s->size, s->bytes_read, s->bytes_scanned, s->n_windows,
+            s->n_frames, (s->n_oob_regions) ? "yes" : "no", s->n_oob_regions,
+            s->oob_bytes, s->density, s->density * s->size, s->confidence);
+}
+
+
+void handle_as_sample(const char *fname, flags_t flags)
+{
+    sample_t s;
+
+    if (!sample_file(fname, main_sample_windows,
+                     flags & FLAG_SAMPLE_RANDOM, &s))
+    {
+        ERR("Could not open '%s'\n", fname);
+        return;
+    }
+
+    printf(TAG " Read: %" PRIu64 " of %" PRIu64 " bytes (%ld windows)\n",
+           s.bytes_read, s.size, s.n_windows);
+    printf(TAG " Frames: %ld\n", s.n_frames);
+    if (s.n_oob_regions)
+      printf(TAG " OOB data seen: %ld regions, %" PRIu64 " bytes "
+             "(about %.0f bytes in the whole file)\n", s.n_oob_regions,
+             s.oob_bytes, s.density * s.size);
+    else
+      printf(TAG " No OOB data seen (%.1f%% sure under 1%% of frame gaps "
+             "have any)\n", s.confidence * 100.0);
+}
@@ -0,0 +1,69 @@
+/******************************************************************************
+ * sample.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * sample.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef SAMPLE_H_INCLUDE
+#define SAMPLE_H_INCLUDE
+
+#include <stdio.h>
+#include <stdint.h>
+#include "main.h"
+
+
+/* Bytes read per window, and frames that must follow each other for a sync
+ * found in the middle of a window to be believed
+ */
+#define SAMPLE_WINDOW_SZ (32 * 1024)
+#define SAMPLE_CHAIN     4
+
+
+/* What was seen of a file by reading a few windows of it */
+typedef struct _sample_t
+{
+    uint64_t size;
+    uint64_t bytes_read;
+    uint64_t bytes_scanned; /* From the first good frame of each window on */
+    uint64_t oob_bytes;
+    long     n_windows;
+    long     n_frames;
+    long     n_oob_regions;
+    double   density;       /* OOB bytes per scanned byte */
+    double   confidence;    /* That a miss means under 1% of gaps have OOB */
+} sample_t;
+
+
+/* Read the head and tail of 'fname' and 'n_windows' windows in between,
+ * evenly spaced or (if 'random') at random, and scan them for OOB data.
+ * Returns 1 on success.
+ */
+extern int sample_file(
+    const char *fname,
+    int         n_windows,
+    int         random,
+    sample_t   *s);
+
+/* Write the results from sample_file() as a single "key=value" record */
+extern void sample_report(FILE *out, const char *fname, const sample_t *s);
+
+/* Quick triage of a single file, from the command line */
+extern void handle_as_sample(const char *fname, flags_t flags);
+
+
+#endif /* SAMPLE_H_INCLUDE */
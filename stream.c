@@ -20,33 +20,433 @@
  * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
  *****************************************************************************/
 
+#define _GNU_SOURCE /* fallocate */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include "main.h"
 #include "utils.h"
+#include "format.h"
+#include "triage.h"
+
+
+/* Latency histogram in microseconds: exact below HIST_SUB, then HIST_SUB
+ * buckets per power of two (within 12.5%)
+ */
+#define HIST_SUB     8
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct _hist_t
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t n;
+    uint64_t max;
+} hist_t;
+
+
+/* Most read from a server before the stream (response header, playlist) */
+#define STREAM_HEAD_MAX (64 * 1024)
+
+
+/* When the data in the buffer was received, by the stream offset each read
+ * ended at (the oldest are forgotten first)
+ */
+#define RECV_RING_SZ 1024
+
+typedef struct _recv_ring_t
+{
+    uint64_t ends[RECV_RING_SZ];
+    double   times[RECV_RING_SZ];
+    int      first;
+    int      count;
+} recv_ring_t;
+
+
+/* Shoutcast/Icecast metadata interleaved with the audio (-I): every
+ * 'metaint' bytes of audio come a length byte and that many 16 bytes of text
+ */
+typedef struct _icy_t
+{
+    int      metaint;
+    int      audio_left; /* Before the next block */
+    int      meta_left;  /* Of the current block, -1 for its length byte */
+    int      meta_sz;
+    char     meta[255 * 16 + 1];
+    uint64_t n_blocks;   /* Not counting empty ones */
+    uint64_t n_bytes;    /* Taken out of the stream */
+    FILE    *sink;
+} icy_t;
+
+
+/* Captured audio (-c), optionally cut into segments.  A segment is only ever
+ * cut in front of a frame or tag, and each one closed is listed in an index so
+ * that it can be analyzed straight away.
+ */
+typedef struct _capture_t
+{
+    const char *host;
+    FILE       *fp;
+    char       *fname;
+    FILE       *index;
+    uint64_t    seg_bytes;  /* Cut after this many bytes, 0 for never */
+    double      seg_secs;   /* ... or this many seconds of audio */
+    uint64_t    written;    /* To this segment */
+    uint64_t    offset;     /* Stream offset this segment starts at */
+    uint64_t    prealloc;   /* Bytes reserved for this segment */
+    double      started;
+    double      audio_secs; /* In this segment */
+} capture_t;
+
+
+/* Stream statistics (-s) */
+typedef struct _stream_stats_t
+{
+    double      start;
+    uint64_t    bytes;       /* Received (audio only) */
+    uint64_t    dropped;     /* Thrown away without being analyzed */
+    uint64_t    oob_bytes;
+    long        oob_regions;
+    long        crc_checked; /* Protected frames (-k) */
+    long        crc_failed;
+    recv_ring_t received;
+    hist_t      recv_detect; /* First byte of a region arriving to finding it */
+    hist_t      detect_sink; /* Finding OOB data to having written it out */
+    icy_t      *icy;         /* Metadata taken out of the stream */
+
+    /* OOB region that may continue in data not yet received */
+    double      pend_time;
+    double      pend_recv;
+    uint64_t    pend_offset;
+    uint64_t    pend_bytes;
+    char        pend_head[25];
+    triage_t    pend_triage;
+} stream_stats_t;
 
 
 /* Globals so we can gracefully exit */
-static FILE             *insert_fp = NULL;   /* File   */
-static const int        *insert_sd = NULL;   /* Socket */
-static const hostdata_t *insert_host = NULL; /* Host   */
+static capture_t        *insert_cap = NULL;   /* File   */
+static const int        *insert_sd = NULL;    /* Socket */
+static const hostdata_t *insert_host = NULL;  /* Host   */
+static stream_stats_t   *insert_stats = NULL; /* Stats  */
+
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+
+static int hist_bucket(uint64_t us)
+{
+    int e;
+
+    if (us < HIST_SUB)
+      return us;
+
+    for (e=0; us >> (e + 1); e++)
+      ;
+    return (e - 2) * HIST_SUB + ((us >> (e - 3)) & (HIST_SUB - 1));
+}
+
+
+/* Smallest value that lands in 'bucket' */
+static uint64_t hist_floor(int bucket)
+{
+    if (bucket < HIST_SUB)
+      return bucket;
+
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (bucket / HIST_SUB - 1);
+}
+
+
+static void hist_add(hist_t *hist, double secs)
+{
+    uint64_t us;
+
+    us = (secs > 0) ? secs * 1000000 : 0;
+    ++hist->counts[hist_bucket(us)];
+    ++hist->n;
+    if (us > hist->max)
+      hist->max = us;
+}
+
+
+/* Largest value that lands in the bucket holding 'pct' percent of values */
+static uint64_t hist_percentile(const hist_t *hist, double pct)
+{
+    int      i;
+    uint64_t seen, want;
+
+    want = (hist->n * pct + 99) / 100;
+    if (want < 1)
+      want = 1;
+
+    for (i=seen=0; i<HIST_BUCKETS - 1; i++)
+      if ((seen += hist->counts[i]) >= want)
+        break;
+
+    return (hist_floor(i + 1) - 1 < hist->max) ? hist_floor(i + 1) - 1 :
+                                                 hist->max;
+}
+
+
+static void print_hist(const char *stage, const hist_t *hist)
+{
+    printf("latency stage=%s count=%" PRIu64 " p50_us=%" PRIu64
+           " p99_us=%" PRIu64 " max_us=%" PRIu64 "\n", stage, hist->n,
+           hist_percentile(hist, 50), hist_percentile(hist, 99), hist->max);
+}
+
+
+static void recv_add(recv_ring_t *ring, uint64_t end, double when)
+{
+    int i;
+
+    if (ring->count == RECV_RING_SZ)
+    {
+        ring->first = (ring->first + 1) % RECV_RING_SZ;
+        --ring->count;
+    }
+
+    i = (ring->first + ring->count) % RECV_RING_SZ;
+    ring->ends[i] = end;
+    ring->times[i] = when;
+    ++ring->count;
+}
+
+
+/* When the byte at stream offset 'offset' was received */
+static double recv_time(const recv_ring_t *ring, uint64_t offset)
+{
+    int i, j;
+
+    for (i=0; i<ring->count; i++)
+    {
+        j = (ring->first + i) % RECV_RING_SZ;
+        if (offset < ring->ends[j])
+          return ring->times[j];
+    }
+
+    return (ring->count) ? ring->times[ring->first] : now();
+}
+
+
+static void flush_oob(stream_stats_t *stats)
+{
+    char desc[128];
+
+    if (!stats->pend_bytes)
+      return;
+
+    ++stats->oob_regions;
+    stats->oob_bytes += stats->pend_bytes;
+    hist_add(&stats->recv_detect, stats->pend_time - stats->pend_recv);
+    triage_finish(&stats->pend_triage);
+    triage_format(&stats->pend_triage, desc, sizeof(desc));
+    printf("oob time=%.6f offset=%" PRIu64 " bytes=%" PRIu64
+           " recv_detect_us=%.0f %s head=%s\n", stats->pend_time,
+           stats->pend_offset, stats->pend_bytes,
+           (stats->pend_time - stats->pend_recv) * 1000000, desc,
+           stats->pend_head);
+    stats->pend_bytes = 0;
+}
+
+
+static void print_stats(stream_stats_t *stats)
+{
+    double secs;
+
+    flush_oob(stats);
+    secs = now() - stats->start;
+    printf("stream bytes=%" PRIu64 " seconds=%.3f bytes_per_sec=%.0f "
+           "dropped=%" PRIu64 " oob_regions=%ld oob_bytes=%" PRIu64
+           " crc_checked=%ld crc_failed=%ld\n",
+           stats->bytes, secs, (secs > 0) ? stats->bytes / secs : 0.0,
+           stats->dropped, stats->oob_regions, stats->oob_bytes,
+           stats->crc_checked, stats->crc_failed);
+    if (stats->icy)
+      printf("icy metaint=%d blocks=%" PRIu64 " bytes=%" PRIu64 "\n",
+             stats->icy->metaint, stats->icy->n_blocks, stats->icy->n_bytes);
+    print_hist("recv_detect", &stats->recv_detect);
+    print_hist("detect_sink", &stats->detect_sink);
+}
+
+
+/* Record OOB data found at 'detected' at stream offset 'offset'.  A region is
+ * reported once it is 'complete' (a frame or tag follows it), so one cut short
+ * by the end of the buffer is joined up with the rest of it.
+ */
+static void stats_oob(
+    stream_stats_t      *stats,
+    const unsigned char *oob,
+    int                  oob_sz,
+    uint64_t             offset,
+    int                  complete,
+    double               detected)
+{
+    int i, n;
+
+    if (stats->pend_bytes &&
+        (stats->pend_offset + stats->pend_bytes != offset))
+      flush_oob(stats);
+
+    if (!stats->pend_bytes)
+    {
+        stats->pend_time = detected;
+        stats->pend_recv = recv_time(&stats->received, offset);
+        stats->pend_offset = offset;
+        stats->pend_head[0] = '\0';
+        triage_init(&stats->pend_triage);
+    }
+    stats->pend_bytes += oob_sz;
+    triage_add(&stats->pend_triage, oob, oob_sz);
+
+    /* Keep records "key=value", spaces and binary become '.' */
+    n = strlen(stats->pend_head);
+    for (i=0; i<oob_sz && n<(int)sizeof(stats->pend_head)-1; i++)
+      stats->pend_head[n++] = (oob[i] > 32 && oob[i] < 127) ? oob[i] : '.';
+    stats->pend_head[n] = '\0';
+
+    if (complete)
+      flush_oob(stats);
+}
+
+
+/* Wait up to 'secs' for 'sd' to have data, returns 0 if it did not */
+static int wait_readable(int sd, double secs)
+{
+    fd_set         readfds;
+    struct timeval tv;
+
+    if (secs <= 0)
+      return 0;
+
+    FD_ZERO(&readfds);
+    FD_SET(sd, &readfds);
+    tv.tv_sec = secs;
+    tv.tv_usec = (secs - tv.tv_sec) * 1000000;
+
+    return select(sd+1, &readfds, NULL, NULL, &tv) != 0;
+}
+
+
+static int capture_open(capture_t *cap)
+{
+    if (!(cap->fp = util_create_file_named(cap->host, "captured-stream", "mp3",
+                                           1, &cap->fname)))
+      return 0;
+
+    cap->written = 0;
+    cap->audio_secs = 0.0;
+    cap->started = now();
+
+    /* Reserve the segment up front so it is not fragmented (the size of the
+     * last one if only the duration is known)
+     */
+    if (cap->seg_bytes)
+      cap->prealloc = cap->seg_bytes;
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (cap->prealloc &&
+        (fallocate(fileno(cap->fp), FALLOC_FL_KEEP_SIZE, 0, cap->prealloc) ==
+         -1))
+      VERBOSE(TAG " Could not preallocate '%s'\n", cap->fname);
+#endif
+
+    return 1;
+}
+
+
+static void capture_close(capture_t *cap)
+{
+    if (!cap->fp)
+      return;
+
+    /* Give back whatever was reserved and not used */
+    fflush(cap->fp);
+    if (cap->prealloc > cap->written &&
+        ftruncate(fileno(cap->fp), cap->written) == -1)
+      VERBOSE(TAG " Could not trim '%s'\n", cap->fname);
+
+    util_close_file(cap->fp);
+    cap->fp = NULL;
+
+    if (cap->index)
+    {
+        fprintf(cap->index, "segment file=%s offset=%" PRIu64 " bytes=%" PRIu64
+                " start=%.6f seconds=%.3f\n", cap->fname, cap->offset,
+                cap->written, cap->started, cap->audio_secs);
+        fflush(cap->index);
+    }
+
+    cap->offset += cap->written;
+    if (!cap->seg_bytes)
+      cap->prealloc = cap->written;
+    free(cap->fname);
+    cap->fname = NULL;
+}
+
+
+static void capture_write(capture_t *cap, const char *data, int size)
+{
+    if (cap && cap->fp && size > 0)
+    {
+        fwrite(data, size, 1, cap->fp);
+        cap->written += size;
+    }
+}
+
+
+/* A frame or tag ('obj', 'size' bytes) is next, start a new segment in front
+ * of it if it is time
+ */
+static void capture_boundary(
+    capture_t           *cap,
+    const unsigned char *obj,
+    int                  size,
+    int                  is_frame,
+    format_t             format)
+{
+    int rate;
+
+    if (!cap || !cap->fp)
+      return;
+
+    if ((cap->seg_bytes && cap->written &&
+         (cap->written + size > cap->seg_bytes)) ||
+        (cap->seg_secs && (cap->audio_secs >= cap->seg_secs)))
+    {
+        capture_close(cap);
+        if (!capture_open(cap))
+          return;
+    }
+
+    if (is_frame && (rate = format_samplerate(format, obj)))
+      cap->audio_secs += (double)format_samples(format, obj) / rate;
+}
 
 
 /* Gracefully exit if the user kills us */
 static void signal_handler(int signum)
 {
-    if (insert_fp)
-      fclose(insert_fp);
+    if (insert_cap)
+      capture_close(insert_cap);
     if (insert_sd)
       close(*insert_sd);
     if (insert_host)
@@ -56,6 +456,9 @@ static void signal_handler(int signum)
         free(insert_host->port);
     }
     
+    if (insert_stats)
+      print_stats(insert_stats);
+
     printf("\n" TAG " session gracefully terminated\n");
     fflush(stdout);
 
@@ -88,139 +491,413 @@ static int connect_host(const char *host, int port)
 }
 
 
+/* Where the value of the response header 'name' (between 'hdr' and 'end')
+ * starts, NULL if it is not there
+ */
+static const char *header_string(
+    const char *hdr,
+    const char *end,
+    const char *name)
+{
+    const char *c;
+
+    for (c=hdr; c && c<end; c=strchr(c, '\n'))
+    {
+        while (*c == '\r' || *c == '\n')
+          ++c;
+        if ((strncasecmp(c, name, strlen(name)) == 0) &&
+            (c[strlen(name)] == ':'))
+          return c + strlen(name) + 1;
+    }
+
+    return NULL;
+}
+
+
+/* Value of the response header 'name' (between 'hdr' and 'end'), 0 if it is
+ * not there
+ */
+static int header_value(const char *hdr, const char *end, const char *name)
+{
+    const char *c;
+
+    return (c = header_string(hdr, end, name)) ? atoi(c) : 0;
+}
+
+
+/* Does the response (header between 'hdr' and 'end') hold a playlist (m3u,
+ * pls or a redirect) to follow?  Anything else is the stream itself, be it
+ * audio/mpeg, audio/aac, audio/aacp or whatever else the server calls it.
+ */
+static int is_playlist(const char *hdr, const char *end)
+{
+    size_t      i, len;
+    const char *type;
+
+    if (!(type = header_string(hdr, end, "content-type")))
+      return 1;
+    while (*type == ' ')
+      ++type;
+
+    len = strcspn(type, ";\r\n");
+    if ((len >= 5) && (strncasecmp(type, "text/", 5) == 0))
+      return 1;
+    for (i=0; i<len; i++)
+      if ((strncasecmp(type + i, "mpegurl", 7) == 0) ||
+          (strncasecmp(type + i, "pls", 3) == 0))
+        return 1;
+
+    return 0;
+}
+
+
+/* Write out a metadata block once all of it has been received */
+static void icy_block(icy_t *icy, uint64_t offset)
+{
+    /* Blocks are padded out with NULs */
+    icy->meta[icy->meta_sz] = '\0';
+    if (!(icy->meta_sz = strlen(icy->meta)))
+      return;
+
+    ++icy->n_blocks;
+    VERBOSE(TAG " ICY metadata: %s\n", icy->meta);
+    if (icy->sink)
+    {
+        fprintf(icy->sink, "offset=%" PRIu64 " %s\n", offset, icy->meta);
+        fflush(icy->sink);
+    }
+}
+
+
+/* Take the metadata blocks out of the 'size' bytes of 'data' in place,
+ * leaving only the audio, which starts at stream offset 'offset'.  Returns the
+ * number of audio bytes left.
+ */
+static int icy_demux(icy_t *icy, char *data, int size, uint64_t offset)
+{
+    int in, out, n;
+
+    in = out = 0;
+    while (in < size)
+    {
+        /* Audio */
+        if (icy->audio_left)
+        {
+            n = (icy->audio_left < size - in) ? icy->audio_left : size - in;
+            if (out != in)
+              memmove(data + out, data + in, n);
+            in += n;
+            out += n;
+            icy->audio_left -= n;
+        }
+
+        /* Length of the next block, in 16 byte units */
+        else if (icy->meta_left < 0)
+        {
+            icy->meta_left = (unsigned char)data[in++] * 16;
+            icy->meta_sz = 0;
+            ++icy->n_bytes;
+        }
+
+        /* Metadata */
+        else
+        {
+            n = (icy->meta_left < size - in) ? icy->meta_left : size - in;
+            memcpy(icy->meta + icy->meta_sz, data + in, n);
+            in += n;
+            icy->meta_sz += n;
+            icy->meta_left -= n;
+            icy->n_bytes += n;
+        }
+
+        if (!icy->audio_left && (icy->meta_left == 0))
+        {
+            icy_block(icy, offset + out);
+            icy->audio_left = icy->metaint;
+            icy->meta_left = -1;
+        }
+    }
+
+    return out;
+}
+
+
+/* Remove 'n' bytes from the front of the brain (capturing them) */
+#define CONSUME(_n)                                              \
+    {capture_write(capture, brain, (_n));                        \
+     memmove(brain, brain + (_n), curr_brain_sz - (_n));         \
+     curr_brain_sz -= (_n);                                      \
+     brain_base += (_n);}
+
+/* Throw everything in the brain away (it is still captured) */
+#define DROP()                                                   \
+    {capture_write(capture, brain, curr_brain_sz);               \
+     brain_base += curr_brain_sz;                                \
+     curr_brain_sz = 0;                                          \
+     ignore_oob = 1;}
+
+
 static void suck_data_from_stream(
     int         sockfd,
-    FILE       *savefp,
+    capture_t  *capture,
     flags_t     flags,
-    const char *host)
+    const char *host,
+    char       *head,
+    int         head_sz,
+    int         metaint,
+    int         deadline_ms)
 {
     static const int brain_sz = DEFAULT_BLK_SZ * 4;
 
-    int            ignore_oob, index;
-    int            recv_sz, curr_brain_sz, frame_length;
-    char           data[DEFAULT_BLK_SZ], brain[brain_sz];
-    FILE          *oob_file;
-    STREAM_OBJECT  type;
-    mp3_frame_t    frame;
-    id3_tag_t      id3_tag;
+    int             ignore_oob, index, oob_sz, eof, timed_out;
+    int             recv_sz, curr_brain_sz, obj_length, crc_ok;
+    uint16_t        stored, computed;
+    char            data[DEFAULT_BLK_SZ], brain[brain_sz];
+    double          waiting_since, detected;
+    uint64_t        brain_base; /* Stream offset of brain[0] */
+    FILE           *oob_file;
+    STREAM_OBJECT   type;
+    format_t        format;
+    id3_tag_t       id3_tag;
+    stream_stats_t *stats;
+    triage_t        tri;
     
     /* If we want to store oob data */ 
     oob_file = NULL;
     if (flags & FLAG_EXTRACT_MODE)
       oob_file = util_create_file(host, "extracted-oob", "dat", 0);
 
+    stats = calloc(1, sizeof(stream_stats_t));
+    stats->start = now();
+    if (flags & FLAG_STATS_MODE)
+      insert_stats = stats;
+
+    /* Metadata goes to its own file rather than being taken for OOB data */
+    if (metaint > 0)
+    {
+        stats->icy = calloc(1, sizeof(icy_t));
+        stats->icy->metaint = stats->icy->audio_left = metaint;
+        stats->icy->meta_left = -1;
+        stats->icy->sink = util_create_file(host, "icy-metadata", "txt", 0);
+    }
+
     /* Grab data from stream (don't analyize first chunk) */
+    format = FORMAT_UNKNOWN;
     ignore_oob = 1;
-    index = 0;
+    index = eof = 0;
     curr_brain_sz = 0;
-    while ((recv_sz = read(sockfd, data, sizeof(data))) > 0)
+    brain_base = 0;
+    waiting_since = 0.0;
+
+    for ( ;; )
     {
+        /* Do not sit on data for longer than the deadline */
+        recv_sz = 0;
+        timed_out = deadline_ms && curr_brain_sz && (waiting_since > 0) &&
+                    (head_sz <= 0) &&
+                    !wait_readable(sockfd, waiting_since +
+                                   deadline_ms / 1000.0 - now());
+
+        /* Stream data that came in with the response header goes first,
+         * a block at a time like anything read after it
+         */
+        if (head_sz > 0)
+        {
+            recv_sz = (head_sz < (int)sizeof(data)) ? head_sz : sizeof(data);
+            memcpy(data, head, recv_sz);
+            head += recv_sz;
+            head_sz -= recv_sz;
+        }
+
+        /* Once the stream ends whatever is left gets analyzed too */
+        else if (!timed_out &&
+                 (recv_sz = read(sockfd, data, sizeof(data))) <= 0)
+        {
+            eof = 1;
+            recv_sz = 0;
+        }
+
+        if (recv_sz && stats->icy)
+          recv_sz = icy_demux(stats->icy, data, recv_sz, stats->bytes);
+
+        if (recv_sz)
+        {
+            stats->bytes += recv_sz;
+            if (flags & FLAG_STATS_MODE)
+              recv_add(&stats->received, stats->bytes, now());
+        }
+
         /* Once buffer is full analyize all frames */
-        if (curr_brain_sz + recv_sz >= brain_sz)
+        if (eof || timed_out || (curr_brain_sz + recv_sz >= brain_sz))
         {
+            waiting_since = 0.0;
+
+            /* MPEG audio or ADTS AAC, from the first frames that come */
+            if (format == FORMAT_UNKNOWN)
+              format = format_detect((unsigned char *)brain, curr_brain_sz);
+
             for ( ;; )
             {
-                type = util_next_mp3_frame_or_id3v2(NULL, brain, curr_brain_sz,
-                                                    ignore_oob, &index,
-                                                    oob_file);
+                type = util_next_mp3_frame_or_id3v2(format, NULL, brain,
+                                                    curr_brain_sz, 1, &index,
+                                                    NULL, &oob_sz);
+
+                /* OOB data is everything in front of the frame/tag */
+                if (oob_sz)
+                {
+                    detected = (flags & FLAG_STATS_MODE) ? now() : 0.0;
+
+                    util_display_oob((unsigned char *)brain, oob_sz,
+                                     ignore_oob);
+                    if (main_oob_threshold)
+                      triage_region(&tri, (unsigned char *)brain, oob_sz);
+                    if (oob_file &&
+                        (!main_oob_threshold ||
+                         tri.score >= main_oob_threshold))
+                    {
+                        fwrite(brain, oob_sz, 1, oob_file);
+                        fflush(oob_file);
+                    }
+
+                    if (!ignore_oob && (flags & FLAG_STATS_MODE))
+                    {
+                        hist_add(&stats->detect_sink, now() - detected);
+                        stats_oob(stats, (unsigned char *)brain, oob_sz,
+                                  brain_base, type != STREAM_OBJECT_UNKNOWN,
+                                  detected);
+                    }
+                }
 
                 /* At the end if UNKNOWN or our length does not match 
-                 * amount in buffer * continue gathering 
+                 * amount in buffer * continue gathering (keeping what was
+                 * too short to be looked at)
                  */
                 if (type == STREAM_OBJECT_UNKNOWN)
                 {
-                    curr_brain_sz = 0;
-                    ignore_oob = 1;
+                    CONSUME(index);
                     break;
                 }
                 else if (type == STREAM_OBJECT_MP3_FRAME)
                 {
-                     mp3_set_header(&frame, brain + index);
-                     frame_length = frame.audio_size + frame.header_size;
+                    obj_length = format_frame_length(format, (unsigned char *)
+                                                     brain + index);
 #ifdef DEBUG
-                     printf("frame: %d\n", frame_length);
+                    printf("frame: %d\n", obj_length);
 #endif
-                   /* Gather more data */
-                   if (frame_length >= curr_brain_sz)
-                       break;
-
-                   /* Remove the frame and continue analyizing */
-                   else if (frame_length != 0)
-                   {
-                       frame_length += index;
-                       memmove(brain, brain + frame_length,
-                               brain_sz - frame_length);
-                       curr_brain_sz -= frame_length;
-                    }
-                    else
-                    {
-                        curr_brain_sz = 0;
-                        ignore_oob = 1;
-                        break;
-                    }
                 }
-                else if (type == STREAM_OBJECT_ID3V2_TAG)
+                else /* (type == STREAM_OBJECT_ID3V2_TAG) */
                 {
                     id3_set_header(&id3_tag, brain + index);
-                    id3_tag.size += 10 + ((id3_tag.footer) ? 10 : 0);
-                  
-                    /* Gather more data */
-                    if (id3_tag.size >= curr_brain_sz)
-                      break;
-
-                    /* Remove the tag and continue analyizing */
-                    else if (id3_tag.size != 0)
-                    {
+                    obj_length = 10 + id3_tag.size + ((id3_tag.footer) ? 10:0);
 #ifdef DEBUG
-                     printf("tag: %d\n", id3_tag.size);
+                    printf("tag: %d\n", obj_length);
 #endif
-                       id3_tag.size += index;
-                       memmove(brain, brain + id3_tag.size,
-                               brain_sz - id3_tag.size);
-                       curr_brain_sz -= id3_tag.size;
-                    }
-                    else
+                }
+
+                /* Garbage */
+                if (obj_length <= 0)
+                {
+                    DROP();
+                    break;
+                }
+
+                /* The OOB data has been reported, only keep the frame/tag */
+                CONSUME(index);
+
+                /* Gather more data (the last frame of a stream is whole) */
+                if ((obj_length > curr_brain_sz) ||
+                    ((obj_length == curr_brain_sz) && !eof))
+                  break;
+
+                /* Whole frame in hand, check it if it is protected */
+                if ((flags & FLAG_CRC_MODE) && (format != FORMAT_ADTS) &&
+                    (type == STREAM_OBJECT_MP3_FRAME) &&
+                    (crc_ok = mp3_check_crc((unsigned char *)brain,
+                                            obj_length, &stored,
+                                            &computed)) != -1)
+                {
+                    ++stats->crc_checked;
+                    if (!crc_ok)
                     {
-                        curr_brain_sz = 0;
-                        ignore_oob = 1;
-                        break;
+                        ++stats->crc_failed;
+                        printf(TAG " CRC mismatch: frame at offset %" PRIu64
+                               " (stored 0x%04x, computed 0x%04x)\n",
+                               brain_base, stored, computed);
                     }
                 }
+
+                /* Remove the frame/tag and continue analyizing */
+                capture_boundary(capture, (unsigned char *)brain, obj_length,
+                                 type == STREAM_OBJECT_MP3_FRAME, format);
+                CONSUME(obj_length);
                 ignore_oob = 0;
             }
         }
 
-        /* Add data to buffer */
+        /* Anything left is still captured */
+        if (eof)
+        {
+            CONSUME(curr_brain_sz);
+            break;
+        }
+        else if (!recv_sz)
+          continue;
+
+        /* Add data to buffer (a frame/tag too big for it is lost) */
         if (curr_brain_sz + recv_sz > brain_sz)
         {
-            curr_brain_sz = 0;
+            stats->dropped += curr_brain_sz + recv_sz;
+            DROP();
+            capture_write(capture, data, recv_sz);
+            brain_base += recv_sz;
             continue;
         }
 
         memcpy(brain + curr_brain_sz, data, recv_sz);
         curr_brain_sz += recv_sz;
+        if (waiting_since == 0.0)
+          waiting_since = now();
+    }
+
+    if (flags & FLAG_STATS_MODE)
+    {
+        print_stats(stats);
+        insert_stats = NULL;
+    }
 
-        if (flags & FLAG_CAPTURE_MODE)
-          fwrite(data, recv_sz, 1, savefp);
+    if (stats->icy)
+    {
+        if (stats->icy->sink)
+          util_close_file(stats->icy->sink);
+        free(stats->icy);
     }
+    free(stats);
+    if (oob_file)
+      util_close_file(oob_file);
 }
 
 
-static int get_stream_info(flags_t flags, int sd, const hostdata_t *host)
+static int get_stream_info(
+    flags_t              flags,
+    int                  sd,
+    const hostdata_t    *host,
+    const stream_opts_t *opts)
 {
     static const int buf_blk_sz = DEFAULT_BLK_SZ;
 
-    int            ret, redirected, total_sz, recv_sz, n_buf_blks;
-    char          *buf, *c, query[DEFAULT_BLK_SZ];
+    int            ret, redirected, total_sz, recv_sz, n_buf_blks, head_sz;
+    int            metaint;
+    char          *buf, *body, *c, query[DEFAULT_BLK_SZ];
     char           data[DEFAULT_BLK_SZ];
-    FILE          *fp;
     fd_set         readfds;
+    capture_t      capture;
     hostdata_t     newhost;
     struct timeval tv;
 
     snprintf(query, sizeof(query), 
-             "GET %s HTTP/1.0\r\nHost: %s:%s\r\n\r\n",
-             host->file, host->host, host->port);
+             "GET %s HTTP/1.0\r\nHost: %s:%s\r\n%s\r\n",
+             host->file, host->host, host->port,
+             (flags & FLAG_ICY_MODE) ? "Icy-MetaData: 1\r\n" : "");
 
 #ifdef DEBUG
         printf("query: %s", query);
@@ -230,19 +907,18 @@ static int get_stream_info(flags_t flags, int sd, const hostdata_t *host)
       return 0;
 
     /* Query for stream info */
-    fp = NULL;
     total_sz = 0;
     n_buf_blks = 0;
-    buf = NULL;
+    buf = body = NULL;
     redirected = 0;
 
-    FD_ZERO(&readfds);
-    FD_SET(sd, &readfds);
-    memset(&tv, 0, sizeof(struct timeval));
-    tv.tv_sec = 3;
-
     for ( ;; )
     {
+        FD_ZERO(&readfds);
+        FD_SET(sd, &readfds);
+        memset(&tv, 0, sizeof(struct timeval));
+        tv.tv_sec = 3;
+
         ret = select(sd+1, &readfds, NULL, NULL, &tv);
         if (ret == -1)
         {
@@ -252,78 +928,115 @@ static int get_stream_info(flags_t flags, int sd, const hostdata_t *host)
         else if (!ret)
           break;
         
-        /* Socket is ready ... */
+        /* Socket is ready ... (keep the buffer a string) */
         if ((recv_sz = read(sd, data, sizeof(data))) > 0 )
         {
-            if ((recv_sz + total_sz) >= (n_buf_blks * buf_blk_sz))
+            if ((recv_sz + total_sz + 1) >= (n_buf_blks * buf_blk_sz))
               buf = realloc(buf, (++n_buf_blks) * buf_blk_sz);
 
             memcpy(buf + total_sz, data, recv_sz);
             total_sz += recv_sz;
+            buf[total_sz] = '\0';
 
             if ((total_sz > 4) && (strncmp(buf, "HTTP", 4) == 0))
               redirected = 1;
+
+            /* Audio served over HTTP rather than a playlist */
+            if (redirected && (body = strstr(buf, "\r\n\r\n")) &&
+                !is_playlist(buf, body))
+            {
+                redirected = 0;
+                break;
+            }
         }
 
-        if (recv_sz == 0 || !redirected)
+        if (recv_sz <= 0)
+          break;
+
+        /* No header or playlist is this long, whatever it is, stop here */
+        else if (total_sz >= STREAM_HEAD_MAX)
+          break;
+
+        /* Shoutcast answers "ICY 200 OK", get all of its header */
+        else if (!redirected &&
+                 !((flags & FLAG_ICY_MODE) && (strncmp(buf, "ICY", 3) == 0) &&
+                   !strstr(buf, "\r\n\r\n")))
           break;
     }
 
-    /* Get the potential new host from the just read in data */
+    /* Get the potential new host from the just read in data (an HTTP
+     * response without one is the stream itself)
+     */
     if (redirected && buf && !(c = strstr(buf, "http://")))
-    {
-        free(buf);
-        return 0;
-    }
+      redirected = 0;
     else if (redirected && buf)
     {
-        strtok(c, "\n");
+        strtok(c, "\r\n");
         util_url_to_host_port_file(c, &newhost);
     }
 
-    free(buf);
+    /* Whatever followed the response header is already stream data */
+    head_sz = metaint = 0;
+    if (!redirected && buf && (body = strstr(buf, "\r\n\r\n")))
+    {
+        if (flags & FLAG_ICY_MODE)
+          metaint = header_value(buf, body, "icy-metaint");
+        body += 4;
+        head_sz = total_sz - (body - buf);
+    }
 
     /* Disconnect here and contact server in m3u/pls */
     if (redirected)
     {
+        free(buf);
         close(sd);
-        if (!(sd = connect_host(newhost.host, newhost.portnum)))
-          return 0;
 
-        /* Get data from new host */
-        snprintf(query, sizeof(query),
-                 "GET %s HTTP/1.0\r\nHost: %s:%s\r\n\r\n",
-                 newhost.file, newhost.host, newhost.port);
-#ifdef DEBUG
-            printf("query: %s", query);
-#endif
+        ret = 0;
+        if ((sd = connect_host(newhost.host, newhost.portnum)))
+        {
+            ret = get_stream_info(flags, sd, &newhost, opts);
+            close(sd);
+        }
+
         free(newhost.file);
         free(newhost.host);
         free(newhost.port);
-    
-        /* Query */
-        if (write(sd, query, strlen(query)) < 1)
-          return 0;
+        return ret;
     }
 
     /* Create file to capture stream to */
-    if ((flags & FLAG_CAPTURE_MODE) &&
-        (!(fp = util_create_file(host->host, "captured-stream", "mp3", 1))))
-      return 0;
+    memset(&capture, 0, sizeof(capture_t));
+    capture.host = host->host;
+    capture.seg_bytes = opts->seg_bytes;
+    capture.seg_secs = opts->seg_secs;
+    if ((flags & FLAG_CAPTURE_MODE) && (opts->seg_bytes || opts->seg_secs))
+      capture.index = util_create_file(host->host, "capture-index", "txt", 1);
+    if ((flags & FLAG_CAPTURE_MODE) && !capture_open(&capture))
+    {
+        free(buf);
+        return 0;
+    }
 
     /* Pull data from stream and analyize */
     insert_host = host;
-    insert_fp = fp;
-    suck_data_from_stream(sd, fp, flags, host->host);
+    insert_cap = &capture;
+    suck_data_from_stream(sd, &capture, flags, host->host, body, head_sz,
+                          metaint, opts->deadline_ms);
 
-    if (fp)
-      fclose(fp);
+    free(buf);
+    capture_close(&capture);
+    if (capture.index)
+      util_close_file(capture.index);
+    insert_cap = NULL;
 
     return 1;
 }
 
 
-void handle_as_stream(const char *url, flags_t flags)
+void handle_as_stream(
+    const char          *url,
+    flags_t              flags,
+    const stream_opts_t *opts)
 {
     int        sd;
     hostdata_t host;
@@ -337,7 +1050,7 @@ void handle_as_stream(const char *url, flags_t flags)
     insert_sd = &sd;
     signal(SIGINT, signal_handler);
 
-    if (!(get_stream_info(flags, sd, &host)))
+    if (!(get_stream_info(flags, sd, &host, opts)))
       return;
 
     /* Disconnect */
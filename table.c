@@ -0,0 +1,549 @@
+/******************************************************************************
+ * table.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * table.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "table.h"
+#include "utils.h"
+
+
+/* On disk: magic, then a header of counts, then each array in turn */
+#define TABLE_MAGIC   "MP3NIDX"
+#define TABLE_VERSION 4
+#define TABLE_BOM     0x01020304 /* Detects a table from another byte order */
+
+typedef struct _table_file_hdr_t
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t bom;
+    uint64_t n_frames;
+    uint64_t n_tags;
+    uint64_t n_oob;
+    uint64_t n_anchors;
+    uint64_t size;
+    double   secs;
+    uint32_t format;
+    uint32_t unused;
+    table_source_t source;
+} table_file_hdr_t;
+
+
+frame_table_t *table_new(void)
+{
+    return calloc(1, sizeof(frame_table_t));
+}
+
+
+void span_free(span_table_t *spans)
+{
+    free(spans->offsets);
+    free(spans->lengths);
+}
+
+
+void table_free(frame_table_t *table)
+{
+    if (!table)
+      return;
+
+    free(table->offsets);
+    free(table->headers);
+    free(table->lengths);
+    span_free(&table->tags);
+    span_free(&table->oob);
+    free(table->anchors.usecs);
+    free(table->anchors.frames);
+    free(table);
+}
+
+
+void span_add(span_table_t *spans, uint64_t offset, uint32_t length)
+{
+    if (spans->count == spans->alloc)
+    {
+        spans->alloc = (spans->alloc) ? spans->alloc * 2 : DEFAULT_BLK_SZ;
+        spans->offsets = realloc(spans->offsets,
+                                 spans->alloc * sizeof(uint64_t));
+        spans->lengths = realloc(spans->lengths,
+                                 spans->alloc * sizeof(uint32_t));
+    }
+
+    spans->offsets[spans->count] = offset;
+    spans->lengths[spans->count] = length;
+    ++spans->count;
+}
+
+
+/* OOB regions split across scans are joined back together, and regions too
+ * large for a span are split up
+ */
+static void add_oob(span_table_t *oob, uint64_t offset, uint64_t length)
+{
+    uint32_t n;
+
+    while (length)
+    {
+        if (oob->count &&
+            (oob->offsets[oob->count-1] + oob->lengths[oob->count-1] ==
+             offset) &&
+            (oob->lengths[oob->count-1] < UINT32_MAX))
+        {
+            n = (length < UINT32_MAX - oob->lengths[oob->count-1]) ?
+                length : UINT32_MAX - oob->lengths[oob->count-1];
+            oob->lengths[oob->count-1] += n;
+        }
+        else
+        {
+            n = (length < UINT32_MAX) ? length : UINT32_MAX;
+            span_add(oob, offset, n);
+        }
+
+        offset += n;
+        length -= n;
+    }
+}
+
+
+static void add_anchor(anchor_table_t *anchors, double secs, uint64_t frame)
+{
+    if (anchors->count == anchors->alloc)
+    {
+        anchors->alloc = (anchors->alloc) ? anchors->alloc * 2 : 64;
+        anchors->usecs = realloc(anchors->usecs,
+                                 anchors->alloc * sizeof(uint64_t));
+        anchors->frames = realloc(anchors->frames,
+                                  anchors->alloc * sizeof(uint64_t));
+    }
+
+    anchors->usecs[anchors->count] = (uint64_t)(secs * 1000000.0 + 0.5);
+    anchors->frames[anchors->count] = frame;
+    ++anchors->count;
+}
+
+
+/* Bit rate, frame size and format of a frame, counted from its header */
+static void count_frame(
+    audio_stats_t       *stats,
+    format_t             format,
+    size_t               n_frames,
+    uint64_t             offset,
+    const unsigned char *h,
+    uint16_t             length)
+{
+    int      i, kbps;
+    uint32_t key;
+
+    stats->audio_bytes += length;
+    if (!n_frames || (length < stats->min_length))
+      stats->min_length = length;
+    if (length > stats->max_length)
+      stats->max_length = length;
+
+    /* A change of version, layer, sample rate or channels mid-file is often
+     * where two files were spliced together
+     */
+    key = format_key(format, h);
+    if (n_frames && (key != stats->format))
+    {
+        if (!stats->format_changes++)
+          stats->first_change = offset;
+    }
+    stats->format = key;
+
+    /* Frames per bit rate, kept in order of bit rate */
+    kbps = format_bitrate(format, h, length) / 1000;
+    for (i=0; (i < stats->n_bitrates) && (stats->kbps[i] < kbps); i++)
+      ;
+    if ((i == stats->n_bitrates) || (stats->kbps[i] != kbps))
+    {
+        if (stats->n_bitrates == STATS_MAX_BITRATES)
+          return;
+        memmove(&stats->kbps[i+1], &stats->kbps[i],
+                (stats->n_bitrates - i) * sizeof(int));
+        memmove(&stats->kbps_frames[i+1], &stats->kbps_frames[i],
+                (stats->n_bitrates - i) * sizeof(long));
+        stats->kbps[i] = kbps;
+        stats->kbps_frames[i] = 0;
+        ++stats->n_bitrates;
+    }
+    ++stats->kbps_frames[i];
+}
+
+
+static void add_frame(
+    frame_table_t       *table,
+    format_t             format,
+    uint64_t             offset,
+    const unsigned char *h,
+    uint16_t             length)
+{
+    int rate;
+
+    if (table->n_frames == table->alloc)
+    {
+        table->alloc = (table->alloc) ? table->alloc * 2 : DEFAULT_BLK_SZ;
+        table->offsets = realloc(table->offsets,
+                                 table->alloc * sizeof(uint64_t));
+        table->headers = realloc(table->headers,
+                                 table->alloc * sizeof(uint32_t));
+        table->lengths = realloc(table->lengths,
+                                 table->alloc * sizeof(uint16_t));
+    }
+
+    table->offsets[table->n_frames] = offset;
+    table->headers[table->n_frames] = ((uint32_t)h[0] << 24) |
+                                      ((uint32_t)h[1] << 16) |
+                                      ((uint32_t)h[2] << 8)  | h[3];
+    table->lengths[table->n_frames] = length;
+
+    /* Keep time: anchor the first frame of each second */
+    if (table->secs >= (double)table->anchors.count * TABLE_ANCHOR_SECS)
+      add_anchor(&table->anchors, table->secs, table->n_frames);
+    if ((rate = format_samplerate(format, h)))
+      table->secs += (double)format_samples(format, h) / rate;
+
+    count_frame(&table->stats, format, table->n_frames, offset, h, length);
+    ++table->n_frames;
+}
+
+
+/* Same rules as util_next_mp3_frame_or_id3v2(), but over a block of memory.
+ * Inlined into table_scan() once per format.
+ */
+FORMAT_INLINE size_t scan_format(
+    format_t             format,
+    frame_table_t       *table,
+    const unsigned char *data,
+    size_t               data_sz,
+    uint64_t             base,
+    int                  final)
+{
+    int                  len;
+    size_t               i, oob_start;
+    const unsigned char *h;
+    id3_tag_t            tag;
+
+    i = oob_start = 0;
+    while (i + 3 <= data_sz)
+    {
+        h = data + i;
+        len = 0;
+
+        /* Sync frame (need the whole header to validate it) */
+        if (format_is_sync(format, h))
+        {
+            if (i + format_hdr_size(format) > data_sz)
+              break;
+            len = format_frame_length(format, h);
+        }
+
+        /* ID3v2 tag */
+        else if ((h[0] == 'I') && (h[1] == 'D') && (h[2] == '3'))
+        {
+            if (i + 10 > data_sz)
+            {
+                if (final)
+                  len = data_sz - i;
+                else
+                  break;
+            }
+            else
+            {
+                id3_set_header(&tag, (const char *)h);
+                len = 10 + tag.size + ((tag.footer) ? 10 : 0);
+            }
+        }
+
+        /* ID3v1 tag, last 128 bytes of the file (not a tag or OOB) */
+        else if (final && (h[0] == 'T') && (h[1] == 'A') && (h[2] == 'G') &&
+                 (i + 128 == data_sz))
+        {
+            if (oob_start < i)
+              add_oob(&table->oob, base + oob_start, i - oob_start);
+            i = oob_start = data_sz;
+            break;
+        }
+
+        if (len == 0)
+        {
+            ++i;
+            continue;
+        }
+
+        /* A frame or tag that we have not got all of yet */
+        if (i + len > data_sz)
+        {
+            if (!final)
+              break;
+            len = data_sz - i;
+        }
+
+        if (oob_start < i)
+          add_oob(&table->oob, base + oob_start, i - oob_start);
+
+        if (h[0] == 0xFF)
+          add_frame(table, format, base + i, h, len);
+        else
+          span_add(&table->tags, base + i, len);
+
+        i += len;
+        oob_start = i;
+    }
+
+    /* Anything left over at the end of a file is OOB */
+    if (final)
+      i = data_sz;
+
+    if (oob_start < i)
+      add_oob(&table->oob, base + oob_start, i - oob_start);
+
+    table->size = base + i;
+    return i;
+}
+
+
+size_t table_scan(
+    frame_table_t       *table,
+    const unsigned char *data,
+    size_t               data_sz,
+    uint64_t             base,
+    int                  final)
+{
+    size_t n;
+
+    /* Until there are frames to tell by, scan as MPEG audio */
+    if (table->format == FORMAT_UNKNOWN)
+      table->format = format_detect(data, data_sz);
+
+    switch (table->format)
+    {
+        case FORMAT_ADTS:
+            return scan_format(FORMAT_ADTS, table, data, data_sz, base, final);
+        default:
+            n = scan_format(FORMAT_MPEG, table, data, data_sz, base, final);
+            if (table->n_frames)
+              table->format = FORMAT_MPEG;
+            return n;
+    }
+}
+
+
+size_t table_frame_at(
+    const frame_table_t *table,
+    double               secs,
+    double              *start)
+{
+    int           rate;
+    size_t        lo, hi, mid, i;
+    unsigned char h[4];
+
+    *start = 0.0;
+    if (!table->anchors.count)
+      return table->n_frames;
+
+    /* Last anchor at or before 'secs' */
+    lo = 0;
+    hi = table->anchors.count;
+    while (hi - lo > 1)
+    {
+        mid = (lo + hi) / 2;
+        if (table->anchors.usecs[mid] <= (uint64_t)(secs * 1000000.0))
+          lo = mid;
+        else
+          hi = mid;
+    }
+
+    /* Then frame by frame, a second's worth at most */
+    *start = table->anchors.usecs[lo] / 1000000.0;
+    for (i=table->anchors.frames[lo]; i<table->n_frames; i++)
+    {
+        if (*start >= secs - 0.0000005)
+          break;
+        TABLE_HDR_BYTES(table->headers[i], h);
+        if ((rate = format_samplerate(table->format, h)))
+          *start += (double)format_samples(table->format, h) / rate;
+    }
+
+    return i;
+}
+
+
+frame_table_t *table_scan_file(const char *fname)
+{
+    size_t               size;
+    const unsigned char *data;
+    frame_table_t       *table;
+
+    if (!util_map_file(fname, &data, &size))
+      return NULL;
+
+    table = table_new();
+    table_scan(table, data, size, 0, 1);
+    util_unmap_file(data, size);
+    if (!table_identify(fname, &table->source))
+      memset(&table->source, 0, sizeof(table_source_t));
+
+    return table;
+}
+
+
+int table_identify(const char *fname, table_source_t *src)
+{
+    char        *path;
+    const char  *c;
+    uint64_t     hash;
+    struct stat  st;
+
+    if ((stat(fname, &st) == -1) || !(path = realpath(fname, NULL)))
+      return 0;
+
+    hash = 14695981039346656037ULL; /* FNV-1a */
+    for (c=path; *c; c++)
+      hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    free(path);
+
+    src->dev = st.st_dev;
+    src->ino = st.st_ino;
+    src->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+                    st.st_mtim.tv_nsec;
+    src->size = st.st_size;
+    src->path_hash = hash;
+    return 1;
+}
+
+
+int table_is_from(const frame_table_t *table, const table_source_t *src)
+{
+    return (table->source.dev == src->dev) &&
+           (table->source.ino == src->ino) &&
+           (table->source.mtime_ns == src->mtime_ns) &&
+           (table->source.size == src->size) &&
+           (table->source.path_hash == src->path_hash) &&
+           (table->size == src->size);
+}
+
+
+int table_save(const frame_table_t *table, FILE *fp)
+{
+    table_file_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(table_file_hdr_t));
+    memcpy(hdr.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC));
+    hdr.version = TABLE_VERSION;
+    hdr.bom = TABLE_BOM;
+    hdr.n_frames = table->n_frames;
+    hdr.n_tags = table->tags.count;
+    hdr.n_oob = table->oob.count;
+    hdr.n_anchors = table->anchors.count;
+    hdr.size = table->size;
+    hdr.secs = table->secs;
+    hdr.format = table->format;
+    hdr.source = table->source;
+
+    fwrite(&hdr, sizeof(table_file_hdr_t), 1, fp);
+    fwrite(table->offsets, sizeof(uint64_t), table->n_frames, fp);
+    fwrite(table->headers, sizeof(uint32_t), table->n_frames, fp);
+    fwrite(table->lengths, sizeof(uint16_t), table->n_frames, fp);
+    fwrite(table->tags.offsets, sizeof(uint64_t), table->tags.count, fp);
+    fwrite(table->tags.lengths, sizeof(uint32_t), table->tags.count, fp);
+    fwrite(table->oob.offsets, sizeof(uint64_t), table->oob.count, fp);
+    fwrite(table->oob.lengths, sizeof(uint32_t), table->oob.count, fp);
+    fwrite(table->anchors.usecs, sizeof(uint64_t), table->anchors.count, fp);
+    fwrite(table->anchors.frames, sizeof(uint64_t), table->anchors.count,
+           fp);
+
+    return !ferror(fp);
+}
+
+
+static int load_spans(span_table_t *spans, size_t count, FILE *fp)
+{
+    spans->count = spans->alloc = count;
+    spans->offsets = malloc(count * sizeof(uint64_t) + 1);
+    spans->lengths = malloc(count * sizeof(uint32_t) + 1);
+
+    return (fread(spans->offsets, sizeof(uint64_t), count, fp) == count) &&
+           (fread(spans->lengths, sizeof(uint32_t), count, fp) == count);
+}
+
+
+static int load_anchors(anchor_table_t *anchors, size_t count, FILE *fp)
+{
+    anchors->count = anchors->alloc = count;
+    anchors->usecs = malloc(count * sizeof(uint64_t) + 1);
+    anchors->frames = malloc(count * sizeof(uint64_t) + 1);
+
+    return (fread(anchors->usecs, sizeof(uint64_t), count, fp) == count) &&
+           (fread(anchors->frames, sizeof(uint64_t), count, fp) == count);
+}
+
+
+frame_table_t *table_load(FILE *fp)
+{
+    size_t            i, n;
+    unsigned char     h[4];
+    table_file_hdr_t  hdr;
+    frame_table_t    *table;
+
+    if (!fread(&hdr, sizeof(table_file_hdr_t), 1, fp) ||
+        memcmp(hdr.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC)) ||
+        (hdr.version != TABLE_VERSION) || (hdr.bom != TABLE_BOM))
+    {
+        ERR("Not a frame index, or from an incompatible version\n");
+        return NULL;
+    }
+
+    table = table_new();
+    n = table->n_frames = table->alloc = hdr.n_frames;
+    table->size = hdr.size;
+    table->secs = hdr.secs;
+    table->format = hdr.format;
+    table->source = hdr.source;
+    table->offsets = malloc(n * sizeof(uint64_t) + 1);
+    table->headers = malloc(n * sizeof(uint32_t) + 1);
+    table->lengths = malloc(n * sizeof(uint16_t) + 1);
+
+    if ((fread(table->offsets, sizeof(uint64_t), n, fp) != n) ||
+        (fread(table->headers, sizeof(uint32_t), n, fp) != n) ||
+        (fread(table->lengths, sizeof(uint16_t), n, fp) != n) ||
+        !load_spans(&table->tags, hdr.n_tags, fp) ||
+        !load_spans(&table->oob, hdr.n_oob, fp) ||
+        !load_anchors(&table->anchors, hdr.n_anchors, fp))
+    {
+        ERR("Truncated frame index\n");
+        table_free(table);
+        return NULL;
+    }
+
+    /* Not saved, the headers have all it takes */
+    for (i=0; i<n; i++)
+    {
+        TABLE_HDR_BYTES(table->headers[i], h);
+        count_frame(&table->stats, table->format, i, table->offsets[i], h,
+                    table->lengths[i]);
+    }
+
+    return table;
+}
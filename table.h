@@ -0,0 +1,144 @@
+/******************************************************************************
+ * table.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * table.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef TABLE_H_INCLUDE
+#define TABLE_H_INCLUDE
+
+#include <stdio.h>
+#include <stdint.h>
+#include "main.h"
+#include "format.h"
+
+
+/* Spans of bytes that are not frames (ID3 tags and OOB regions) */
+typedef struct _span_table_t
+{
+    uint64_t *offsets;
+    uint32_t *lengths;
+    size_t    count;
+    size_t    alloc;
+} span_table_t;
+
+
+/* Time to frame anchors: the first frame starting at or after each
+ * TABLE_ANCHOR_SECS of audio, so a time can be found without walking every
+ * frame before it
+ */
+#define TABLE_ANCHOR_SECS 1
+
+typedef struct _anchor_table_t
+{
+    uint64_t *usecs;  /* When the frame starts */
+    uint64_t *frames; /* Index into the frame table */
+    size_t    count;
+    size_t    alloc;
+} anchor_table_t;
+
+
+/* The file a table was made from, as it was then, so that a saved table is
+ * not used for another file of the same name or for this one once changed
+ */
+typedef struct _table_source_t
+{
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t mtime_ns;
+    uint64_t size;
+    uint64_t path_hash; /* FNV-1a of the absolute path */
+} table_source_t;
+
+
+/* Index of every frame in a file or stream.  Rather than an array of
+ * mp3_frame_t, the table keeps parallel arrays so that a frame costs 14 bytes:
+ * its offset, the first 4 bytes of its header (everything else can be decoded
+ * from it) and its length (header and CRC included).
+ */
+typedef struct _frame_table_t
+{
+    uint64_t       *offsets;
+    uint32_t       *headers;
+    uint16_t       *lengths;
+    format_t        format; /* Of the frames, detected by the first scan */
+    size_t          n_frames;
+    size_t          alloc;
+    span_table_t    tags;
+    span_table_t    oob;
+    anchor_table_t  anchors;
+    double          secs;  /* Audio in the frames so far */
+    audio_stats_t   stats; /* Of the frames so far */
+    uint64_t        size;  /* Bytes covered by the table */
+    table_source_t  source; /* Zeroes unless made from a file */
+} frame_table_t;
+
+
+/* Raw header (as stored in the table) back to the 4 bytes in the file */
+#define TABLE_HDR_BYTES(_raw, _h)               \
+    {(_h)[0] = ((_raw) >> 24) & 0xFF;           \
+     (_h)[1] = ((_raw) >> 16) & 0xFF;           \
+     (_h)[2] = ((_raw) >> 8) & 0xFF;            \
+     (_h)[3] = (_raw) & 0xFF;}
+
+
+extern void span_add(span_table_t *spans, uint64_t offset, uint32_t length);
+extern void span_free(span_table_t *spans);
+
+extern frame_table_t *table_new(void);
+extern void table_free(frame_table_t *table);
+
+/* Scans 'data_sz' bytes of 'data', which start at 'base' in the file/stream,
+ * adding frames, tags and OOB regions to the table.  Unless 'final' is set, a
+ * frame or tag running past the end of the data is left for the next call.
+ * The format is detected from the data, unless the table already has one.
+ * Returns the number of bytes consumed.
+ */
+extern size_t table_scan(
+    frame_table_t       *table,
+    const unsigned char *data,
+    size_t               data_sz,
+    uint64_t             base,
+    int                  final);
+
+/* Index of the first frame starting at or after 'secs' into the audio (or
+ * n_frames if there is none), found from the nearest anchor.  '*start' is set
+ * to when that frame starts.
+ */
+extern size_t table_frame_at(
+    const frame_table_t *table,
+    double               secs,
+    double              *start);
+
+/* Maps and scans a whole file (noting it as the source), returns NULL on
+ * error
+ */
+extern frame_table_t *table_scan_file(const char *fname);
+
+/* Fills 'src' from the file as it is now, returns 0 on error */
+extern int table_identify(const char *fname, table_source_t *src);
+
+/* Whether the table was made from 'src' */
+extern int table_is_from(const frame_table_t *table, const table_source_t *src);
+
+/* Write/read the table to/from disk (host byte order) */
+extern int table_save(const frame_table_t *table, FILE *fp);
+extern frame_table_t *table_load(FILE *fp);
+
+
+#endif /* TABLE_H_INCLUDE */
@@ -0,0 +1,246 @@
+/******************************************************************************
+ * triage.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * triage.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "triage.h"
+#include "blocks.h"
+
+
+typedef struct _signature_t
+{
+    const char *name;
+    const char *bytes;
+    int         len;
+    int         payload; /* Otherwise it marks junk */
+} signature_t;
+
+
+static const signature_t signatures[] = {
+    {"uuencode", "begin 6",               7, 1},
+    {"zip",      "PK\x03\x04",            4, 1},
+    {"gzip",     "\x1f\x8b\x08",           3, 1},
+    {"bzip2",    "1AY&SY",                6, 1},
+    {"7z",       "7z\xbc\xaf\x27\x1c",      6, 1},
+    {"pgp",      "-----BEGIN PGP",       14, 1},
+    {"pdf",      "%PDF-",                 5, 1},
+    {"png",      "\x89PNG\r\n\x1a\n",      8, 1},
+    {"framed",   BLOCK_MAGIC, BLOCK_MAGIC_SZ, 1},
+    {"http",     "HTTP/1.",               7, 0},
+    {"icy",      "ICY 200",               7, 0},
+    {"lame",     "LAME",                  4, 0},
+    {"xing",     "Xing",                  4, 0}
+};
+
+#define N_SIGNATURES  (sizeof(signatures) / sizeof(signatures[0]))
+#define SIG_BASE64    N_SIGNATURES /* Not a fixed pattern, found by runs */
+
+/* Signatures starting with each byte, and base64 classes: 1 for the alphabet,
+ * 2 for line breaks (which do not end a run)
+ */
+static uint32_t first_byte[256];
+static unsigned char base64_class[256];
+
+
+static void tables_init(void)
+{
+    int i;
+    const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                      "0123456789+/=";
+
+    for (i=0; i<(int)N_SIGNATURES; i++)
+      first_byte[(unsigned char)signatures[i].bytes[0]] |= 1u << i;
+
+    for (i=0; b64[i]; i++)
+      base64_class[(unsigned char)b64[i]] = 1;
+    base64_class['\r'] = base64_class['\n'] = 2;
+}
+
+
+void triage_init(triage_t *t)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, tables_init);
+    memset(t, 0, sizeof(triage_t));
+}
+
+
+/* Signatures starting at any of the first 'n' bytes of 'data' */
+static uint32_t match(const unsigned char *data, size_t len, size_t n)
+{
+    int      s;
+    size_t   i;
+    uint32_t sigs, cands;
+
+    sigs = 0;
+    for (i=0; i<n; i++)
+    {
+        if (!(cands = first_byte[data[i]]))
+          continue;
+
+        while (cands)
+        {
+            s = __builtin_ctz(cands);
+            cands &= cands - 1;
+            if ((i + signatures[s].len <= len) &&
+                !memcmp(data + i, signatures[s].bytes, signatures[s].len))
+              sigs |= 1u << s;
+        }
+    }
+
+    return sigs;
+}
+
+
+void triage_add(triage_t *t, const unsigned char *data, size_t len)
+{
+    size_t        i, n;
+    unsigned char joint[2 * (TRIAGE_MAX_SIG - 1)];
+
+    /* Four histograms so that repeated bytes do not wait on each other */
+    for (i=0; i+4 <= len; i += 4)
+    {
+        ++t->counts[0][data[i]];
+        ++t->counts[1][data[i+1]];
+        ++t->counts[2][data[i+2]];
+        ++t->counts[3][data[i+3]];
+    }
+    for ( ; i<len; i++)
+      ++t->counts[0][data[i]];
+    t->len += len;
+
+    /* Signatures starting in the previous piece, then in this one */
+    if (t->tail_len)
+    {
+        n = (len < TRIAGE_MAX_SIG - 1) ? len : TRIAGE_MAX_SIG - 1;
+        memcpy(joint, t->tail, t->tail_len);
+        memcpy(joint + t->tail_len, data, n);
+        t->sigs |= match(joint, t->tail_len + n, t->tail_len);
+    }
+    t->sigs |= match(data, len, len);
+
+    n = (len < TRIAGE_MAX_SIG - 1) ? len : TRIAGE_MAX_SIG - 1;
+    if (t->tail_len + n > TRIAGE_MAX_SIG - 1)
+    {
+        i = t->tail_len + n - (TRIAGE_MAX_SIG - 1);
+        memmove(t->tail, t->tail + i, t->tail_len - i);
+        t->tail_len -= i;
+    }
+    memcpy(t->tail + t->tail_len, data + len - n, n);
+    t->tail_len += n;
+
+    /* Runs of base64 */
+    for (i=0; i<len; i++)
+    {
+        if (base64_class[data[i]] == 1)
+          ++t->b64_run;
+        else if (!base64_class[data[i]])
+        {
+            if (t->b64_run > t->b64_longest)
+              t->b64_longest = t->b64_run;
+            t->b64_run = 0;
+        }
+    }
+}
+
+
+void triage_finish(triage_t *t)
+{
+    int      i, k;
+    uint64_t c, text;
+    double   p, score;
+
+    if (t->b64_run > t->b64_longest)
+      t->b64_longest = t->b64_run;
+    if (t->b64_longest >= TRIAGE_BASE64_RUN)
+      t->sigs |= 1u << SIG_BASE64;
+
+    t->entropy = 0.0;
+    text = 0;
+    for (i=0; i<256; i++)
+    {
+        c = 0;
+        for (k=0; k<4; k++)
+          c += t->counts[k][i];
+        if (c)
+        {
+            p = (double)c / t->len;
+            t->entropy -= p * log2(p);
+        }
+        if ((i >= 32 && i < 127) || i == '\t' || i == '\n' || i == '\r')
+          text += c;
+    }
+    t->printable = (t->len) ? (double)text / t->len : 0.0;
+
+    /* Random looking data says compressed or encrypted, a payload signature
+     * says so outright, junk markers only count when nothing else does
+     */
+    score = t->entropy * 60.0 / 8.0;
+    for (i=0; i<=(int)N_SIGNATURES; i++)
+      if ((t->sigs & (1u << i)) &&
+          (i == SIG_BASE64 || signatures[i].payload))
+      {
+          score += 30.0;
+          break;
+      }
+    if (i > (int)N_SIGNATURES && t->sigs)
+      score = (score > 10.0) ? 10.0 : score;
+    else if (t->printable > 0.95 && t->entropy > 4.0)
+      score += 10.0;
+
+    /* A few bytes say little either way */
+    if (t->len < 16)
+      score = score * t->len / 16;
+
+    t->score = (score > 100.0) ? 100 : (int)score;
+}
+
+
+void triage_region(triage_t *t, const unsigned char *data, size_t len)
+{
+    triage_init(t);
+    triage_add(t, data, len);
+    triage_finish(t);
+}
+
+
+void triage_format(const triage_t *t, char *buf, size_t buf_sz)
+{
+    int    i, n;
+    size_t used;
+
+    used = snprintf(buf, buf_sz, "entropy=%.3f printable=%.3f sigs=",
+                    t->entropy, t->printable);
+
+    n = 0;
+    for (i=0; i<=(int)N_SIGNATURES && used<buf_sz; i++)
+      if (t->sigs & (1u << i))
+        used += snprintf(buf + used, buf_sz - used, "%s%s", (n++) ? "," : "",
+                         (i == SIG_BASE64) ? "base64" : signatures[i].name);
+
+    if (used < buf_sz)
+      snprintf(buf + used, buf_sz - used, "%s score=%d", (n) ? "" : "-",
+               t->score);
+}
@@ -0,0 +1,65 @@
+/******************************************************************************
+ * triage.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * triage.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef TRIAGE_H_INCLUDE
+#define TRIAGE_H_INCLUDE
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* Longest signature, and the shortest run of base64 that counts as one */
+#define TRIAGE_MAX_SIG     16
+#define TRIAGE_BASE64_RUN  64
+
+
+/* Scores a region of OOB data, possibly a piece at a time, by how likely it is
+ * to be a payload rather than encoder junk or protocol chatter
+ */
+typedef struct _triage_t
+{
+    uint64_t      counts[4][256]; /* Byte histogram, split four ways */
+    uint64_t      len;
+    uint32_t      sigs;           /* Signatures seen, one bit each */
+    int           b64_run;        /* Current/longest run of base64 */
+    int           b64_longest;
+    unsigned char tail[TRIAGE_MAX_SIG - 1]; /* For signatures across pieces */
+    int           tail_len;
+
+    /* Filled in by triage_finish() */
+    double        entropy;        /* Bits per byte */
+    double        printable;      /* Fraction of text bytes */
+    int           score;          /* 0 (junk) to 100 (payload) */
+} triage_t;
+
+
+extern void triage_init(triage_t *t);
+extern void triage_add(triage_t *t, const unsigned char *data, size_t len);
+extern void triage_finish(triage_t *t);
+
+/* triage_init(), triage_add() and triage_finish() on a whole region */
+extern void triage_region(triage_t *t, const unsigned char *data, size_t len);
+
+/* "entropy=... printable=... sigs=... score=..." for reports */
+extern void triage_format(const triage_t *t, char *buf, size_t buf_sz);
+
+
+#endif /* TRIAGE_H_INCLUDE */
@@ -23,10 +23,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "utils.h"
+#include "format.h"
 
 
 void util_url_to_host_port_file(const char *url, hostdata_t *hostdata)
@@ -69,19 +74,48 @@ void util_url_to_host_port_file(const char *url, hostdata_t *hostdata)
 }
 
 
-FILE *util_create_file(
+/* Next number to try for each output name, so that a run writing many files
+ * of the same name does not test every name it has already taken
+ */
+#define SUFFIX_BUCKETS 256
+
+typedef struct _suffix_t
+{
+    char             *name;
+    int               next;
+    struct _suffix_t *chain;
+} suffix_t;
+
+
+/* The buffer given to an output file, freed by util_close_file() */
+typedef struct _sink_buf_t
+{
+    FILE               *fp;
+    char               *buf;
+    struct _sink_buf_t *next;
+} sink_buf_t;
+
+
+static pthread_mutex_t  sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static suffix_t        *suffixes[SUFFIX_BUCKETS];
+static sink_buf_t      *sink_bufs;
+
+
+/* "[dir/]<name>-<desc>[-<number>].<extension>", where <name> is 'fname'
+ * without its directory or extension (the caller frees it)
+ */
+static char *output_path(
     const char *fname,
     const char *desc,
     const char *extension,
-    int         is_stream)
+    int         is_stream,
+    int         number)
 {
-    int          fileno;
-    char        *outname;
-    const char  *c, *r;
-    FILE        *out;
+    char        *path;
+    size_t       len;
+    const char  *c, *r, *dir;
     struct stat  st;
 
-    /* Create output file (in the working directory) */
     if ((c = strrchr(fname, '/')) && strlen(c+1))
       ++c;
     else
@@ -90,50 +124,332 @@ FILE *util_create_file(
     if ((stat(c, &st) == 0) && S_ISDIR(st.st_mode))
       c = NAME;
 
-    /* Avoid overwriting an existig file by appening a number to the name */
-    fileno = 0;
+    if (is_stream || !(r = strrchr(c, '.')))
+      r = c + strlen(c);
+
+    dir = (main_output_dir) ? main_output_dir : "";
+    len = strlen(dir) + (r - c) + strlen(desc) + strlen(extension) + 32;
+    path = malloc(len);
+
+    if (number > 0)
+      snprintf(path, len, "%s%s%.*s-%s-%d.%s", dir, (*dir) ? "/" : "",
+               (int)(r - c), c, desc, number, extension);
+    else
+      snprintf(path, len, "%s%s%.*s-%s.%s", dir, (*dir) ? "/" : "",
+               (int)(r - c), c, desc, extension);
+
+    return path;
+}
+
+
+/* Hands out the next number to try for 'name' (call with sink_lock held) */
+static int next_suffix(const char *name)
+{
+    uint32_t    h;
+    suffix_t   *s;
+    const char *c;
+
+    h = 2166136261u;
+    for (c=name; *c; c++)
+      h = (h ^ (unsigned char)*c) * 16777619u;
+
+    for (s=suffixes[h % SUFFIX_BUCKETS]; s; s=s->chain)
+      if (strcmp(s->name, name) == 0)
+        return s->next++;
+
+    s = malloc(sizeof(suffix_t));
+    s->name = strdup(name);
+    s->next = 1;
+    s->chain = suffixes[h % SUFFIX_BUCKETS];
+    suffixes[h % SUFFIX_BUCKETS] = s;
+
+    return 0;
+}
+
+
+FILE *util_create_file(
+    const char *fname,
+    const char *desc,
+    const char *extension,
+    int         is_stream)
+{
+    return util_create_file_named(fname, desc, extension, is_stream, NULL);
+}
+
+
+FILE *util_create_file_named(
+    const char  *fname,
+    const char  *desc,
+    const char  *extension,
+    int          is_stream,
+    char       **name)
+{
+    int         fd, number;
+    char       *base, *outname;
+    FILE       *out;
+    sink_buf_t *sink;
+
+    /* Never overwrite a file: O_EXCL fails if the name is taken (by this or
+     * any other process), in which case the next number is tried.  Numbers
+     * are handed out under the lock, so threads do not race for the same one.
+     */
+    base = output_path(fname, desc, extension, is_stream, 0);
     outname = NULL;
-    do 
+    do
     {
         free(outname);
-        outname = calloc(1, strlen(c) + 64);
+        pthread_mutex_lock(&sink_lock);
+        number = next_suffix(base);
+        pthread_mutex_unlock(&sink_lock);
 
-        if (is_stream || !(r = strrchr(c, '.')))
-          r = c + strlen(c);
-    
-        strncpy(outname, c, r - c);
-
-        if (fileno > 0)
-          sprintf(outname, "%s-%s-%d.%s", outname, desc, fileno, extension);
-        else
-          sprintf(outname, "%s-%s.%s", outname, desc, extension);
-        ++fileno;
+        outname = output_path(fname, desc, extension, is_stream, number);
+        fd = open(outname, O_WRONLY | O_CREAT | O_EXCL, 0644);
     }
-    while ((out = fopen(outname, "r")) && !fclose(out));
+    while ((fd == -1) && (errno == EEXIST));
+    free(base);
 
-    if (!(out = fopen(outname, "w")))
+    if ((fd == -1) || !(out = fdopen(fd, "w")))
     {
         ERR("Could not create output file '%s'\n", outname);
+        if (fd != -1)
+          close(fd);
+        free(outname);
         return NULL;
     }
 
-    free(outname);
+    /* Outputs are written in small pieces, give them a large buffer */
+    sink = malloc(sizeof(sink_buf_t));
+    sink->fp = out;
+    sink->buf = malloc(OUTPUT_BUF_SZ);
+    setvbuf(out, sink->buf, _IOFBF, OUTPUT_BUF_SZ);
+    pthread_mutex_lock(&sink_lock);
+    sink->next = sink_bufs;
+    sink_bufs = sink;
+    pthread_mutex_unlock(&sink_lock);
+
+    if (name)
+      *name = outname;
+    else
+      free(outname);
     return out;
 }
 
 
+int util_close_file(FILE *fp)
+{
+    int          ret;
+    sink_buf_t  *sink, **prev;
+
+    pthread_mutex_lock(&sink_lock);
+    for (prev=&sink_bufs; (sink = *prev) && (sink->fp != fp);
+         prev=&sink->next)
+      ;
+    if (sink)
+      *prev = sink->next;
+    pthread_mutex_unlock(&sink_lock);
+
+    /* The buffer is in use until the file is closed */
+    ret = fclose(fp);
+    if (sink)
+    {
+        free(sink->buf);
+        free(sink);
+    }
+
+    return ret;
+}
+
+
+char *util_output_name(
+    const char *fname,
+    const char *desc,
+    const char *extension)
+{
+    return output_path(fname, desc, extension, 0, 0);
+}
+
+
+void util_display_oob(
+    const unsigned char *oob,
+    int                  oob_size,
+    int                  ignore_oob)
+{
+    int i;
+
+    if (oob_size && !ignore_oob && IS_VERBOSE && !IS_QUIET)
+    {
+        VERBOSE("--OOB Data Found: %d bytes--\n", oob_size);
+        for (i=0; i<oob_size; i++)
+          VERBOSE("0x%.2x(%c) ", oob[i], 
+                 (oob[i] > 31 && oob[i]<127) ? oob[i] : ' ');
+        VERBOSE("\n----------------------------\n\n");
+    }
+    else if (oob_size && !IS_VERBOSE && !IS_QUIET)
+      printf(TAG " %d bytes out-of-frame\n", oob_size);
+}
+
+
+uint64_t util_copy_bytes(FILE *from, FILE *to, uint64_t n)
+{
+    size_t        want, got;
+    uint64_t      copied;
+    unsigned char buf[COPY_BUF_SZ];
+
+    copied = 0;
+    while (copied < n)
+    {
+        want = (n - copied < sizeof(buf)) ? n - copied : sizeof(buf);
+        if ((got = fread(buf, 1, want, from)) == 0)
+          break;
+        if (fwrite(buf, 1, got, to) != got)
+          break;
+        copied += got;
+    }
+
+    return copied;
+}
+
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void)
+{
+    int      i, j;
+    uint32_t c;
+
+    for (i=0; i<256; i++)
+    {
+        c = i;
+        for (j=0; j<8; j++)
+          c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        crc32_table[i] = c;
+    }
+}
+
+
+uint32_t util_crc32(uint32_t crc, const unsigned char *data, size_t len)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, crc32_init);
+
+    crc = ~crc;
+    while (len--)
+      crc = crc32_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+
+/* CRC-16 (x^16 + x^15 + x^2 + 1, MSB first) a byte at a time from crc16_table
+ * [0], and four at a time (slicing-by-4), where crc16_table[k] is the effect of
+ * a byte followed by 'k' zero bytes.
+ */
+static uint16_t crc16_table[4][256];
+
+static void crc16_init(void)
+{
+    int      i, j, k;
+    uint16_t c;
+
+    for (i=0; i<256; i++)
+    {
+        c = i << 8;
+        for (j=0; j<8; j++)
+          c = (c & 0x8000) ? (c << 1) ^ 0x8005 : (c << 1);
+        crc16_table[0][i] = c;
+    }
+
+    for (k=1; k<4; k++)
+      for (i=0; i<256; i++)
+      {
+          c = crc16_table[k-1][i];
+          crc16_table[k][i] = (c << 8) ^ crc16_table[0][c >> 8];
+      }
+}
+
+
+uint16_t util_crc16(uint16_t crc, const unsigned char *data, size_t len)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, crc16_init);
+
+    for ( ; len >= 4; data += 4, len -= 4)
+    {
+        crc ^= (data[0] << 8) | data[1];
+        crc = crc16_table[3][crc >> 8] ^ crc16_table[2][crc & 0xFF] ^
+              crc16_table[1][data[2]] ^ crc16_table[0][data[3]];
+    }
+
+    while (len--)
+      crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *data++];
+
+    return crc;
+}
+
+
+int util_map_file(
+    const char           *fname,
+    const unsigned char **data,
+    size_t               *size)
+{
+    int         fd;
+    void       *addr;
+    struct stat st;
+
+    if ((fd = open(fname, O_RDONLY)) == -1)
+      return 0;
+
+    if ((fstat(fd, &st) == -1) || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return 0;
+    }
+
+    *size = st.st_size;
+    *data = NULL;
+    if (*size == 0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    addr = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+      return 0;
+
+    /* We scan front to back */
+    madvise(addr, *size, MADV_SEQUENTIAL);
+    *data = addr;
+
+    return 1;
+}
+
+
+void util_unmap_file(const unsigned char *data, size_t size)
+{
+    if (data && size)
+      munmap((void *)data, size);
+}
+
+
 /* Pass either data block or file handle
  * If both are passed, the file handle takes presecendence.
+ * Inlined into util_next_mp3_frame_or_id3v2() once per format.
  */
-STREAM_OBJECT util_next_mp3_frame_or_id3v2(
+FORMAT_INLINE STREAM_OBJECT next_object(
+    format_t    format,
     FILE       *fp,
     const char *data,
     int         data_sz,
     int         ignore_oob,
     int        *frame_or_tag_index,
-    FILE       *oob_to_file)
+    FILE       *oob_to_file,
+    int        *oob_found)
 {
-    int           i, n_blks, oob_size;
+    int           i, n_blks, n_read, oob_size, is_frame;
     unsigned char v[3] = {0}, *oob;
     long          start, end;
     STREAM_OBJECT ret;
@@ -162,8 +478,18 @@ STREAM_OBJECT util_next_mp3_frame_or_id3v2(
     oob_size = ret = 0;
     while (((start + 3) <= end))
     {
-        if (fp && (fread(v, 1, 3, fp) == 0))
-          break;
+        if (fp && ((n_read = fread(v, 1, 3, fp)) < 3))
+        {
+            /* Too short to be a frame or tag, the tail of the file is OOB */
+            for (i=0; i<n_read; i++)
+            {
+                if (oob_size >= (n_blks * OOB_BLK_SIZE))
+                  oob = realloc(oob, (++n_blks) * OOB_BLK_SIZE);
+                oob[oob_size++] = v[i];
+            }
+            start = ftell(fp);
+            break;
+        }
         else if (data)
           memcpy(v, data+start, 3);
 
@@ -171,9 +497,18 @@ STREAM_OBJECT util_next_mp3_frame_or_id3v2(
         if (fp)
           start = ftell(fp) - 3;
 
-        /* Look for MP3 sync frame */
-        if ((v[0] == 0xFF) && ((v[1] & 0xE0) == 0xE0) && 
-            mp3_is_valid_frame(fp, start))
+        /* Look for a sync frame (with all of its header, in a stream) */
+        is_frame = 0;
+        if (format_is_sync(format, v))
+        {
+            if (!fp && (start + format_hdr_size(format) > end))
+              break;
+            is_frame = (fp) ? mp3_is_valid_frame(fp, start) :
+                       format_frame_length(format, (const unsigned char *)
+                                           data + start) > 0;
+        }
+
+        if (is_frame)
         {
             ret = STREAM_OBJECT_MP3_FRAME;
             break;
@@ -210,16 +545,7 @@ STREAM_OBJECT util_next_mp3_frame_or_id3v2(
     }
 
     /* Display OOB data */
-    if (oob_size && !ignore_oob && IS_VERBOSE)
-    {
-        VERBOSE("--OOB Data Found: %d bytes--\n", oob_size);
-        for (i=0; i<oob_size; i++)
-          VERBOSE("0x%.2x(%c) ", oob[i], 
-                 (oob[i] > 31 && oob[i]<127) ? oob[i] : ' ');
-        VERBOSE("\n----------------------------\n\n");
-    }
-    else if (oob_size && !IS_VERBOSE)
-      printf(TAG " %d bytes out-of-frame\n", oob_size);
+    util_display_oob(oob, oob_size, ignore_oob);
 
     /* Write OOB data to file */
     if (oob_size && oob_to_file)
@@ -228,6 +554,9 @@ STREAM_OBJECT util_next_mp3_frame_or_id3v2(
         fflush(oob_to_file);
     }
    
+    if (oob_found)
+      *oob_found = oob_size;
+
     if (fp)
       fseek(fp, start, SEEK_SET);
     else if (frame_or_tag_index)
@@ -238,6 +567,28 @@ STREAM_OBJECT util_next_mp3_frame_or_id3v2(
 }
 
 
+STREAM_OBJECT util_next_mp3_frame_or_id3v2(
+    format_t    format,
+    FILE       *fp,
+    const char *data,
+    int         data_sz,
+    int         ignore_oob,
+    int        *frame_or_tag_index,
+    FILE       *oob_to_file,
+    int        *oob_found)
+{
+    switch (format)
+    {
+        case FORMAT_ADTS:
+            return next_object(FORMAT_ADTS, fp, data, data_sz, ignore_oob,
+                               frame_or_tag_index, oob_to_file, oob_found);
+        default:
+            return next_object(FORMAT_MPEG, fp, data, data_sz, ignore_oob,
+                               frame_or_tag_index, oob_to_file, oob_found);
+    }
+}
+
+
 mp3_frame_t *mp3_get_frame(FILE *fp)
 {
     char         header[6];
@@ -305,6 +656,10 @@ int mp3_frame_length(const mp3_frame_t *frame)
 {
     int bit_rate, sample_rate, value_idx;
 
+    /* Reserved values index outside of the tables */
+    if ((frame->version == V_RESERVED) || (frame->layer == L_RESERVED))
+      return 0;
+
     /* Bit rate (from header to actual rate value) */
     if ((frame->version == V2) &&
         (((frame->layer == L2)) || (frame->layer == L3)))
@@ -345,7 +700,7 @@ void mp3_set_header(mp3_frame_t *frame, const char header[4])
     frame->bitrate = MP3_HDR_BIT_RATE(header);
     frame->samplerate = MP3_HDR_SAMPLE_RATE(header);
     frame->padding = MP3_HDR_PADDING(header);
-    frame->crc = MP3_HDR_CRC(header);
+    frame->crc = !MP3_HDR_CRC(header); /* A clear bit means it is protected */
     
     if (frame->crc)
       frame->header_size = 6;
@@ -396,6 +751,120 @@ int mp3_is_valid_frame(FILE *fp, long start)
 }
 
 
+int mp3_header_length(const unsigned char h[4])
+{
+    mp3_frame_t frame;
+
+    mp3_set_header(&frame, (const char *)h);
+    if (!mp3_is_valid_header(&frame) || (frame.audio_size < 1))
+      return 0;
+
+    return frame.audio_size + frame.header_size;
+}
+
+
+int mp3_header_bitrate(const unsigned char h[4])
+{
+    int version, layer, idx;
+
+    version = MP3_HDR_VERSION(h);
+    layer = MP3_HDR_LAYER(h);
+    if (version == V_RESERVED || layer == L_RESERVED)
+      return 0;
+
+    /* MPEG 2.5 shares the MPEG 2 rates */
+    if (version == V1)
+      idx = 3 - layer;
+    else
+      idx = (layer == L1) ? 3 : 4;
+
+    return (bitrate_table[MP3_HDR_BIT_RATE(h)][idx] > 0) ?
+           bitrate_table[MP3_HDR_BIT_RATE(h)][idx] * 1000 : 0;
+}
+
+
+int mp3_header_samplerate(const unsigned char h[4])
+{
+    int version, idx;
+
+    version = MP3_HDR_VERSION(h);
+    if ((idx = MP3_HDR_SAMPLE_RATE(h)) == 0x3 || version == V_RESERVED)
+      return 0;
+
+    if (version == V1)
+      return sample_rate_table[idx][0];
+    else if (version == V2)
+      return sample_rate_table[idx][1];
+    else /* (version == V2_5) */
+      return sample_rate_table[idx][2];
+}
+
+
+int mp3_header_samples(const unsigned char h[4])
+{
+    switch (MP3_HDR_LAYER(h))
+    {
+        case L1: return 384;
+        case L2: return 1152;
+        case L3: return (MP3_HDR_VERSION(h) == V1) ? 1152 : 576;
+        default: return 0;
+    }
+}
+
+
+int mp3_side_info_size(const unsigned char h[4])
+{
+    if (MP3_HDR_VERSION(h) == V1)
+      return (MP3_HDR_MODE(h) == MODE_MONO) ? 17 : 32;
+    return (MP3_HDR_MODE(h) == MODE_MONO) ? 9 : 17;
+}
+
+
+/* Bytes after the CRC that it covers (the side info, or for Layer I the bit
+ * allocation), 0 for Layer II whose coverage needs its allocation tables
+ */
+static int crc_protected_bytes(const unsigned char h[4])
+{
+    int mode, bound;
+
+    mode = MP3_HDR_MODE(h);
+    switch (MP3_HDR_LAYER(h))
+    {
+        case L3:
+            return mp3_side_info_size(h);
+
+        case L1:
+            if (mode == MODE_MONO)
+              return 16;
+            bound = (mode == MODE_JOINT_STEREO) ?
+                    4 * (((h[3] & 0x30) >> 4) + 1) : 32;
+            return (4 * (bound * 2 + (32 - bound))) / 8;
+
+        default:
+            return 0;
+    }
+}
+
+
+int mp3_check_crc(
+    const unsigned char *frame,
+    size_t               len,
+    uint16_t            *stored,
+    uint16_t            *computed)
+{
+    int n;
+
+    if (MP3_HDR_CRC(frame) || !(n = crc_protected_bytes(frame)) ||
+        (len < 6 + (size_t)n))
+      return -1;
+
+    *stored = (frame[4] << 8) | frame[5];
+    *computed = util_crc16(util_crc16(0xFFFF, frame + 2, 2), frame + 6, n);
+
+    return *stored == *computed;
+}
+
+
 id3_tag_t *id3_get_tag(FILE *fp)
 {
     id3_tag_t *tag;
@@ -23,6 +23,7 @@
 #define UTILS_H_INCLUDE
 
 #include <stdio.h>
+#include <stdint.h>
 #include "main.h"
 
 
@@ -43,10 +44,12 @@ typedef struct _hostdata_t
 extern void util_url_to_host_port_file(const char *url, hostdata_t *hostdata);
 
 
-/* Returns a file pointer to a newly created file, in the current working
- * directory, with the description inserted in the name.  If this is a 
- * stream, assume 'fname' is a URL/host, so avoid lopping off an extension,
- * because that would probably be part of the address.
+/* Returns a file pointer to a newly created file, in the output directory
+ * ('-o', by default the current working directory), with the description
+ * inserted in the name.  If this is a stream, assume 'fname' is a URL/host,
+ * so avoid lopping off an extension, because that would probably be part of
+ * the address.  The file is created atomically, with a number added to the
+ * name if it is taken, and is closed with util_close_file().
  */
 extern FILE *util_create_file(
     const char *fname,
@@ -54,19 +57,79 @@ extern FILE *util_create_file(
     const char *extension,
     int         is_stream);
 
+/* Same as util_create_file(), also handing back the name it was given (which
+ * the caller frees)
+ */
+extern FILE *util_create_file_named(
+    const char  *fname,
+    const char  *desc,
+    const char  *extension,
+    int          is_stream,
+    char       **name);
+
+/* Closes a file from util_create_file(), freeing its buffer */
+extern int util_close_file(FILE *fp);
+
+/* The name util_create_file() would pick for a file, without the number
+ * added to keep from overwriting, for outputs that are found again by name
+ * (the caller frees it)
+ */
+extern char *util_output_name(
+    const char *fname,
+    const char *desc,
+    const char *extension);
+
 
-/* Searches the file stream or data stream for the start of the next mp3 frame
- * or id3v2 tag.  If a data stream is searched, and index into that stream is
- * returned where the frame or tag begins.
+/* Searches the file stream or data stream for the start of the next frame of
+ * 'format' or id3v2 tag.  If a data stream is searched, and index into that
+ * stream is returned where the frame or tag begins.  A data stream frame is
+ * only returned once its whole header is in the data.  A file stream is
+ * always taken to be MPEG audio.
  * If 'oob_to_file' is specified, the OOB data is written here.
+ * If 'oob_found' is specified, the number of OOB bytes skipped is stored there.
  */
 extern STREAM_OBJECT util_next_mp3_frame_or_id3v2(
+    format_t    format,
     FILE       *fp,
     const char *data,
     int         data_sz,
     int         ignore_oob,
     int        *frame_or_tag_index,
-    FILE       *oob_to_file);
+    FILE       *oob_to_file,
+    int        *oob_found);
+
+
+/* Displays (verbose hex dump, or a byte count) an OOB region */
+extern void util_display_oob(
+    const unsigned char *oob,
+    int                  oob_size,
+    int                  ignore_oob);
+
+
+/* Copies 'n' bytes from 'from' to 'to' through a fixed size buffer, returns
+ * the number of bytes copied.
+ */
+extern uint64_t util_copy_bytes(FILE *from, FILE *to, uint64_t n);
+
+
+/* CRC-32 (IEEE 802.3) of 'len' bytes, continuing from 'crc' (0 to start) */
+extern uint32_t util_crc32(uint32_t crc, const unsigned char *data, size_t len);
+
+
+/* CRC-16 as used by MPEG audio (polynomial 0x8005, not reflected), continuing
+ * from 'crc' (0xFFFF to start)
+ */
+extern uint16_t util_crc16(uint16_t crc, const unsigned char *data, size_t len);
+
+
+/* Maps the whole of 'fname' read-only into memory.  Returns 1 on success, an
+ * empty file is mapped as 'size' 0.
+ */
+extern int util_map_file(
+    const char           *fname,
+    const unsigned char **data,
+    size_t               *size);
+extern void util_unmap_file(const unsigned char *data, size_t size);
 
 
 /* MP3 Frames */
@@ -78,6 +141,31 @@ extern void mp3_set_header(mp3_frame_t *frame, const char header[4]);
 extern int mp3_is_valid_header(const mp3_frame_t *frame);
 extern int mp3_is_valid_frame(FILE *fp, long start);
 
+/* Length of the frame (header included) starting with the 4 header bytes 'h',
+ * or 0 if it is not a valid frame header.
+ */
+extern int mp3_header_length(const unsigned char h[4]);
+
+/* Bit rate (bits/s, 0 for free format), sample rate (Hz) and samples per frame
+ * of the frame with header 'h'
+ */
+extern int mp3_header_bitrate(const unsigned char h[4]);
+extern int mp3_header_samplerate(const unsigned char h[4]);
+extern int mp3_header_samples(const unsigned char h[4]);
+
+/* Size of the side info following a Layer III header (and its CRC) */
+extern int mp3_side_info_size(const unsigned char h[4]);
+
+/* Checks the CRC of the 'len' byte frame 'frame'.  Returns 1 if it matches, 0
+ * if not, or -1 if the frame is not protected or its CRC cannot be checked
+ * (Layer II).
+ */
+extern int mp3_check_crc(
+    const unsigned char *frame,
+    size_t               len,
+    uint16_t            *stored,
+    uint16_t            *computed);
+
 
 /* ID3 Tags */
 extern id3_tag_t *id3_get_tag(FILE *fp);
@@ -0,0 +1,180 @@
+/******************************************************************************
+ * walk.c
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * walk.c is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "main.h"
+#include "format.h"
+#include "utils.h"
+#include "walk.h"
+
+
+#define DENTS_BUF_SZ (64 * 1024)
+
+
+/* What getdents64 fills the buffer with */
+struct linux_dirent64
+{
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+
+/* State carried down the tree */
+typedef struct _walk_t
+{
+    walk_fn_t fn;
+    void     *arg;
+    long      n_found;
+    char      path[PATH_MAX];
+} walk_t;
+
+
+int walk_is_mp3(int fd)
+{
+    ssize_t       n;
+    unsigned char buf[WALK_SNIFF_SZ];
+
+    if ((n = pread(fd, buf, sizeof(buf), 0)) < 4)
+      return 0;
+
+    if (buf[0] == 'I' && buf[1] == 'D' && buf[2] == '3')
+      return 1;
+
+    /* Captures can start part way through something, so look for a frame
+     * followed by another rather than insisting on one at the start
+     */
+    return format_detect(buf, n) != FORMAT_UNKNOWN;
+}
+
+
+/* Walk the directory open as 'dir_fd', whose path is in walk->path and is
+ * 'path_len' long
+ */
+static void walk_dir(walk_t *walk, int dir_fd, size_t path_len)
+{
+    int                    fd, type;
+    long                   n, pos;
+    char                  *buf;
+    size_t                 name_len;
+    struct stat            st;
+    struct linux_dirent64 *d;
+
+    buf = malloc(DENTS_BUF_SZ);
+    while ((n = syscall(SYS_getdents64, dir_fd, buf, DENTS_BUF_SZ)) > 0)
+      for (pos=0; pos<n; pos+=d->d_reclen)
+      {
+          d = (struct linux_dirent64 *)(buf + pos);
+          if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+
+          name_len = strlen(d->d_name);
+          if (path_len + 1 + name_len >= sizeof(walk->path))
+          {
+              ERR("Path too long under '%s'\n", walk->path);
+              continue;
+          }
+
+          /* Only ask the file system when the directory did not say */
+          type = d->d_type;
+          if (type == DT_UNKNOWN || type == DT_LNK)
+          {
+              if (fstatat(dir_fd, d->d_name, &st,
+                          (type == DT_LNK) ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
+                continue;
+              if (S_ISREG(st.st_mode))
+                type = DT_REG;
+              else if (S_ISDIR(st.st_mode) && d->d_type == DT_UNKNOWN)
+                type = DT_DIR;
+          }
+
+          walk->path[path_len] = '/';
+          memcpy(walk->path + path_len + 1, d->d_name, name_len + 1);
+          if (type == DT_DIR)
+          {
+              if ((fd = openat(dir_fd, d->d_name,
+                               O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) != -1)
+              {
+                  walk_dir(walk, fd, path_len + 1 + name_len);
+                  close(fd);
+              }
+          }
+          else if (type == DT_REG &&
+                   (fd = openat(dir_fd, d->d_name, O_RDONLY)) != -1)
+          {
+              if (walk_is_mp3(fd))
+              {
+                  ++walk->n_found;
+                  walk->fn(walk->path, walk->arg);
+              }
+              close(fd);
+          }
+          walk->path[path_len] = '\0';
+      }
+
+    free(buf);
+}
+
+
+long walk_tree(const char *root, walk_fn_t fn, void *arg)
+{
+    int     fd;
+    long    n_found;
+    size_t  len;
+    walk_t *walk;
+
+    if ((fd = open(root, O_RDONLY | O_DIRECTORY)) == -1)
+      return -1;
+
+    walk = malloc(sizeof(walk_t));
+    walk->fn = fn;
+    walk->arg = arg;
+    walk->n_found = 0;
+
+    /* Paths are reported under 'root' as given, less any trailing '/' */
+    len = strlen(root);
+    while (len > 0 && root[len-1] == '/')
+      --len;
+    if (len >= sizeof(walk->path))
+      len = sizeof(walk->path) - 1;
+    memcpy(walk->path, root, len);
+    walk->path[len] = '\0';
+
+    walk_dir(walk, fd, len);
+    close(fd);
+
+    n_found = walk->n_found;
+    free(walk);
+
+    return n_found;
+}
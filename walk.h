@@ -0,0 +1,48 @@
+/******************************************************************************
+ * walk.h
+ *
+ * mp3nema - MP3 analysis and data hiding utility
+ *
+ * Copyright (C) 2009 Matt Davis (enferex) of 757Labs (www.757labs.com)
+ *
+ * walk.h is part of mp3nema.
+ * mp3nema is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mp3nema is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mp3nema.  If not, see <http://www.gnu.org/licenses/>.
+ *****************************************************************************/
+#ifndef WALK_H_INCLUDE
+#define WALK_H_INCLUDE
+
+
+/* Bytes read from the start of a file to decide if it is an mp3 */
+#define WALK_SNIFF_SZ 4096
+
+
+/* Called for each mp3 found, 'path' is only valid during the call */
+typedef void (*walk_fn_t)(const char *path, void *arg);
+
+
+/* Returns 1 if the file starts with an ID3v2 tag, or with two frames (MPEG
+ * audio or ADTS AAC) that follow each other within the first WALK_SNIFF_SZ
+ * bytes
+ */
+extern int walk_is_mp3(int fd);
+
+/* Recursively walk 'root', calling 'fn' for each mp3 as soon as it is found
+ * (by content, not by name).  Symbolic links to files are followed, links to
+ * directories are not.  Returns the number of mp3s found, or -1 if 'root'
+ * could not be opened.
+ */
+extern long walk_tree(const char *root, walk_fn_t fn, void *arg);
+
+
+#endif /* WALK_H_INCLUDE */